@@ -0,0 +1,34 @@
+#!/bin/sh
+# Runs the same constant-rate load with workers left to the scheduler and pinned to CPUs,
+# and prints latency percentiles, so the effect of cpu_affinity on the tail can be compared.
+#
+# usage: bench/affinity.sh [config]
+# RATE is requests/sec of bin/bench (make bench-load), it should be below the saturation point;
+# AFFINITY lists cpu_affinity values to compare.
+
+CONFIG=${1:-etc/httpd.conf}
+PORT=${PORT:-$(awk '$1 == "port" { print $2 }' "$CONFIG")}
+DURATION=${DURATION:-30}
+RATE=${RATE:-20000}
+AFFINITY=${AFFINITY:-"off auto"}
+
+for affinity in $AFFINITY; do
+    conf=$(mktemp)
+    grep -v '^cpu_affinity' "$CONFIG" > "$conf"
+    echo "cpu_affinity $affinity" >> "$conf"
+    bin/server -c "$conf" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+
+    bin/bench -t2 -c100 -d$DURATION -R$RATE 127.0.0.1:$PORT / | awk -v a="$affinity" '
+        $1 == "50.000%" { p50 = $2 }
+        $1 == "99.000%" { p99 = $2 }
+        $1 == "99.900%" { p999 = $2 }
+        $1 == "99.990%" { p9999 = $2 }
+        $1 == "Requests/sec:" { rps = $2 }
+        END { printf "%-10s %10.0f req/s  p50 %8s  p99 %8s  p99.9 %8s  p99.99 %8s\n", a, rps, p50, p99, p999, p9999 }'
+
+    kill $pid
+    wait $pid 2> /dev/null
+    rm -f "$conf"
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs the same load against libevent and io_uring backends and prints req/s together with
+# context switches and read/write syscalls per request taken from /proc of the server.
+#
+# usage: bench/backends.sh [config]
+# LOAD is a load generator command printing requests count on its last line,
+# by default bin/bench (make bench-load) is used against PORT.
+
+CONFIG=${1:-etc/httpd.conf}
+PORT=${PORT:-$(awk '$1 == "port" { print $2 }' "$CONFIG")}
+DURATION=${DURATION:-10}
+LOAD=${LOAD:-"bin/bench -t2 -c100 -d$DURATION 127.0.0.1:$PORT / | awk '/requests in/ { print \$1 }'"}
+
+proc_sum() {
+    keys=$1
+    shift
+    awk -v keys="$keys" 'BEGIN { n = split(keys, k, " ") } { for (i = 1; i <= n; i++) if ($1 == k[i] ":") s += $2 } END { print s + 0 }' "$@"
+}
+
+for backend in libevent io_uring; do
+    conf=$(mktemp)
+    grep -v '^io_backend' "$CONFIG" > "$conf"
+    echo "io_backend $backend" >> "$conf"
+    bin/server -c "$conf" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+
+    cs0=$(proc_sum "voluntary_ctxt_switches nonvoluntary_ctxt_switches" /proc/$pid/task/*/status)
+    sc0=$(proc_sum "syscr syscw" /proc/$pid/io)
+    start=$(date +%s.%N)
+    requests=$(sh -c "$LOAD" | tail -n 1)
+    end=$(date +%s.%N)
+    cs1=$(proc_sum "voluntary_ctxt_switches nonvoluntary_ctxt_switches" /proc/$pid/task/*/status)
+    sc1=$(proc_sum "syscr syscw" /proc/$pid/io)
+
+    kill $pid
+    wait $pid 2> /dev/null
+    rm -f "$conf"
+
+    awk -v b=$backend -v r="$requests" -v t0=$start -v t1=$end -v cs=$((cs1 - cs0)) -v sc=$((sc1 - sc0)) 'BEGIN {
+        if (r == 0) { print b ": no requests done"; exit }
+        printf "%-9s %10.0f req/s %8.3f ctxsw/req %8.3f rw syscalls/req\n", b, r / (t1 - t0), cs / r, sc / r
+    }'
+done
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Runs the same constant-rate load over files with cold page cache with file system calls done
+# in workers and offloaded to I/O threads, and prints request latency together with loop lag
+# from /_status, so stalls of event loops on disk can be compared.
+#
+# usage: bench/iostall.sh config urls-file
+# URLs file is `[weight] path` per line for bin/bench (make bench-load), it should list many files
+# of document root; page cache is dropped before every run, so it needs root.
+# RATE is requests/sec, IO_THREADS lists io_threads values to compare.
+
+CONFIG=$1
+URLS=$2
+PORT=${PORT:-$(awk '$1 == "port" { print $2 }' "$CONFIG")}
+DURATION=${DURATION:-30}
+RATE=${RATE:-2000}
+IO_THREADS=${IO_THREADS:-"0 2"}
+
+# lag_percentiles prints p50, p99 and p99.9 upper bounds of loop lag histogram summed over workers
+lag_percentiles() {
+    curl -s "127.0.0.1:$PORT/_status" | awk '
+        /^httpd_loop_lag_seconds_bucket/ {
+            split($1, le, "\""); n++; bound[n] = le[2]; count[n] = $2
+        }
+        END {
+            total = count[n]
+            split("0.5 0.99 0.999", q, " ")
+            for (i = 1; i <= 3; i++) {
+                for (b = 1; b <= n && count[b] < q[i] * total; b++) {}
+                printf "  lag p%s %8.3fms", q[i] * 100, bound[b] * 1000
+            }
+        }'
+}
+
+for threads in $IO_THREADS; do
+    conf=$(mktemp)
+    grep -v '^io_threads' "$CONFIG" > "$conf"
+    echo "io_threads $threads" >> "$conf"
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    bin/server -c "$conf" > /dev/null 2>&1 &
+    pid=$!
+    sleep 1
+
+    printf "io_threads %-3s" "$threads"
+    bin/bench -t2 -c100 -d$DURATION -R$RATE -u "$URLS" 127.0.0.1:$PORT | awk '
+        $1 == "50.000%" { p50 = $2 }
+        $1 == "99.000%" { p99 = $2 }
+        $1 == "99.900%" { p999 = $2 }
+        $1 == "Requests/sec:" { rps = $2 }
+        END { printf " %8.0f req/s  p50 %8s  p99 %8s  p99.9 %8s", rps, p50, p99, p999 }'
+    lag_percentiles
+    echo
+
+    kill $pid
+    wait $pid 2> /dev/null
+    rm -f "$conf"
+done
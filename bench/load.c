@@ -0,0 +1,708 @@
+// load generator: wrk-style HTTP benchmark on libevent with closed loop and constant rate modes.
+// Usage: bin/bench [-t threads] [-c connections] [-d seconds] [-R requests/s] [-m mode] [-T timeout]
+//                  [-u urls file] [host:]port [path...]
+//
+// Closed loop sends the next request on a connection as soon as the previous response arrives,
+// like wrk. With -R every connection sends at constant rate and latency is counted from the time
+// request was scheduled, not sent, so a stalled server can't hide its stall (coordinated omission).
+// Modes: keepalive reuses connections, close asks server to close after every response,
+// reconnect closes from client side after every response. Connect time is part of latency then.
+// URLs file has `[weight] path` per line, paths on command line have weight 1.
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_URLS 4096
+#define MAX_RESPONSE_HEADERS (64 * 1024)
+#define CONNECT_RETRY_DELAY_NS 10000000 // don't spin when server refuses connections
+
+enum mode {
+    MODE_KEEPALIVE = 0,
+    MODE_CLOSE,
+    MODE_RECONNECT,
+};
+
+static const char *mode_names[] = { "keepalive", "close", "reconnect" };
+
+//
+// histogram
+//
+
+// log-linear buckets like HdrHistogram: values below 2^(HIST_SUB_BITS + 1) are exact,
+// above it every power of two is split into HIST_SUB buckets, so relative error is below 1%
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((65 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} histogram;
+
+static int hist_index(uint64_t value) {
+    int msb = 63 - __builtin_clzll(value | 1);
+    if (msb < HIST_SUB_BITS) {
+        return (int)value;
+    }
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) - HIST_SUB);
+}
+
+// hist_value returns the highest value which falls into bucket.
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB) {
+        return index;
+    }
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t low = ((uint64_t)(index & (HIST_SUB - 1)) + HIST_SUB) << shift;
+    return low + ((uint64_t)1 << shift) - 1;
+}
+
+static void hist_record(histogram *h, uint64_t value) {
+    h->counts[hist_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+static void hist_merge(histogram *dst, const histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+static uint64_t hist_percentile(const histogram *h, double percentile) {
+    uint64_t rank = (uint64_t)(percentile / 100 * h->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += h->counts[i]) >= rank) {
+            uint64_t value = hist_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+//
+// load
+//
+
+typedef struct url {
+    char *request;
+    size_t request_len;
+    unsigned long weight_end; // cumulative weight
+} url;
+
+static struct {
+    int threads;
+    int connections;
+    double duration;
+    double rate; // requests per second over all connections, 0 is closed loop
+    double timeout;
+    int mode;
+
+    struct sockaddr_in addr;
+    char host[256];
+
+    url urls[MAX_URLS];
+    int urls_len;
+    unsigned long weight_total;
+} options = {
+    .threads = 2,
+    .connections = 10,
+    .duration = 10,
+    .timeout = 5,
+};
+
+typedef struct load_thread load_thread;
+
+typedef struct conn {
+    load_thread *thread;
+    struct bufferevent *bev;
+    struct event *timer; // fires when the next request is due or connect is retried
+    int connected;
+
+    int in_flight;
+    uint64_t start; // latency origin: scheduled time with -R, send or connect time otherwise
+    uint64_t next; // scheduled time of the next request with -R
+
+    int headers_done;
+    int status;
+    int server_closes;
+    size_t body_left;
+} conn;
+
+struct load_thread {
+    pthread_t thread;
+    struct event_base *base;
+    conn *conns;
+    int conns_len;
+    uint64_t rng;
+    uint64_t interval; // ns between requests of one connection with -R
+    int stopping;
+
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t status[6]; // by first digit, 0 is anything unparsable
+    uint64_t connect_errors;
+    uint64_t read_errors;
+    uint64_t timeouts;
+    histogram latency;
+};
+
+static void conn_request(conn *c);
+static void conn_read_cb(struct bufferevent *bev, void *arg);
+static void conn_event_cb(struct bufferevent *bev, short events, void *arg);
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static const url *pick_url(load_thread *t) {
+    if (options.urls_len == 1) {
+        return &options.urls[0];
+    }
+    unsigned long point = xorshift(&t->rng) % options.weight_total;
+    int lo = 0, hi = options.urls_len - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (options.urls[mid].weight_end > point) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return &options.urls[lo];
+}
+
+static int conn_open(conn *c) {
+    c->bev = bufferevent_socket_new(c->thread->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    if (c->bev == NULL) {
+        return -1;
+    }
+    struct timeval timeout = {
+        .tv_sec = (time_t)options.timeout,
+        .tv_usec = (suseconds_t)((options.timeout - (time_t)options.timeout) * 1e6),
+    };
+    bufferevent_set_timeouts(c->bev, &timeout, &timeout);
+    bufferevent_setcb(c->bev, conn_read_cb, NULL, conn_event_cb, c);
+    bufferevent_enable(c->bev, EV_READ | EV_WRITE);
+    c->connected = 0;
+    if (bufferevent_socket_connect(c->bev, (struct sockaddr *)&options.addr, sizeof(options.addr)) < 0) {
+        bufferevent_free(c->bev);
+        c->bev = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_close(conn *c) {
+    if (c->bev != NULL) {
+        bufferevent_free(c->bev);
+        c->bev = NULL;
+    }
+    c->in_flight = 0;
+}
+
+// conn_schedule arranges the next request: right away in closed loop, at its time with -R.
+static void conn_schedule(conn *c, uint64_t delay) {
+    load_thread *t = c->thread;
+    if (t->stopping) {
+        return;
+    }
+    uint64_t now = now_ns();
+    uint64_t due = now + delay;
+    if (t->interval > 0) {
+        c->next += t->interval;
+        if (c->next > due) {
+            due = c->next;
+        }
+    }
+    if (due <= now) {
+        conn_request(c);
+        return;
+    }
+    struct timeval tv = { .tv_sec = (due - now) / 1000000000, .tv_usec = (due - now) % 1000000000 / 1000 };
+    evtimer_add(c->timer, &tv);
+}
+
+static void conn_timer_cb(evutil_socket_t fd, short events, void *arg) {
+    (void)fd;
+    (void)events;
+    conn_request(arg);
+}
+
+// conn_request sends request, connecting first if needed: bufferevent keeps the request until connected.
+static void conn_request(conn *c) {
+    load_thread *t = c->thread;
+    uint64_t now = now_ns();
+    c->start = t->interval > 0 && c->next < now ? c->next : now; // timer may fire a bit early
+    if (c->bev == NULL && conn_open(c) < 0) {
+        t->connect_errors++;
+        conn_schedule(c, CONNECT_RETRY_DELAY_NS);
+        return;
+    }
+
+    const url *u = pick_url(t);
+    if (bufferevent_write(c->bev, u->request, u->request_len) < 0) {
+        t->read_errors++;
+        conn_close(c);
+        conn_schedule(c, 0);
+        return;
+    }
+    c->in_flight = 1;
+    c->headers_done = 0;
+}
+
+static void conn_done(conn *c) {
+    load_thread *t = c->thread;
+    hist_record(&t->latency, now_ns() - c->start);
+    t->requests++;
+    t->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+    c->in_flight = 0;
+    if (options.mode != MODE_KEEPALIVE || c->server_closes) {
+        conn_close(c);
+    }
+    conn_schedule(c, 0);
+}
+
+// parse_headers reads status and what's needed to find response end, returns -1 if response is malformed.
+static int parse_headers(conn *c, const char *headers, size_t len) {
+    if (len < 12 || memcmp(headers, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    c->status = atoi(headers + 9);
+    c->body_left = 0;
+    c->server_closes = headers[7] == '0';
+
+    const char *end = headers + len;
+    for (const char *line = memchr(headers, '\n', len); line != NULL && line + 1 < end;
+            line = memchr(line + 1, '\n', end - line - 1)) {
+        const char *name = line + 1;
+        size_t left = end - name;
+        if (left > 15 && strncasecmp(name, "Content-Length:", 15) == 0) {
+            c->body_left = strtoull(name + 15, NULL, 10);
+        } else if (left > 11 && strncasecmp(name, "Connection:", 11) == 0) {
+            const char *value = name + 11;
+            while (*value == ' ') {
+                value++;
+            }
+            if (end - value >= 5 && strncasecmp(value, "close", 5) == 0) {
+                c->server_closes = 1;
+            } else if (end - value >= 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+                c->server_closes = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static void conn_read_cb(struct bufferevent *bev, void *arg) {
+    conn *c = arg;
+    load_thread *t = c->thread;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    if (!c->in_flight) {
+        evbuffer_drain(input, evbuffer_get_length(input)); // nothing was asked
+        return;
+    }
+    if (!c->headers_done) {
+        struct evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+        if (end.pos < 0) {
+            if (evbuffer_get_length(input) > MAX_RESPONSE_HEADERS) {
+                t->read_errors++;
+                conn_close(c);
+                conn_schedule(c, 0);
+            }
+            return;
+        }
+        size_t headers_len = end.pos + 4;
+        const char *headers = (const char *)evbuffer_pullup(input, headers_len);
+        if (headers == NULL || parse_headers(c, headers, headers_len) < 0) {
+            t->read_errors++;
+            conn_close(c);
+            conn_schedule(c, 0);
+            return;
+        }
+        t->bytes += headers_len;
+        evbuffer_drain(input, headers_len);
+        c->headers_done = 1;
+    }
+
+    size_t len = evbuffer_get_length(input);
+    size_t body = len < c->body_left ? len : c->body_left;
+    evbuffer_drain(input, body);
+    t->bytes += body;
+    c->body_left -= body;
+    if (c->body_left == 0) {
+        conn_done(c); // may free bev, so it's the last thing to do
+    }
+}
+
+static void conn_event_cb(struct bufferevent *bev, short events, void *arg) {
+    conn *c = arg;
+    load_thread *t = c->thread;
+    if (events & BEV_EVENT_CONNECTED) {
+        int on = 1;
+        setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        c->connected = 1;
+        return;
+    }
+
+    uint64_t delay = 0;
+    if (!c->connected) {
+        t->connect_errors++;
+        delay = CONNECT_RETRY_DELAY_NS;
+    } else if (c->in_flight) {
+        if (events & BEV_EVENT_TIMEOUT) {
+            t->timeouts++;
+        } else {
+            t->read_errors++;
+        }
+    } else {
+        conn_close(c); // idle connection closed by server, next request reconnects
+        return;
+    }
+    conn_close(c);
+    conn_schedule(c, delay);
+}
+
+static void stop_cb(evutil_socket_t fd, short events, void *arg) {
+    (void)fd;
+    (void)events;
+    load_thread *t = arg;
+    t->stopping = 1;
+    event_base_loopbreak(t->base);
+}
+
+static void *load_thread_run(void *arg) {
+    load_thread *t = arg;
+    struct timeval duration = {
+        .tv_sec = (time_t)options.duration,
+        .tv_usec = (suseconds_t)((options.duration - (time_t)options.duration) * 1e6),
+    };
+    struct event *stop = evtimer_new(t->base, stop_cb, t);
+    evtimer_add(stop, &duration);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < t->conns_len; i++) {
+        conn *c = &t->conns[i];
+        // with -R connections are spread over the interval instead of firing together
+        c->next = start + t->interval * i / t->conns_len;
+        if (t->interval > 0 && i > 0) {
+            c->next -= t->interval; // conn_schedule adds one interval back
+            conn_schedule(c, 0);
+        } else {
+            conn_request(c);
+        }
+    }
+    event_base_dispatch(t->base);
+
+    for (int i = 0; i < t->conns_len; i++) {
+        conn_close(&t->conns[i]);
+        event_free(t->conns[i].timer);
+    }
+    event_free(stop);
+    return NULL;
+}
+
+//
+// setup and report
+//
+
+static int add_url(const char *path, unsigned long weight) {
+    if (options.urls_len == MAX_URLS) {
+        fprintf(stderr, "Too many urls, at most %d\n", MAX_URLS);
+        return -1;
+    }
+    if (weight == 0) {
+        return 0;
+    }
+    const char *connection = options.mode == MODE_CLOSE ? "Connection: close\r\n" : "";
+    url *u = &options.urls[options.urls_len];
+    int len = snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: bench\r\n%s\r\n",
+        path, options.host, connection);
+    if ((u->request = malloc(len + 1)) == NULL) {
+        perror("Url allocate error");
+        return -1;
+    }
+    snprintf(u->request, len + 1, "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: bench\r\n%s\r\n",
+        path, options.host, connection);
+    u->request_len = len;
+    options.weight_total += weight;
+    u->weight_end = options.weight_total;
+    options.urls_len++;
+    return 0;
+}
+
+static int load_urls(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Urls `%s` read error: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *save;
+        char *first = strtok_r(line, " \t\r\n", &save);
+        if (first == NULL || first[0] == '#') {
+            continue;
+        }
+        char *second = strtok_r(NULL, " \t\r\n", &save);
+        int r = second == NULL ? add_url(first, 1) : add_url(second, strtoul(first, NULL, 10));
+        if (r < 0) {
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int parse_target(const char *target) {
+    char host[256] = "127.0.0.1";
+    const char *port = strrchr(target, ':');
+    if (port != NULL) {
+        size_t host_len = port - target;
+        if (host_len >= sizeof(host)) {
+            fprintf(stderr, "Host is too long\n");
+            return -1;
+        }
+        memcpy(host, target, host_len);
+        host[host_len] = '\0';
+        port++;
+    } else {
+        port = target;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int r = getaddrinfo(host, port, &hints, &res);
+    if (r != 0) {
+        fprintf(stderr, "Cannot resolve %s: %s\n", target, gai_strerror(r));
+        return -1;
+    }
+    memcpy(&options.addr, res->ai_addr, sizeof(options.addr));
+    freeaddrinfo(res);
+    snprintf(options.host, sizeof(options.host), "%s:%s", host, port);
+    return 0;
+}
+
+static const char *format_ns(char *dst, size_t cap, double ns) {
+    if (ns < 1e3) {
+        snprintf(dst, cap, "%.0fns", ns);
+    } else if (ns < 1e6) {
+        snprintf(dst, cap, "%.2fus", ns / 1e3);
+    } else if (ns < 1e9) {
+        snprintf(dst, cap, "%.2fms", ns / 1e6);
+    } else {
+        snprintf(dst, cap, "%.2fs", ns / 1e9);
+    }
+    return dst;
+}
+
+static const char *format_bytes(char *dst, size_t cap, double bytes) {
+    if (bytes < 1024) {
+        snprintf(dst, cap, "%.0fB", bytes);
+    } else if (bytes < 1024 * 1024) {
+        snprintf(dst, cap, "%.2fKB", bytes / 1024);
+    } else if (bytes < 1024 * 1024 * 1024) {
+        snprintf(dst, cap, "%.2fMB", bytes / (1024 * 1024));
+    } else {
+        snprintf(dst, cap, "%.2fGB", bytes / (1024 * 1024 * 1024));
+    }
+    return dst;
+}
+
+static void print_usage() {
+    fprintf(stderr, "Usage:\nbin/bench [-t threads] [-c connections] [-d seconds] [-R requests/s] "
+        "[-m keepalive|close|reconnect] [-T timeout] [-u urls file] [host:]port [path...]\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *urls_file = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:R:m:T:u:")) != -1) {
+        switch (opt) {
+            case 't':
+                options.threads = atoi(optarg);
+                break;
+            case 'c':
+                options.connections = atoi(optarg);
+                break;
+            case 'd':
+                options.duration = atof(optarg);
+                break;
+            case 'R':
+                options.rate = atof(optarg);
+                break;
+            case 'T':
+                options.timeout = atof(optarg);
+                break;
+            case 'u':
+                urls_file = optarg;
+                break;
+            case 'm':
+                for (options.mode = 0; options.mode < 3; options.mode++) {
+                    if (strcmp(optarg, mode_names[options.mode]) == 0) {
+                        break;
+                    }
+                }
+                if (options.mode == 3) {
+                    print_usage();
+                    return 1;
+                }
+                break;
+            default:
+                print_usage();
+                return 1;
+        }
+    }
+    if (optind == argc || options.threads <= 0 || options.connections <= 0 || options.duration <= 0 ||
+            options.timeout <= 0 || options.rate < 0) {
+        print_usage();
+        return 1;
+    }
+    if (options.connections < options.threads) {
+        options.threads = options.connections;
+    }
+    if (parse_target(argv[optind]) < 0) {
+        return 1;
+    }
+    for (int i = optind + 1; i < argc; i++) {
+        if (add_url(argv[i], 1) < 0) {
+            return 1;
+        }
+    }
+    if (urls_file != NULL && load_urls(urls_file) < 0) {
+        return 1;
+    }
+    if (options.urls_len == 0 && add_url("/", 1) < 0) {
+        return 1;
+    }
+
+    load_thread *threads = calloc(options.threads, sizeof(load_thread));
+    conn *conns = calloc(options.connections, sizeof(conn));
+    if (threads == NULL || conns == NULL) {
+        perror("Allocate error");
+        return 1;
+    }
+    for (int i = 0, first = 0; i < options.threads; i++) {
+        load_thread *t = &threads[i];
+        t->conns = conns + first;
+        t->conns_len = options.connections / options.threads + (i < options.connections % options.threads);
+        first += t->conns_len;
+        t->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (options.rate > 0) {
+            t->interval = (uint64_t)(1e9 * options.connections / options.rate);
+        }
+        // default timers use coarse clock which is too rough for -R
+        struct event_config *config = event_config_new();
+        if (config == NULL || event_config_set_flag(config, EVENT_BASE_FLAG_PRECISE_TIMER) < 0 ||
+                (t->base = event_base_new_with_config(config)) == NULL) {
+            fprintf(stderr, "Cannot create event base\n");
+            return 1;
+        }
+        event_config_free(config);
+        for (int j = 0; j < t->conns_len; j++) {
+            t->conns[j].thread = t;
+            if ((t->conns[j].timer = evtimer_new(t->base, conn_timer_cb, &t->conns[j])) == NULL) {
+                fprintf(stderr, "Cannot create timer\n");
+                return 1;
+            }
+        }
+    }
+
+    printf("Running %gs test @ %s\n", options.duration, options.host);
+    printf("  %d threads and %d connections, %s, %s, %d urls\n", options.threads, options.connections,
+        options.rate > 0 ? "constant rate" : "closed loop", mode_names[options.mode], options.urls_len);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < options.threads; i++) {
+        if (pthread_create(&threads[i].thread, NULL, load_thread_run, &threads[i]) != 0) {
+            perror("Thread creation error");
+            return 1;
+        }
+    }
+    histogram *latency = calloc(1, sizeof(histogram));
+    uint64_t requests = 0, bytes = 0, status[6] = { 0 }, connect_errors = 0, read_errors = 0, timeouts = 0;
+    for (int i = 0; i < options.threads; i++) {
+        load_thread *t = &threads[i];
+        pthread_join(t->thread, NULL);
+        hist_merge(latency, &t->latency);
+        requests += t->requests;
+        bytes += t->bytes;
+        for (int j = 0; j < 6; j++) {
+            status[j] += t->status[j];
+        }
+        connect_errors += t->connect_errors;
+        read_errors += t->read_errors;
+        timeouts += t->timeouts;
+        event_base_free(t->base);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    char a[32], b[32];
+    if (latency->total > 0) {
+        printf("  Latency   mean %s   max %s\n", format_ns(a, sizeof(a), latency->sum / latency->total),
+            format_ns(b, sizeof(b), latency->max));
+        printf("  Latency Distribution (HdrHistogram - %s)\n",
+            options.rate > 0 ? "Recorded Latency, corrected for coordinated omission" : "Recorded Latency");
+        static const double percentiles[] = { 50, 75, 90, 99, 99.9, 99.99, 99.999, 100 };
+        for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+            printf(" %7.3f%%  %s\n", percentiles[i], format_ns(a, sizeof(a), hist_percentile(latency, percentiles[i])));
+        }
+    }
+    printf("  Responses: 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, other %lu\n", (unsigned long)status[2],
+        (unsigned long)status[3], (unsigned long)status[4], (unsigned long)status[5],
+        (unsigned long)(status[0] + status[1]));
+    if (connect_errors + read_errors + timeouts > 0) {
+        printf("  Socket errors: connect %lu, read %lu, timeout %lu\n", (unsigned long)connect_errors,
+            (unsigned long)read_errors, (unsigned long)timeouts);
+    }
+    printf("  %lu requests in %.2fs, %s read\n", (unsigned long)requests, elapsed, format_bytes(a, sizeof(a), bytes));
+    printf("Requests/sec: %.2f\n", requests / elapsed);
+    printf("Transfer/sec: %s\n", format_bytes(a, sizeof(a), bytes / elapsed));
+
+    free(latency);
+    free(conns);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,254 @@
+// request hot path microbenchmarks over browser requests from bench/corpus.
+// Prints one line per function and sample in Go benchmark format, so runs can be compared with benchstat:
+//   BenchmarkUrlDecode/chrome_html.http  200000  41.3 ns/op  0.00 allocs/op
+// Usage: bin/micro_bench [-n iterations] [corpus files...]
+//
+// Steps of request handling come from http_internal.h; allocations are counted by wrapping
+// malloc and friends at link time (see bench-micro in Makefile).
+#include "http.h"
+#include "http_internal.h"
+#include "mime.h"
+#include "scan.h"
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ITERATIONS 200000
+#define DEFAULT_CORPUS "bench/corpus/*.http"
+#define DEFAULT_MIME_TYPES "etc/mime.types"
+#define STATIC_ROOT "/var/www/html"
+
+static unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_aligned_alloc(size_t alignment, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    allocs++;
+    return __real_realloc(ptr, size);
+}
+
+void *__wrap_aligned_alloc(size_t alignment, size_t size) {
+    allocs++;
+    return __real_aligned_alloc(alignment, size);
+}
+
+typedef struct sample {
+    const char *name;
+    char *data;
+    size_t len;
+    http_request request;
+} sample;
+
+typedef struct bench_ctx {
+    const sample *s;
+    http_pools *pools;
+    file_entry *file;
+} bench_ctx;
+
+static volatile size_t sink; // keeps results alive
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int load_sample(sample *s, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    s->name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    s->data = malloc(len);
+    s->len = fread(s->data, 1, len, f);
+    fclose(f);
+
+    http_parser parser;
+    http_parser_init(&parser, 0);
+    if (http_parser_execute(&parser, s->data, s->len) != HTTP_PARSE_DONE) {
+        fprintf(stderr, "%s: not a complete request\n", path);
+        return -1;
+    }
+    s->request = parser.request;
+    return 0;
+}
+
+static void bench_parse(bench_ctx *ctx) {
+    http_parser parser;
+    http_parser_init(&parser, 0);
+    sink += http_parser_execute(&parser, ctx->s->data, ctx->s->len);
+}
+
+static void bench_url_decode(bench_ctx *ctx) {
+    char path[4096];
+    const http_slice *slice = &ctx->s->request.path;
+    if (slice->len < sizeof(path)) {
+        sink += http_url_decode(path, ctx->s->data + slice->off, slice->len);
+    }
+}
+
+static void bench_full_path(bench_ctx *ctx) {
+    const http_slice *slice = &ctx->s->request.path;
+    char *path = http_full_path(&ctx->pools->request, STATIC_ROOT, ctx->s->data + slice->off, slice->len);
+    sink += path != NULL ? (size_t)path[0] : 0;
+    arena_reset(&ctx->pools->request);
+}
+
+// bench_respond_ok assembles 200 headers for already rendered file block, like for a cached file
+static void bench_respond_ok(bench_ctx *ctx) {
+    http_response *response = http_response_new(ctx->pools);
+    response->keep_alive = 1;
+    http_respond_ok(response, ctx->file, 0);
+    sink += response->headers->len;
+    http_response_free(response);
+}
+
+static void bench_mime(bench_ctx *ctx) {
+    sink += (size_t)mime_type_of_path(ctx->file->path);
+}
+
+// bench_buffer_append copies request line by line into response-sized buffer, growing past it if needed
+static void bench_buffer_append(bench_ctx *ctx) {
+    char storage[HTTP_INITIAL_HEADERS_BUF_SIZE];
+    buffer buf;
+    buffer_init(&buf, storage, sizeof(storage));
+    buffer *b = &buf;
+    const char *data = ctx->s->data;
+    const char *end = data + ctx->s->len;
+    while (data < end) {
+        const char *eol = memchr(data, '\n', end - data);
+        size_t len = eol != NULL ? (size_t)(eol - data + 1) : (size_t)(end - data);
+        buffer_append_dynamically(&b, data, len);
+        data += len;
+    }
+    sink += b->len;
+    if (!b->external) {
+        free(b->data);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*run)(bench_ctx *ctx);
+} benchmarks[] = {
+    { "HttpParse", bench_parse },
+    { "UrlDecode", bench_url_decode },
+    { "CleanAndGetFullPath", bench_full_path },
+    { "RespondOkHeaders", bench_respond_ok },
+    { "MimeTypeOfPath", bench_mime },
+    { "BufferAppend", bench_buffer_append },
+};
+
+// sample_file makes file entry which looks like the requested one, nothing is opened
+static file_entry *sample_file(const sample *s) {
+    file_entry *file = calloc(1, sizeof(file_entry));
+    const http_slice *slice = &s->request.path;
+    file->path = malloc(sizeof(STATIC_ROOT) + slice->len + 1);
+    memcpy(file->path, STATIC_ROOT, sizeof(STATIC_ROOT) - 1);
+    memcpy(file->path + sizeof(STATIC_ROOT) - 1, s->data + slice->off, slice->len);
+    file->path[sizeof(STATIC_ROOT) - 1 + slice->len] = '\0';
+    file->path_len = strlen(file->path);
+    file->fd = -1;
+    file->size = 12345;
+    file->mtime = 1700000000;
+    file->ino = 424242;
+    file->mime_type = mime_type_of_path(file->path);
+    file->refcnt = 1;
+    file->clock_slot = -1;
+    return file;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = DEFAULT_ITERATIONS;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n' && (iterations = atol(optarg)) > 0) {
+            continue;
+        }
+        fprintf(stderr, "Usage: bin/micro_bench [-n iterations] [corpus files...]\n");
+        return 1;
+    }
+
+    glob_t g = { 0 };
+    char **paths = argv + optind;
+    int n = argc - optind;
+    if (n == 0) {
+        if (glob(DEFAULT_CORPUS, 0, NULL, &g) != 0) {
+            fprintf(stderr, "No corpus at %s\n", DEFAULT_CORPUS);
+            return 1;
+        }
+        paths = g.gl_pathv;
+        n = g.gl_pathc;
+    }
+
+    scan_init();
+    if (mime_init(access(DEFAULT_MIME_TYPES, R_OK) == 0 ? DEFAULT_MIME_TYPES : NULL) < 0) {
+        return 1;
+    }
+    http_date_update(time(NULL));
+    http_pools pools;
+    http_pools_init(&pools);
+
+    sample *samples = calloc(n, sizeof(sample));
+    for (int i = 0; i < n; i++) {
+        if (load_sample(&samples[i], paths[i]) < 0) {
+            return 1;
+        }
+    }
+
+    printf("goos: linux\n");
+    printf("scan: %s\n", scan_level_name(scan_init()));
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        for (int i = 0; i < n; i++) {
+            bench_ctx ctx = { .s = &samples[i], .pools = &pools, .file = sample_file(&samples[i]) };
+            // warm up: renders file headers once and fills pools, as in a running worker
+            for (int j = 0; j < 1000; j++) {
+                benchmarks[b].run(&ctx);
+            }
+
+            unsigned long allocs_before = allocs;
+            double start = now_ns();
+            for (long j = 0; j < iterations; j++) {
+                benchmarks[b].run(&ctx);
+            }
+            double ns = (now_ns() - start) / iterations;
+            double allocs_per_op = (double)(allocs - allocs_before) / iterations;
+
+            printf("Benchmark%s/%s\t%ld\t%.1f ns/op\t%.2f allocs/op\n", benchmarks[b].name, samples[i].name,
+                iterations, ns, allocs_per_op);
+
+            free(ctx.file->headers);
+            free(ctx.file->path);
+            free(ctx.file);
+        }
+    }
+
+    http_pools_destroy(&pools);
+    for (int i = 0; i < n; i++) {
+        free(samples[i].data);
+    }
+    free(samples);
+    globfree(&g);
+    return 0;
+}
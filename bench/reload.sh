@@ -0,0 +1,47 @@
+#!/bin/sh
+# Runs the same constant-rate load while the server is left alone and while it is reloaded
+# with a signal every few seconds, and prints latency percentiles with failed requests,
+# so the cost of a config reload or binary upgrade can be seen.
+#
+# usage: bench/reload.sh [config]
+# RATE is requests/sec of bin/bench (make bench-load), INTERVAL is seconds between signals;
+# SIGNALS lists what to compare: none, HUP (config reload) or USR2 (binary upgrade).
+
+CONFIG=${1:-etc/httpd.conf}
+PORT=${PORT:-$(awk '$1 == "port" { print $2 }' "$CONFIG")}
+DURATION=${DURATION:-30}
+RATE=${RATE:-20000}
+INTERVAL=${INTERVAL:-3}
+SIGNALS=${SIGNALS:-"none HUP USR2"}
+
+for signal in $SIGNALS; do
+    conf=$(mktemp)
+    cp "$CONFIG" "$conf"
+    bin/server -c "$conf" > /dev/null 2>&1 &
+    sleep 1
+
+    out=$(mktemp)
+    bin/bench -t2 -c100 -d$DURATION -R$RATE 127.0.0.1:$PORT / > "$out" &
+    load=$!
+    reloads=0
+    while kill -0 $load 2> /dev/null; do
+        sleep $INTERVAL
+        if [ "$signal" != none ] && kill -0 $load 2> /dev/null; then
+            kill -$signal "$(pgrep -n -f "bin/server -c $conf")" # the newest process serves
+            reloads=$((reloads + 1))
+        fi
+    done
+    awk -v s="$signal" -v n=$reloads '
+        $1 == "50.000%" { p50 = $2 }
+        $1 == "99.000%" { p99 = $2 }
+        $1 == "99.900%" { p999 = $2 }
+        $1 == "Requests/sec:" { rps = $2 }
+        $1 == "Socket" { split($0, e, /[ ,]+/); errors = e[5] + e[7] + e[9] }
+        END { printf "%-5s %3d reloads %10.0f req/s  p50 %8s  p99 %8s  p99.9 %8s  errors %d\n",
+            s, n, rps, p50, p99, p999, errors }' "$out"
+
+    sleep 1
+    pkill -f "bin/server -c $conf"
+    sleep 1
+    rm -f "$conf" "$out"
+done
@@ -0,0 +1,109 @@
+// scan benchmark: parses browser requests from bench/corpus with every scan implementation CPU supports.
+// Usage: bin/scan_bench [corpus files...]
+#include "parser.h"
+#include "scan.h"
+
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 200000
+#define DEFAULT_CORPUS "bench/corpus/*.http"
+
+typedef struct sample {
+    const char *name;
+    char *data;
+    size_t len;
+} sample;
+
+static volatile size_t sink; // keeps results alive
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int load_sample(sample *s, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    s->name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+    s->data = malloc(len);
+    s->len = fread(s->data, 1, len, f);
+    fclose(f);
+    return 0;
+}
+
+static double bench_parse(const sample *s) {
+    http_parser parser;
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        http_parser_init(&parser, 0);
+        sink += http_parser_execute(&parser, s->data, s->len);
+    }
+    return (now_ns() - start) / ITERATIONS;
+}
+
+static double bench_kernel(size_t (*kernel)(const char *, size_t), const sample *s) {
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        // skip to every stop like a caller would
+        for (size_t pos = 0; pos < s->len; pos++) {
+            pos += kernel(s->data + pos, s->len - pos);
+            sink += pos;
+        }
+    }
+    return (now_ns() - start) / ITERATIONS;
+}
+
+int main(int argc, char *argv[]) {
+    glob_t g = { 0 };
+    char **paths = argv + 1;
+    int n = argc - 1;
+    if (n == 0) {
+        if (glob(DEFAULT_CORPUS, 0, NULL, &g) != 0) {
+            fprintf(stderr, "No corpus at %s\n", DEFAULT_CORPUS);
+            return 1;
+        }
+        paths = g.gl_pathv;
+        n = g.gl_pathc;
+    }
+
+    sample *samples = calloc(n, sizeof(sample));
+    for (int i = 0; i < n; i++) {
+        if (load_sample(&samples[i], paths[i]) < 0) {
+            return 1;
+        }
+    }
+
+    printf("%-8s %-20s %6s %10s %10s %10s %10s\n", "level", "sample", "bytes", "parse ns", "ctl ns", "escape ns",
+        "parse MB/s");
+    for (int level = SCAN_SCALAR; level <= SCAN_AVX2; level++) {
+        if (scan_init_level(level) < 0) {
+            printf("%-8s not supported\n", scan_level_name(level));
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            double parse = bench_parse(&samples[i]);
+            double ctl = bench_kernel(scan.ctl, &samples[i]);
+            double escape = bench_kernel(scan.escape, &samples[i]);
+            printf("%-8s %-20s %6zu %10.1f %10.1f %10.1f %10.0f\n", scan_level_name(level), samples[i].name,
+                samples[i].len, parse, ctl, escape, samples[i].len / parse * 1e3);
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        free(samples[i].data);
+    }
+    free(samples);
+    globfree(&g);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include "http.h"
+#include "parser.h"
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+
+// Access log is written by a logger thread: workers put fixed-size records into their own
+// single-producer rings and never block, a record is dropped if the ring is full.
+// Logger drains all rings, formats records and writes them in batches.
+
+#define ACCESS_LOG_PATH_LEN 224 // longer paths are truncated, record takes 256 bytes
+#define ACCESS_LOG_RING_LEN 4096 // records per worker, power of two
+
+typedef struct access_log_record {
+    time_t time;
+    uint64_t bytes;
+    uint32_t duration_us;
+    uint32_t addr; // network byte order
+    uint16_t status;
+    uint8_t method;
+    uint8_t version_minor;
+    uint8_t path_len;
+    uint8_t path_truncated;
+    char path[ACCESS_LOG_PATH_LEN];
+} access_log_record;
+
+typedef struct access_log_ring {
+    // written by worker
+    size_t tail __attribute__((aligned(64)));
+    size_t head_cache; // last seen head, ring is reread only when it looks full
+    unsigned long requests; // for sampling
+
+    // written by logger
+    size_t head __attribute__((aligned(64)));
+
+    access_log_record records[ACCESS_LOG_RING_LEN] __attribute__((aligned(64)));
+} access_log_ring;
+
+// access_log_init starts logger thread appending to path, every sample-th successful response
+// is logged and all errors. Nothing is started if path is NULL.
+int access_log_init(const char *path, unsigned sample, int workers);
+
+// access_log_worker returns ring of i-th worker, NULL if access log is off.
+access_log_ring *access_log_worker(int i);
+
+// access_log_begin fills record with everything known when response is ready, so request bytes
+// can be released. Returns 0 if the request isn't sampled and shouldn't be logged.
+int access_log_begin(access_log_ring *ring, access_log_record *record, const struct sockaddr_in *address,
+    const char *raw_request, const http_request *request, const http_response *response);
+
+// access_log_end puts the record to the ring when response is written.
+// Returns -1 if ring is full and the record is dropped.
+int access_log_end(access_log_ring *ring, access_log_record *record, uint64_t start_ns, uint64_t now_ns);
+
+// access_log_stop writes what is left in the rings and stops logger.
+void access_log_stop();
+
+#endif // ACCESSLOG_H
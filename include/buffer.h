@@ -9,9 +9,11 @@ typedef struct buffer {
     char *data;
     size_t len;
     size_t cap;
+    int external; // data isn't owned by buffer, it's moved to malloc'ed memory when buffer grows
 } buffer;
 
 buffer *buffer_new(size_t capacity);
+void buffer_init(buffer *buf, char *data, size_t capacity); // buffer over external storage
 void buffer_free(buffer *buf);
 
 int buffer_append(buffer *buf, const char *data, size_t len);
@@ -1,14 +1,49 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stddef.h>
+
+enum cpu_affinity {
+    CPU_AFFINITY_OFF = 0, // scheduler places workers
+    CPU_AFFINITY_AUTO, // workers are pinned to allowed CPUs of the process in order
+    CPU_AFFINITY_LIST, // workers are pinned to cpus from config
+};
+
+// dispatch policy of accept thread, used without reuseport and io_uring
+enum dispatch_policy {
+    DISPATCH_ROUND_ROBIN = 0,
+    DISPATCH_LEAST_CONN, // least loaded of all workers
+    DISPATCH_P2C, // less loaded of two random workers
+};
+
 typedef struct serve_config {
     unsigned int addr;
     unsigned short port;
     int worker_num;
+    int reuseport; // every worker owns its own SO_REUSEPORT listening socket
+    int io_uring; // workers run io_uring loop instead of libevent
+    int dispatch;
+    int cpu_affinity;
+    int *cpus; // CPU_AFFINITY_LIST: worker i runs on cpus[i % cpus_len]
+    int cpus_len;
 
     char *static_root;
+    char *mime_types; // path of mime.types file, NULL if only built-in types are used
+
+    size_t cache_size; // in-memory content cache budget, bytes, 0 disables it
+    size_t cache_max_object; // bigger files are always sent from disk
+
+    size_t max_header_size; // request line and headers, bigger requests get 431
+
+    int io_threads; // per NUMA node, open() and disk reads are offloaded to them; 0 does them in workers
+
+    int shutdown_timeout; // seconds old workers finish in-flight responses for on stop or upgrade
+
+    char *access_log; // path, NULL if access log is off
+    unsigned access_log_sample; // every n-th successful response is logged, errors always are
 } serve_config;
 
 serve_config *parse_serve_config(const char *path);
+void free_serve_config(serve_config *cfg);
 
 #endif // CONFIG_H
@@ -1,11 +1,103 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-void file_open(const char *path, void **file, size_t *file_size);
-void file_close(void *file, size_t file_size);
+// precompressed variants of a file are served from sidecars next to it, e.g. app.js.br and app.js.gz
+enum file_encoding {
+    FILE_ENCODING_BR = 0,
+    FILE_ENCODING_GZIP,
+    FILE_ENCODINGS,
+};
 
-struct stat *file_get_info(const char *path);
+// file_headers_block is 200 response headers of a file without per-request lines. It's published
+// by one pointer store, so readers always see lengths which belong to the text.
+typedef struct file_headers_block {
+    size_t len;
+    size_t fields_off; // lines after Content-Length, shared with 206 responses
+    char data[];
+} file_headers_block;
+
+// file_entry is an opened regular file shared between workers by the file cache.
+// Everything except refcnt and lazily rendered headers is immutable after load,
+// so readers need no locking.
+typedef struct file_entry {
+    char *path; // key, full path
+    size_t path_len;
+    uint64_t hash;
+
+    int fd;
+    size_t size;
+    time_t mtime;
+    ino_t ino;
+    const char *mime_type; // looked up once by path extension, sidecars have type of the original
+    const char *encoding; // Content-Encoding of sidecar, NULL for plain file
+
+    file_headers_block *headers; // rendered by http layer on first use
+
+    // sidecars owned by the entry, looked up once on first use, see file_entry_encoded()
+    struct file_entry *encoded[FILE_ENCODINGS];
+    int encoded_resolved;
+
+    int refcnt; // table holds one reference while entry is cached
+    int cached; // entry is in the table, so it will be invalidated; its descriptor counts against the limit
+    struct file_entry *next; // hash chain
+    int table_slot; // in table CLOCK, -1 if entry isn't in the table
+    int table_referenced;
+
+    // content cache, protected by its lock except for lock-free reads of blob and referenced bit
+    struct file_blob *blob;
+    int clock_slot; // -1 if entry has no blob
+    int clock_referenced;
+
+    int warm; // body sent from disk has been read ahead by I/O thread, see file_warm()
+} file_entry;
+
+// file_blob is cached content of small file in one cache-line-aligned allocation.
+typedef struct file_blob {
+    int refcnt;
+    size_t size; // charged against cache budget
+
+    const char *body;
+    size_t body_len;
+
+    char data[] __attribute__((aligned(64)));
+} file_blob;
+
+typedef struct file_content_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t bytes;
+    size_t objects;
+} file_content_stats;
+
+int file_cache_init(const char *root);
+
+file_entry *file_cache_get(const char *path);
+file_entry *file_cache_find(const char *path);
+void file_cache_invalidate(const char *path);
+void file_cache_flush();
+
+void file_entry_ref(file_entry *entry);
+void file_entry_unref(file_entry *entry);
+file_entry *const *file_entry_encoded(file_entry *entry);
+int file_entry_encoded_resolved(const file_entry *entry);
+void file_stat_encoded(const char *path, struct stat stats[FILE_ENCODINGS]);
+
+void file_content_cache_init(size_t budget, size_t max_object);
+file_blob *file_content_get(file_entry *entry);
+int file_content_ready(const file_entry *entry);
+void file_content_stats_get(file_content_stats *stats);
+
+void file_warm(file_entry *entry, size_t offset, size_t len);
+
+file_blob *file_blob_new(const char *body, size_t len);
+void file_blob_ref(file_blob *blob);
+void file_blob_unref(file_blob *blob);
 
 #endif // FILE_H
@@ -2,20 +2,66 @@
 #define HTTP_H
 
 #include "buffer.h"
+#include "file.h"
+#include "parser.h"
+#include "pool.h"
 
+#include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
-const char *http_end_of_request;
+// request body is never used: body up to this size is dropped by the server before the next request
+// is read, so the connection stays open; a bigger one or one with Transfer-Encoding closes it
+#define HTTP_MAX_DISCARDED_BODY (64 * 1024)
+
+// connection closed with request body left unread is shut down for writing first, then client's data
+// is dropped until it closes too, for up to these seconds and bytes: closing with unread data resets
+// the connection, and client could lose the response it hasn't read yet
+#define HTTP_LINGER_TIMEOUT 2
+#define HTTP_LINGER_MAX_BYTES (1024 * 1024)
+
+// http_pools are per-worker allocators: response objects are reused together with their header
+// storage, temporary memory of http_handler comes from arena which is reset when it returns.
+typedef struct http_pools {
+    object_pool responses;
+    arena request;
+} http_pools;
 
 typedef struct http_response {
     buffer *headers;
-    char *body;
+
+    // body is either in-memory content of a small file or is sent straight from the cached file
+    // with sendfile(), response holds a reference to one of them
+    file_blob *body_blob;
+    file_entry *body_file;
+    off_t body_offset;
     size_t body_len;
+
+    int status; // taken from status line when headers are finished
+    int keep_alive; // connection should stay open after the response is written
+
+    http_pools *pools; // response returns to them when freed
+    buffer headers_buf;
+    char headers_data[];
 } http_response;
 
-http_response *http_handler(const buffer *raw_request, const char *static_root);
+// http_date_update refreshes Date header of the calling thread, workers call it every second.
+void http_date_update(time_t now);
+
+void http_pools_init(http_pools *pools);
+void http_pools_destroy(http_pools *pools);
+
+// http_handler builds response to the parsed request. If nonblocking is set and the request needs
+// file system (file isn't cached nor known to be missing, sidecars aren't resolved or body isn't warm),
+// NULL is returned with errno EWOULDBLOCK: http_prefetch() is to be run elsewhere and the request handled again.
+http_response *http_handler(const char *raw_request, const http_request *request, const char *static_root,
+    http_pools *pools, int nonblocking);
+
+// http_prefetch does blocking part of the request for I/O thread: opens the file into cache,
+// resolves its sidecars and loads the body into content cache or reads it ahead.
+void http_prefetch(const char *raw_request, const http_request *request, const char *static_root, arena *arena);
 
-http_response *http_response_new();
+http_response *http_response_new(http_pools *pools);
 void http_response_free(http_response *resp);
 
 #endif // HTTP_H
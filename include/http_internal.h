@@ -0,0 +1,25 @@
+#ifndef HTTP_INTERNAL_H
+#define HTTP_INTERNAL_H
+
+#include "file.h"
+#include "http.h"
+#include "pool.h"
+
+#include <stddef.h>
+
+// steps of request handling which aren't part of http.h, exposed for bench/micro.c
+
+#define HTTP_INITIAL_HEADERS_BUF_SIZE 1024 // headers stored inline in pooled response
+
+// http_url_decode decodes len bytes of src into dst, which must have len + 1 bytes.
+// Returns decoded length.
+size_t http_url_decode(char *dst, const char *src, size_t len);
+
+// http_full_path decodes request path right after static_root in one arena allocation.
+// Returns NULL with errno set to EACCES if path escapes root.
+char *http_full_path(arena *arena, const char *static_root, const char *path, size_t path_len);
+
+// http_respond_ok fills 200 response for file, its rendered headers block is reused.
+int http_respond_ok(http_response *response, file_entry *file, int with_body);
+
+#endif // HTTP_INTERNAL_H
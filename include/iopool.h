@@ -0,0 +1,47 @@
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include "parser.h"
+
+#include <sched.h>
+#include <stddef.h>
+
+// I/O pool keeps blocking file system calls off event loops. When http_handler() can't answer
+// without touching disk, worker copies the request into a job for the pool of its NUMA node.
+// Pool thread runs http_prefetch() for it and pushes the job back to the worker's completion
+// queue, waking the worker up through eventfd; worker then handles the request again, warm.
+
+typedef struct io_completions {
+    struct io_job *jobs; // done jobs pushed by pool threads, worker takes them all at once
+    int fd; // eventfd written when jobs become non-empty, watched by worker's loop
+} io_completions;
+
+typedef struct io_job {
+    struct io_job *next;
+    void *owner; // worker's connection, cleared by worker if it's closed meanwhile
+    io_completions *done;
+    const char *static_root;
+
+    http_request request;
+    size_t raw_len;
+    char raw[]; // request head, offsets of request point here
+} io_job;
+
+typedef struct io_pool io_pool;
+
+// io_pool_new starts threads running on cpus, wherever scheduler puts them if cpus is NULL.
+io_pool *io_pool_new(int threads, const cpu_set_t *cpus);
+void io_pool_free(io_pool *pool); // waits for queued jobs to finish
+
+// io_job_new copies request head of raw_len bytes for the pool, returns NULL if malloc fails.
+io_job *io_job_new(void *owner, io_completions *done, const char *static_root,
+    const char *raw, size_t raw_len, const http_request *request);
+void io_pool_submit(io_pool *pool, io_job *job);
+
+int io_completions_init(io_completions *done);
+void io_completions_destroy(io_completions *done);
+
+// io_completions_take returns done jobs, worker calls it when fd becomes readable and frees them.
+io_job *io_completions_take(io_completions *done);
+
+#endif // IOPOOL_H
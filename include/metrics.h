@@ -0,0 +1,98 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "buffer.h"
+#include "http.h"
+#include "pool.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_PATH "/_status" // reserved, never looked up in document root
+
+enum metrics_close_reason {
+    CLOSE_DONE = 0, // response without keep-alive is written
+    CLOSE_EOF, // client disconnected
+    CLOSE_TIMEOUT,
+    CLOSE_ERROR, // socket read or write error
+    CLOSE_INTERNAL, // server side failure: memory, queueing response and so on
+    CLOSE_REASONS,
+};
+
+#define METRICS_STATUSES 11 // tracked codes and the rest, see metrics_status_index()
+
+// every worker runs a timer with this interval, how late it fires is how long the loop was stalled
+#define METRICS_LOOP_LAG_INTERVAL_MS 10
+
+// latency histograms are log-linear over microseconds: exact up to 8us,
+// then every power of two is split into 4 buckets, up to 2 << 26 us (about 134 s);
+// the last bucket, 104, is past all of them and is rendered only as +Inf
+#define METRICS_HIST_SUB_BITS 2
+#define METRICS_HIST_MAX_BITS 26
+#define METRICS_HIST_BUCKETS (((METRICS_HIST_MAX_BITS - METRICS_HIST_SUB_BITS + 2) << METRICS_HIST_SUB_BITS) + 1)
+
+typedef struct metrics_histogram {
+    uint64_t counts[METRICS_HIST_BUCKETS];
+    uint64_t sum_us;
+} metrics_histogram;
+
+// worker_metrics belong to one worker which is the only writer, so counters are updated
+// without atomic read-modify-write; blocks of different workers never share a cache line.
+// Readers sum them on demand and may see values a moment old.
+typedef struct worker_metrics {
+    uint64_t accepted;
+    uint64_t closed[CLOSE_REASONS];
+    uint64_t requests[METRICS_STATUSES];
+    uint64_t parse_errors;
+    uint64_t bytes_sent;
+    uint64_t log_dropped; // access log records which didn't fit the ring
+    uint64_t io_offloaded; // requests which waited for I/O pool
+    metrics_histogram ttfb; // request start to the first response byte handed to the socket
+    metrics_histogram total; // request start to the last response byte handed to the socket
+    metrics_histogram loop_lag; // delay of the lag timer
+
+    // pools of the worker, read without locking for stats
+    const object_pool *clients;
+    const http_pools *http_pools;
+
+    // load published for dispatch, on a line of its own as accept thread reads it for every client
+    uint64_t load_active __attribute__((aligned(64))); // open connections
+    uint64_t load_queued_bytes; // bytes of responses which aren't written yet
+
+    // written by accept thread
+    uint64_t dispatched __attribute__((aligned(64)));
+    uint64_t dispatch_dropped; // worker's handoff ring was full
+} __attribute__((aligned(64))) worker_metrics;
+
+int metrics_init(int workers);
+worker_metrics *metrics_worker(int i);
+
+// metrics_add is increment by the owning worker: relaxed load and store compile to plain instructions
+// but keep readers from seeing torn values.
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_sub(uint64_t *gauge, uint64_t n) {
+    __atomic_store_n(gauge, __atomic_load_n(gauge, __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int metrics_status_index(int status);
+void metrics_observe(metrics_histogram *hist, uint64_t ns);
+
+// metrics_loop_lag counts delay of the lag timer armed at armed_ns, returns now to arm it again.
+uint64_t metrics_loop_lag(worker_metrics *m, uint64_t armed_ns);
+
+// metrics_request_done counts the written response which was started at start_ns.
+void metrics_request_done(worker_metrics *m, const http_response *response, uint64_t start_ns);
+
+// metrics_render appends all metrics summed over workers in Prometheus text format.
+int metrics_render(buffer **buf);
+
+#endif // METRICS_H
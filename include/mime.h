@@ -0,0 +1,19 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+
+#define MIME_DEFAULT_TYPE "application/octet-stream"
+
+// mime_init builds extension table from built-in types, then from mime.types file at path if it's not NULL.
+// File lines are `type ext...`, # starts a comment, later entries override earlier ones.
+// Table isn't changed after that, so lookups need no locking.
+int mime_init(const char *path);
+
+// mime_type_lookup finds type by extension without dot, case-insensitive. Returns NULL if unknown.
+const char *mime_type_lookup(const char *ext, size_t len);
+
+// mime_type_of_path returns type of file by extension of its last path component, never NULL.
+const char *mime_type_of_path(const char *path);
+
+#endif // MIME_H
@@ -0,0 +1,74 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+
+enum http_parse_result {
+    HTTP_PARSE_AGAIN = 0, // need more data
+    HTTP_PARSE_DONE,
+    HTTP_PARSE_ERROR,
+};
+
+typedef enum http_method {
+    HTTP_METHOD_UNKNOWN = 0,
+    HTTP_METHOD_GET,
+    HTTP_METHOD_HEAD,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_OPTIONS,
+    HTTP_METHOD_TRACE,
+    HTTP_METHOD_CONNECT,
+    HTTP_METHOD_PATCH,
+} http_method;
+
+// http_slice points into raw request by offset, so it survives buffer reallocation.
+typedef struct http_slice {
+    size_t off;
+    size_t len;
+} http_slice;
+
+typedef struct http_request {
+    http_method method;
+    int version_major;
+    int version_minor;
+    http_slice path;
+    http_slice query;
+
+    // headers we care about, len is 0 if header is absent
+    http_slice host;
+    http_slice connection;
+    http_slice range;
+    http_slice if_range;
+    http_slice if_none_match;
+    http_slice if_modified_since;
+    http_slice accept_encoding;
+
+    size_t content_length; // of request body, 0 if there is none
+    int has_content_length;
+    int transfer_encoding; // Transfer-Encoding is present, body ends only where its coding says
+    int connection_close; // Connection has close token
+    int connection_keep_alive; // Connection has keep-alive token
+    int malformed; // request can't be parsed, respond with 400
+    int too_large; // malformed because request line and headers exceed parser limit, respond with 431
+} http_request;
+
+// http_parser parses request incrementally: every call continues from where previous one stopped,
+// so each byte is scanned once however data is split between reads. Nothing is allocated.
+typedef struct http_parser {
+    int state;
+    size_t pos; // next byte to scan
+    size_t line_start;
+    size_t limit; // max length of request line and headers, 0 is unlimited
+
+    http_request request;
+} http_parser;
+
+void http_parser_init(http_parser *parser, size_t limit);
+const char *http_method_name(http_method method); // "-" for unknown
+
+// http_parser_execute continues parsing request which starts at data, len is all data received so far.
+// On HTTP_PARSE_DONE parser->pos is the length of request.
+int http_parser_execute(http_parser *parser, const char *data, size_t len);
+
+#endif // PARSER_H
@@ -0,0 +1,42 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Pools belong to one worker and are used only from its thread, so there is no locking.
+
+// object_pool keeps freed objects of one size for reuse instead of returning them to malloc.
+typedef struct object_pool {
+    size_t obj_size;
+    size_t max_free; // objects above this are freed, so idle memory is bounded
+
+    void *free_list; // linked through the first word of every free object
+    size_t free_count;
+
+    // written only by the owner thread, but stored atomically: metrics thread reads them
+    unsigned long hits; // got from free list
+    unsigned long misses; // got from malloc
+} object_pool;
+
+void object_pool_init(object_pool *pool, size_t obj_size, size_t max_free);
+void object_pool_destroy(object_pool *pool);
+
+void *object_pool_get(object_pool *pool); // contents are undefined, NULL if malloc fails
+void object_pool_put(object_pool *pool, void *obj);
+
+// arena hands out memory by bumping a pointer and takes it all back at once with arena_reset.
+typedef struct arena {
+    struct arena_chunk *chunks; // current one first
+    size_t chunk_size;
+
+    unsigned long hits; // fit into current chunk
+    unsigned long misses; // needed a new chunk
+} arena;
+
+void arena_init(arena *arena, size_t chunk_size);
+void arena_destroy(arena *arena);
+
+void *arena_alloc(arena *arena, size_t size); // 16 bytes aligned, NULL if malloc fails
+void arena_reset(arena *arena); // keeps the first chunk for the next round
+
+#endif // POOL_H
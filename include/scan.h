@@ -0,0 +1,31 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+
+// scan functions look through 16 (SSE4.2) or 32 (AVX2) bytes at a time,
+// implementation is picked by scan_init() from CPUID, scalar one is used before that.
+enum scan_level {
+    SCAN_SCALAR = 0,
+    SCAN_SSE42,
+    SCAN_AVX2,
+};
+
+typedef struct scan_impl {
+    // ctl returns index of the first control byte except HTAB (so \r and \n too), or len
+    size_t (*ctl)(const char *data, size_t len);
+    // tchar returns length of the prefix made of RFC 7230 token characters
+    size_t (*tchar)(const char *data, size_t len);
+    // escape returns index of the first % or +, or len
+    size_t (*escape)(const char *data, size_t len);
+    // dot_segment returns index of the first / followed by / or ., or len
+    size_t (*dot_segment)(const char *data, size_t len);
+} scan_impl;
+
+extern scan_impl scan;
+
+int scan_init();
+int scan_init_level(int level); // for benchmarks, returns -1 if CPU doesn't support level
+const char *scan_level_name(int level);
+
+#endif // SCAN_H
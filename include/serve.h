@@ -11,8 +11,13 @@ enum serve_result {
     SERVE_LISTEN_ERROR,
     SERVE_SYSCONF_ERROR,
     SERVE_LIBEVENT_ERROR,
+    SERVE_CONFIG_ERROR,
 };
 
-int listen_and_serve_http(const serve_config *cfg);
+// listen_and_serve_http serves until SIGTERM or SIGINT, then lets workers finish in-flight responses.
+// SIGHUP starts the same binary with config re-read from cfg_path, SIGUSR2 starts the binary from
+// its path on disk, both with argv; new process inherits listening sockets and the old one drains
+// as soon as it is ready. If the new process fails, the old one keeps serving.
+int listen_and_serve_http(const serve_config *cfg, const char *cfg_path, char *const argv[]);
 
 #endif // SERVE_H
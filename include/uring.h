@@ -0,0 +1,25 @@
+#ifndef URING_H
+#define URING_H
+
+#include "accesslog.h"
+#include "config.h"
+#include "http.h"
+#include "iopool.h"
+#include "metrics.h"
+
+// io_uring backend runs a worker without libevent: one ring per worker with multishot accept,
+// multishot receives into a provided buffer ring and linked sends (splice for files from disk).
+// Requests go through the same parser and http_handler as with libevent.
+
+// uring_probe checks that kernel has everything the backend needs, returns -1 with errno if not.
+int uring_probe();
+
+// uring_worker_loop serves clients accepted from listen_fds in the calling thread. Requests needing
+// file system go to io_pool if it's not NULL, its done jobs come back through io_done.
+// Once *stop is set to 1, worker stops accepting and returns 0 when its connections are done,
+// 2 closes them right away; listen_fds are closed then if listen_fds_owned is set. Returns -1 on fatal error.
+int uring_worker_loop(const int *listen_fds, int listen_fds_len, int listen_fds_owned, const serve_config *cfg,
+    http_pools *pools, worker_metrics *metrics, access_log_ring *access_log, io_pool *io_pool,
+    io_completions *io_done, const int *stop);
+
+#endif // URING_H
@@ -0,0 +1,203 @@
+#include "accesslog.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ACCESS_LOG_BUF_SIZE (64 * 1024) // bytes written at once under load
+#define ACCESS_LOG_LINE_MAX 1280 // formatted record with every path byte escaped fits
+#define ACCESS_LOG_IDLE_SLEEP_MS 10 // logger sleeps when rings are almost empty
+
+static struct {
+    int fd;
+    unsigned sample;
+    access_log_ring *rings;
+    int rings_len;
+    pthread_t thread;
+    int stopping;
+
+    char buf[ACCESS_LOG_BUF_SIZE];
+    size_t len;
+    time_t date_time; // time of cached date
+    char date[32];
+} logger = { .fd = -1 };
+
+static void *logger_process(void *arg);
+
+int access_log_init(const char *path, unsigned sample, int workers) {
+    if (path == NULL) {
+        return 0;
+    }
+    if ((logger.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        fprintf(stderr, "Access log `%s` open error: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if ((logger.rings = aligned_alloc(64, workers * sizeof(access_log_ring))) == NULL) {
+        perror("Access log allocate error");
+        close(logger.fd);
+        logger.fd = -1;
+        return -1;
+    }
+    // records aren't cleared: fresh pages are first touched by the worker which writes them,
+    // so they land on its NUMA node
+    for (int i = 0; i < workers; i++) {
+        access_log_ring *ring = &logger.rings[i];
+        ring->tail = ring->head_cache = ring->head = 0;
+        ring->requests = 0;
+    }
+    logger.rings_len = workers;
+    logger.sample = sample > 0 ? sample : 1;
+
+    if (pthread_create(&logger.thread, NULL, logger_process, NULL) != 0) {
+        perror("Access log pthread creation error");
+        free(logger.rings);
+        logger.rings = NULL;
+        close(logger.fd);
+        logger.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+access_log_ring *access_log_worker(int i) {
+    return logger.rings != NULL ? &logger.rings[i] : NULL;
+}
+
+int access_log_begin(access_log_ring *ring, access_log_record *record, const struct sockaddr_in *address,
+        const char *raw_request, const http_request *request, const http_response *response) {
+    if (response->status < 400 && ring->requests++ % logger.sample != 0) {
+        return 0;
+    }
+
+    record->addr = address->sin_addr.s_addr;
+    record->status = response->status;
+    record->bytes = response->headers->len + response->body_len;
+    record->method = request->method;
+    record->version_minor = request->version_minor;
+    size_t path_len = request->path.len + (request->query.len > 0 ? request->query.len + 1 : 0); // with ?query
+    record->path_truncated = path_len > ACCESS_LOG_PATH_LEN;
+    record->path_len = record->path_truncated ? ACCESS_LOG_PATH_LEN : path_len;
+    memcpy(record->path, raw_request + request->path.off, record->path_len);
+    return 1;
+}
+
+int access_log_end(access_log_ring *ring, access_log_record *record, uint64_t start_ns, uint64_t now_ns) {
+    size_t tail = ring->tail; // worker is the only writer
+    if (tail - ring->head_cache == ACCESS_LOG_RING_LEN) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache == ACCESS_LOG_RING_LEN) {
+            return -1;
+        }
+    }
+
+    record->time = time(NULL);
+    record->duration_us = (now_ns - start_ns) / 1000;
+    memcpy(&ring->records[tail & (ACCESS_LOG_RING_LEN - 1)], record, sizeof(access_log_record));
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void access_log_stop() {
+    if (logger.rings == NULL) {
+        return;
+    }
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+    free(logger.rings);
+    logger.rings = NULL;
+    close(logger.fd);
+    logger.fd = -1;
+}
+
+//
+// logger thread
+//
+
+static void logger_flush() {
+    size_t written = 0;
+    while (written < logger.len) {
+        ssize_t n = write(logger.fd, logger.buf + written, logger.len - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Access log write error"); // records are lost, server goes on
+            break;
+        }
+        written += n;
+    }
+    logger.len = 0;
+}
+
+// format_date returns Common Log Format date, it's formatted once a second.
+static const char *format_date(time_t t) {
+    if (t != logger.date_time) {
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(logger.date, sizeof(logger.date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+        logger.date_time = t;
+    }
+    return logger.date;
+}
+
+// format_record appends one line in Common Log Format followed by response time in seconds,
+// path bytes which could break the line are escaped as \xHH.
+static void format_record(const access_log_record *record) {
+    char *p = logger.buf + logger.len;
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &record->addr, addr, sizeof(addr));
+    p += sprintf(p, "%s - - [%s] \"%s ", addr, format_date(record->time), http_method_name(record->method));
+    for (size_t i = 0; i < record->path_len; i++) {
+        unsigned char c = record->path[i];
+        if (c < 0x20 || c >= 0x7f || c == '"' || c == '\\') {
+            p += sprintf(p, "\\x%02X", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    p += sprintf(p, "%s HTTP/1.%d\" %d %llu %u.%06u\n", record->path_truncated ? "..." : "",
+        record->version_minor, record->status, (unsigned long long)record->bytes,
+        record->duration_us / 1000000, record->duration_us % 1000000);
+    logger.len = p - logger.buf;
+}
+
+// logger_drain formats records of every ring and returns their count.
+static size_t logger_drain() {
+    size_t drained = 0;
+    for (int i = 0; i < logger.rings_len; i++) {
+        access_log_ring *ring = &logger.rings[i];
+        size_t head = ring->head; // logger is the only writer
+        size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            if (logger.len + ACCESS_LOG_LINE_MAX > ACCESS_LOG_BUF_SIZE) {
+                logger_flush();
+            }
+            format_record(&ring->records[head & (ACCESS_LOG_RING_LEN - 1)]);
+            drained++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+    return drained;
+}
+
+static void *logger_process(void *arg) {
+    (void)arg;
+    static const struct timespec idle_sleep = { 0, ACCESS_LOG_IDLE_SLEEP_MS * 1000000 };
+    while (!__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)) {
+        // under load rings are drained in full buffers, otherwise whatever is there is written before sleep
+        if (logger_drain() < ACCESS_LOG_BUF_SIZE / ACCESS_LOG_LINE_MAX) {
+            if (logger.len > 0) {
+                logger_flush();
+            }
+            nanosleep(&idle_sleep, NULL);
+        }
+    }
+    logger_drain();
+    logger_flush();
+    return NULL;
+}
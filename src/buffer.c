@@ -5,23 +5,33 @@ buffer *buffer_new(size_t capacity) {
     if (buf == NULL) {
         return NULL;
     }
-    buf->data = calloc(capacity, 1);
+    buf->data = malloc(capacity);
     if (buf->data == NULL) {
         free(buf);
         return NULL;
     }
     buf->cap = capacity;
     buf->len = 0;
+    buf->external = 0;
 
     return buf;
 }
 
+void buffer_init(buffer *buf, char *data, size_t capacity) {
+    buf->data = data;
+    buf->cap = capacity;
+    buf->len = 0;
+    buf->external = 1;
+}
+
 void buffer_free(buffer *buf) {
     if (buf == NULL) {
         return;
     }
 
-    free(buf->data);
+    if (!buf->external) {
+        free(buf->data);
+    }
     free(buf);
 }
 
@@ -49,41 +59,46 @@ int buffer_append_string(buffer *buf, const char *data) {
     return 0;
 }
 
-int buffer_append_dynamically(buffer **buf, const char *data, size_t len) {
-    if ((*buf)->len + len > (*buf)->cap) {
-        buffer *tmp = realloc(*buf, (*buf)->cap * 2);
-        if (tmp == NULL) {
+static int buffer_grow(buffer *buf, size_t len) {
+    size_t cap = buf->cap;
+    while (buf->len + len > cap) {
+        cap *= 2;
+    }
+    char *data;
+    if (buf->external) {
+        if ((data = malloc(cap)) == NULL) {
             return -1;
         }
-        *buf = tmp;
-        (*buf)->cap *= 2;
+        memcpy(data, buf->data, buf->len);
+        buf->external = 0;
+    } else if ((data = realloc(buf->data, cap)) == NULL) {
+        return -1;
     }
-
-    memcpy((*buf)->data + (*buf)->len, data, len);
-    (*buf)->len += len;
+    buf->data = data;
+    buf->cap = cap;
 
     return 0;
 }
 
-int buffer_append_string_dynamically(buffer **buf, const char *data) {
-    if ((*buf)->len + strlen(data) > (*buf)->cap) {
-        buffer *tmp = realloc(*buf, (*buf)->cap * 2);
-        if (tmp == NULL) {
+int buffer_append_dynamically(buffer **buf, const char *data, size_t len) {
+    if ((*buf)->len + len > (*buf)->cap) {
+        if (buffer_grow(*buf, len) < 0) {
             return -1;
         }
-        *buf = tmp;
-        (*buf)->cap *= 2;
     }
 
-    memcpy((*buf)->data + (*buf)->len, data, strlen(data));
-    (*buf)->len += strlen(data);
+    memcpy((*buf)->data + (*buf)->len, data, len);
+    (*buf)->len += len;
 
     return 0;
 }
 
+int buffer_append_string_dynamically(buffer **buf, const char *data) {
+    return buffer_append_dynamically(buf, data, strlen(data));
+}
+
 void buffer_clear(buffer *buf) {
     assert(buf != NULL);
 
-    buf->len = 0;
-    memset(buf->data, 0, buf->cap);
+    buf->len = 0; // data past len is never read, no need to zero it
 }
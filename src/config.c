@@ -10,8 +10,30 @@
 static const char *http_port = "port";
 static const char *cpu_limit = "cpu_limit";
 static const char *document_root = "document_root";
+static const char *mime_types = "mime_types";
+static const char *reuseport = "reuseport";
+static const char *io_backend = "io_backend";
+static const char *dispatch = "dispatch";
+static const char *cache_size = "cache_size";
+static const char *cache_max_object = "cache_max_object";
+static const char *max_header_size = "max_header_size";
+static const char *cpu_affinity = "cpu_affinity";
+static const char *access_log = "access_log";
+static const char *access_log_sample = "access_log_sample";
+static const char *io_threads = "io_threads";
+static const char *shutdown_timeout = "shutdown_timeout";
+
+#define DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_CACHE_MAX_OBJECT (64 * 1024)
+#define DEFAULT_MAX_HEADER_SIZE (32 * 1024)
+#define MIN_MAX_HEADER_SIZE 1024
+#define DEFAULT_IO_THREADS 2
+#define DEFAULT_SHUTDOWN_TIMEOUT 30
 
 static int fill_parameter(serve_config *cfg, const char *key, const char *val);
+static int parse_switch(const char *key, const char *val);
+static int parse_size(const char *key, const char *val, size_t *size);
+static int parse_cpu_list(const char *key, const char *val, serve_config *cfg);
 
 serve_config *parse_serve_config(const char *path) {
     FILE *file = fopen(path, "r");
@@ -26,6 +48,12 @@ serve_config *parse_serve_config(const char *path) {
         fclose(file);
         return NULL;
     }
+    cfg->cache_size = DEFAULT_CACHE_SIZE;
+    cfg->cache_max_object = DEFAULT_CACHE_MAX_OBJECT;
+    cfg->max_header_size = DEFAULT_MAX_HEADER_SIZE;
+    cfg->access_log_sample = 1;
+    cfg->io_threads = DEFAULT_IO_THREADS;
+    cfg->shutdown_timeout = DEFAULT_SHUTDOWN_TIMEOUT;
 
     char line[128];
     char key[128], val[128], *sep;
@@ -43,7 +71,7 @@ serve_config *parse_serve_config(const char *path) {
 
             if ((fill_parameter(cfg, key, val)) < 0) {
                 fclose(file);
-                free(cfg);
+                free_serve_config(cfg);
                 return NULL;
             }
         }
@@ -54,6 +82,17 @@ serve_config *parse_serve_config(const char *path) {
     return cfg;
 }
 
+void free_serve_config(serve_config *cfg) {
+    if (cfg == NULL) {
+        return;
+    }
+    free(cfg->static_root);
+    free(cfg->mime_types);
+    free(cfg->cpus);
+    free(cfg->access_log);
+    free(cfg);
+}
+
 static int fill_parameter(serve_config *cfg, const char *key, const char *val) {
     if ((strcmp(key, http_port)) == 0) {
         long port = strtol(val, NULL, 10);
@@ -75,9 +114,212 @@ static int fill_parameter(serve_config *cfg, const char *key, const char *val) {
             fprintf(stderr, "Cannot initialize static_root: %s\n", strerror(errno));
             return -1;
         }
+        // request paths start with /, keep the file cache key free of //
+        size_t root_len = strlen(cfg->static_root);
+        while (root_len > 1 && cfg->static_root[root_len - 1] == '/') {
+            cfg->static_root[--root_len] = '\0';
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, mime_types)) == 0) {
+        free(cfg->mime_types);
+        if ((cfg->mime_types = strdup(val)) == NULL) {
+            fprintf(stderr, "Cannot initialize mime_types: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, reuseport)) == 0) {
+        if ((cfg->reuseport = parse_switch(key, val)) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, io_backend)) == 0) {
+        if ((strcmp(val, "libevent")) == 0) {
+            cfg->io_uring = 0;
+        } else if ((strcmp(val, "io_uring")) == 0) {
+            cfg->io_uring = 1;
+        } else {
+            fprintf(stderr, "Wrong %s value: %s, expected libevent or io_uring\n", key, val);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, dispatch)) == 0) {
+        if ((strcmp(val, "round-robin")) == 0) {
+            cfg->dispatch = DISPATCH_ROUND_ROBIN;
+        } else if ((strcmp(val, "least-conn")) == 0) {
+            cfg->dispatch = DISPATCH_LEAST_CONN;
+        } else if ((strcmp(val, "p2c")) == 0) {
+            cfg->dispatch = DISPATCH_P2C;
+        } else {
+            fprintf(stderr, "Wrong %s value: %s, expected round-robin, least-conn or p2c\n", key, val);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, cache_size)) == 0) {
+        return parse_size(key, val, &cfg->cache_size);
+    }
+
+    if ((strcmp(key, cache_max_object)) == 0) {
+        return parse_size(key, val, &cfg->cache_max_object);
+    }
+
+    if ((strcmp(key, max_header_size)) == 0) {
+        if (parse_size(key, val, &cfg->max_header_size) < 0) {
+            return -1;
+        }
+        if (cfg->max_header_size < MIN_MAX_HEADER_SIZE) {
+            fprintf(stderr, "Wrong %s value: %s, should be at least %d\n", key, val, MIN_MAX_HEADER_SIZE);
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, cpu_affinity)) == 0) {
+        free(cfg->cpus);
+        cfg->cpus = NULL;
+        cfg->cpus_len = 0;
+        if ((strcmp(val, "off")) == 0) {
+            cfg->cpu_affinity = CPU_AFFINITY_OFF;
+            return 0;
+        }
+        if ((strcmp(val, "auto")) == 0) {
+            cfg->cpu_affinity = CPU_AFFINITY_AUTO;
+            return 0;
+        }
+        cfg->cpu_affinity = CPU_AFFINITY_LIST;
+        return parse_cpu_list(key, val, cfg);
+    }
+
+    if ((strcmp(key, access_log)) == 0) {
+        free(cfg->access_log);
+        cfg->access_log = NULL;
+        if ((strcmp(val, "off")) == 0) {
+            return 0;
+        }
+        if ((cfg->access_log = strdup(val)) == NULL) {
+            fprintf(stderr, "Cannot initialize access_log: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if ((strcmp(key, access_log_sample)) == 0) {
+        long sample = strtol(val, NULL, 10);
+        if (sample < 1) {
+            fprintf(stderr, "Wrong %s value: %s, should be at least 1\n", key, val);
+            return -1;
+        }
+        cfg->access_log_sample = sample;
+        return 0;
+    }
+
+    if ((strcmp(key, io_threads)) == 0) {
+        long threads = strtol(val, NULL, 10);
+        if (threads < 0) {
+            fprintf(stderr, "Wrong %s value: %s, should be 0 or more\n", key, val);
+            return -1;
+        }
+        cfg->io_threads = threads;
         return 0;
     }
 
-    fprintf(stderr, "Unknown key: %s, ignoring it\n", val);
+    if ((strcmp(key, shutdown_timeout)) == 0) {
+        long timeout = strtol(val, NULL, 10);
+        if (timeout < 0) {
+            fprintf(stderr, "Wrong %s value: %s, should be 0 or more\n", key, val);
+            return -1;
+        }
+        cfg->shutdown_timeout = timeout;
+        return 0;
+    }
+
+    fprintf(stderr, "Unknown key: %s, ignoring it\n", key);
     return 0;
-}
\ No newline at end of file
+}
+
+static int parse_switch(const char *key, const char *val) {
+    if ((strcmp(val, "on")) == 0) {
+        return 1;
+    }
+    if ((strcmp(val, "off")) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "Wrong %s value: %s, expected on or off\n", key, val);
+    return -1;
+}
+
+// parse_size parses size in bytes with optional k, m or g suffix.
+static int parse_size(const char *key, const char *val, size_t *size) {
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (end == val) {
+        fprintf(stderr, "Wrong %s value: %s\n", key, val);
+        return -1;
+    }
+    switch (*end) {
+        case 'g': case 'G':
+            n *= 1024;
+            // fallthrough
+        case 'm': case 'M':
+            n *= 1024;
+            // fallthrough
+        case 'k': case 'K':
+            n *= 1024;
+            end++;
+            break;
+    }
+    if (*end != '\0') {
+        fprintf(stderr, "Wrong %s value: %s\n", key, val);
+        return -1;
+    }
+
+    *size = n;
+    return 0;
+}
+
+// parse_cpu_list parses CPU list like 0-3,8,10-11 in order of workers.
+static int parse_cpu_list(const char *key, const char *val, serve_config *cfg) {
+    const char *p = val;
+    while (1) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                break;
+            }
+        }
+        int *cpus = realloc(cfg->cpus, (cfg->cpus_len + last - first + 1) * sizeof(int));
+        if (cpus == NULL) {
+            fprintf(stderr, "Cannot initialize %s: %s\n", key, strerror(errno));
+            return -1;
+        }
+        cfg->cpus = cpus;
+        for (long cpu = first; cpu <= last; cpu++) {
+            cfg->cpus[cfg->cpus_len++] = cpu;
+        }
+        if (*end == '\0') {
+            return 0;
+        }
+        if (*end != ',') {
+            break;
+        }
+        p = end + 1;
+    }
+    fprintf(stderr, "Wrong %s value: %s, expected off, auto or CPU list like 0-3,8\n", key, val);
+    return -1;
+}
@@ -1,57 +1,1025 @@
 #include "file.h"
+#include "mime.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-void file_open(const char *path, void **file, size_t *file_size) {
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        *file = NULL;
-        *file_size = 0;
+//
+// file cache
+//
+
+#define FILE_CACHE_BUCKETS 16384
+#define FILE_CACHE_SHARDS 64 // readers of different shards never touch the same lock
+#define FILE_CACHE_MAX_ENTRIES 8192 // descriptors held by cache, at most
+#define FILE_CACHE_FD_SHARE 4 // cache takes this part of descriptor limit, the rest is left for clients
+#define FILE_CACHE_MISSING_SLOTS 4096 // failed lookups kept by hash, a multiple of shards so shard lock guards slot
+#define WATCH_MAX_SYMLINK_DEPTH 8 // symlinked directories followed one into another, guards against loops
+#define FILE_WARM_WINDOW (256 * 1024) // body bytes made resident before the first send from disk
+#define FILE_WARM_READAHEAD (8 * 1024 * 1024) // asked from kernel ahead, sendfile's own readahead goes on from there
+
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                      IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+typedef struct file_cache_shard {
+    pthread_rwlock_t lock;
+    unsigned long generation; // bumped on every invalidation, so a stale load isn't inserted
+} __attribute__((aligned(64))) file_cache_shard;
+
+// file_missing is a lookup which failed because path doesn't exist.
+typedef struct file_missing {
+    char *path; // NULL if slot is empty
+    size_t path_len;
+    uint64_t hash;
+    unsigned long generation; // of missing_generation at lookup, slot is stale once it changes
+    int error; // ENOENT or ENOTDIR
+} file_missing;
+
+typedef struct file_watch {
+    int wd;
+    char *path;
+} file_watch;
+
+static struct {
+    int enabled;
+    int fds; // held by cached entries and their sidecars
+    int max_fds;
+
+    file_entry *buckets[FILE_CACHE_BUCKETS];
+    file_cache_shard shards[FILE_CACHE_SHARDS];
+
+    // CLOCK over table entries, they are evicted when descriptors run out.
+    // The lock is taken before shard locks.
+    pthread_mutex_t clock_lock;
+    file_entry **clock;
+    int clock_len;
+    int clock_hand;
+
+    // missing files, so requests for them don't go to disk again; all of them become stale
+    // when anything is created or moved in under root
+    file_missing missing[FILE_CACHE_MISSING_SLOTS];
+    unsigned long missing_generation;
+
+    // owned by watcher thread after init
+    int inotify_fd;
+    file_watch *watches;
+    size_t watches_len, watches_cap;
+    int watch_symlink_depth;
+    pthread_t watcher;
+} cache;
+
+static const struct {
+    const char *suffix;
+    const char *name;
+} encodings[FILE_ENCODINGS] = {
+    [FILE_ENCODING_BR] = { ".br", "br" },
+    [FILE_ENCODING_GZIP] = { ".gz", "gzip" },
+};
+
+static void file_content_drop(file_entry *entry);
+static int file_cache_reserve_fd();
+
+static pthread_rwlock_t *entry_lock(const file_entry *entry) {
+    return &cache.shards[entry->hash % FILE_CACHE_BUCKETS % FILE_CACHE_SHARDS].lock;
+}
+
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static file_entry *file_entry_load(const char *path, size_t path_len, uint64_t hash) {
+    file_entry *entry = calloc(1, sizeof(file_entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+    if ((entry->path = malloc(path_len + 1)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->path, path, path_len + 1);
+    entry->path_len = path_len;
+    entry->hash = hash;
+
+    if ((entry->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    struct stat file_stats;
+    if (fstat(entry->fd, &file_stats) < 0) {
+        close(entry->fd);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    if (!S_ISREG(file_stats.st_mode)) {
+        close(entry->fd);
+        free(entry->path);
+        free(entry);
+        errno = EINVAL;
+        return NULL;
+    }
+    entry->size = (size_t)file_stats.st_size;
+    entry->mtime = file_stats.st_mtime;
+    entry->ino = file_stats.st_ino;
+    entry->mime_type = mime_type_of_path(path);
+    entry->refcnt = 1;
+    entry->clock_slot = -1;
+    entry->table_slot = -1;
+
+    return entry;
+}
+
+void file_entry_ref(file_entry *entry) {
+    __atomic_add_fetch(&entry->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void file_entry_unref(file_entry *entry) {
+    if (entry == NULL) {
+        return;
+    }
+    if (__atomic_sub_fetch(&entry->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
         return;
     }
 
-    struct stat *file_stats = file_get_info(path);
-    if (file_stats == NULL) {
-        close(fd);
-        *file = NULL;
-        *file_size = 0;
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        file_entry_unref(entry->encoded[i]);
+    }
+    close(entry->fd);
+    free(entry->headers);
+    free(entry->path);
+    free(entry);
+}
+
+// file_entry_release clears cached flag of entry, so its descriptor stops counting against the limit.
+// Returns 0 if entry has already been released.
+static int file_entry_release(file_entry *entry) {
+    if (!__atomic_exchange_n(&entry->cached, 0, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+    __atomic_sub_fetch(&cache.fds, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// file_entry_encoded_resolved tells if file_entry_encoded() returns without looking sidecars up.
+int file_entry_encoded_resolved(const file_entry *entry) {
+    return __atomic_load_n(&entry->encoded_resolved, __ATOMIC_ACQUIRE) || entry->encoding != NULL;
+}
+
+// file_entry_encoded returns sidecars of the entry indexed by file_encoding, NULL where there is none.
+// They are looked up once and live as long as the entry, so a request costs no extra syscalls;
+// watcher invalidates the original file together with its sidecar.
+file_entry *const *file_entry_encoded(file_entry *entry) {
+    if (file_entry_encoded_resolved(entry)) {
+        return entry->encoded;
+    }
+
+    char path[PATH_MAX];
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        size_t suffix_len = strlen(encodings[i].suffix);
+        if (entry->path_len + suffix_len >= sizeof(path)) {
+            break;
+        }
+        memcpy(path, entry->path, entry->path_len);
+        memcpy(path + entry->path_len, encodings[i].suffix, suffix_len + 1);
+        file_entry *sidecar = file_entry_load(path, entry->path_len + suffix_len,
+            path_hash(path, entry->path_len + suffix_len));
+        if (sidecar == NULL) {
+            continue;
+        }
+        sidecar->mime_type = entry->mime_type;
+        sidecar->encoding = encodings[i].name;
+        if (__atomic_load_n(&entry->cached, __ATOMIC_SEQ_CST) && file_cache_reserve_fd() == 0) {
+            sidecar->cached = 1; // stays in cache along with the entry, so its content can be cached too
+        }
+
+        // workers may race to resolve, the first one wins
+        file_entry *expected = NULL;
+        if (!__atomic_compare_exchange_n(&entry->encoded[i], &expected, sidecar, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            file_entry_release(sidecar);
+            file_entry_unref(sidecar);
+            continue;
+        }
+        if (!__atomic_load_n(&entry->cached, __ATOMIC_SEQ_CST)) {
+            // entry isn't cached or invalidation has missed the sidecar
+            file_entry_release(sidecar);
+            file_content_drop(sidecar);
+        }
+    }
+    __atomic_store_n(&entry->encoded_resolved, 1, __ATOMIC_RELEASE);
+
+    return entry->encoded;
+}
+
+// file_entry_uncache marks entry as removed from table and drops cached content of it and its sidecars.
+static void file_entry_uncache(file_entry *entry) {
+    file_entry_release(entry);
+    file_content_drop(entry);
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        file_entry *sidecar = __atomic_load_n(&entry->encoded[i], __ATOMIC_SEQ_CST);
+        if (sidecar != NULL) {
+            file_entry_release(sidecar);
+            file_content_drop(sidecar);
+        }
+    }
+}
+
+// file_stat_encoded stats sidecars of path without opening them, st_mode is 0 where there's none.
+void file_stat_encoded(const char *path, struct stat stats[FILE_ENCODINGS]) {
+    size_t path_len = strlen(path);
+    char sidecar[PATH_MAX];
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        size_t suffix_len = strlen(encodings[i].suffix);
+        stats[i].st_mode = 0;
+        if (path_len + suffix_len >= sizeof(sidecar)) {
+            continue;
+        }
+        memcpy(sidecar, path, path_len);
+        memcpy(sidecar + path_len, encodings[i].suffix, suffix_len + 1);
+        if (stat(sidecar, &stats[i]) < 0 || !S_ISREG(stats[i].st_mode)) {
+            stats[i].st_mode = 0;
+        }
+    }
+}
+
+// bucket_find looks entry up in bucket, caller holds shard lock.
+static file_entry *bucket_find(size_t bucket, uint64_t hash, const char *path, size_t path_len) {
+    for (file_entry *entry = cache.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->path_len == path_len && memcmp(entry->path, path, path_len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// missing_find returns error of failed lookup of path if nothing has appeared since, 0 otherwise.
+// Caller holds shard lock.
+static int missing_find(uint64_t hash, const char *path, size_t path_len) {
+    const file_missing *slot = &cache.missing[hash % FILE_CACHE_MISSING_SLOTS];
+    if (slot->path == NULL || slot->generation != __atomic_load_n(&cache.missing_generation, __ATOMIC_ACQUIRE) ||
+            slot->hash != hash || slot->path_len != path_len || memcmp(slot->path, path, path_len) != 0) {
+        return 0;
+    }
+    return slot->error;
+}
+
+// missing_add remembers failed lookup started at generation, replacing whatever was in its slot.
+// Caller holds shard lock exclusively.
+static void missing_add(uint64_t hash, const char *path, size_t path_len, unsigned long generation, int error) {
+    if (generation != __atomic_load_n(&cache.missing_generation, __ATOMIC_ACQUIRE)) {
+        return; // something has appeared while looking up, it may be this path
+    }
+    file_missing *slot = &cache.missing[hash % FILE_CACHE_MISSING_SLOTS];
+    char *copy = malloc(path_len + 1);
+    if (copy == NULL) {
         return;
     }
-    size_t size = (size_t)file_stats->st_size;
-    free(file_stats);
+    memcpy(copy, path, path_len + 1);
+    free(slot->path);
+    slot->path = copy;
+    slot->path_len = path_len;
+    slot->hash = hash;
+    slot->generation = generation;
+    slot->error = error;
+}
+
+// table_touch marks entry as recently used, so eviction passes it over once.
+static void table_touch(file_entry *entry) {
+    if (!__atomic_load_n(&entry->table_referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&entry->table_referenced, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// table_clock_remove takes entry out of CLOCK slot, caller holds clock_lock.
+static void table_clock_remove(int slot) {
+    cache.clock[slot]->table_slot = -1;
+    cache.clock_len--;
+    if (slot != cache.clock_len) {
+        cache.clock[slot] = cache.clock[cache.clock_len];
+        cache.clock[slot]->table_slot = slot;
+    }
+    if (cache.clock_hand >= cache.clock_len) {
+        cache.clock_hand = 0;
+    }
+}
+
+// table_forget takes entry unlinked from its bucket out of CLOCK, if eviction hasn't done it yet.
+static void table_forget(file_entry *entry) {
+    pthread_mutex_lock(&cache.clock_lock);
+    if (entry->table_slot >= 0) {
+        table_clock_remove(entry->table_slot);
+    }
+    pthread_mutex_unlock(&cache.clock_lock);
+}
+
+// table_make_room evicts entries which weren't hit since the last sweep until a descriptor is free,
+// caller holds clock_lock. Evicted file is closed when in-flight responses release it.
+static void table_make_room() {
+    while (cache.clock_len > 0 && __atomic_load_n(&cache.fds, __ATOMIC_RELAXED) >= cache.max_fds) {
+        file_entry *entry = cache.clock[cache.clock_hand];
+        if (__atomic_load_n(&entry->table_referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->table_referenced, 0, __ATOMIC_RELAXED);
+            cache.clock_hand = (cache.clock_hand + 1) % cache.clock_len;
+            continue;
+        }
+        table_clock_remove(cache.clock_hand);
+
+        // invalidation may have unlinked it already, then the table reference is dropped there;
+        // it waits for clock_lock to forget the entry, so the entry is alive here
+        size_t bucket = entry->hash % FILE_CACHE_BUCKETS;
+        file_cache_shard *shard = &cache.shards[bucket % FILE_CACHE_SHARDS];
+        int unlinked = 0;
+        pthread_rwlock_wrlock(&shard->lock);
+        for (file_entry **p = &cache.buckets[bucket]; *p != NULL; p = &(*p)->next) {
+            if (*p == entry) {
+                *p = entry->next;
+                unlinked = 1;
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&shard->lock);
+        if (unlinked) {
+            file_entry_uncache(entry);
+            file_entry_unref(entry);
+        }
+    }
+}
+
+// file_cache_reserve_fd counts one more descriptor held by cache, evicting to stay within the limit.
+static int file_cache_reserve_fd() {
+    int r = -1;
+    pthread_mutex_lock(&cache.clock_lock);
+    table_make_room();
+    if (__atomic_load_n(&cache.fds, __ATOMIC_RELAXED) < cache.max_fds) {
+        __atomic_add_fetch(&cache.fds, 1, __ATOMIC_RELAXED);
+        r = 0;
+    }
+    pthread_mutex_unlock(&cache.clock_lock);
+    return r;
+}
+
+// file_cache_find returns referenced entry for path only if it's cached, never touching the file.
+// Otherwise NULL is returned with errno of the last lookup if path is known to be missing, EAGAIN if it isn't.
+file_entry *file_cache_find(const char *path) {
+    if (!__atomic_load_n(&cache.enabled, __ATOMIC_RELAXED)) {
+        errno = EAGAIN;
+        return NULL;
+    }
+    size_t path_len = strlen(path);
+    uint64_t hash = path_hash(path, path_len);
+    size_t bucket = hash % FILE_CACHE_BUCKETS;
+    file_cache_shard *shard = &cache.shards[bucket % FILE_CACHE_SHARDS];
+
+    pthread_rwlock_rdlock(&shard->lock);
+    file_entry *entry = bucket_find(bucket, hash, path, path_len);
+    int error = 0;
+    if (entry != NULL) {
+        file_entry_ref(entry);
+        table_touch(entry);
+    } else {
+        error = missing_find(hash, path, path_len);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (entry == NULL) {
+        errno = error != 0 ? error : EAGAIN;
+    }
+    return entry;
+}
+
+// file_cache_get returns referenced entry for path, loading it on miss, or NULL with errno set.
+// Caller releases it with file_entry_unref().
+file_entry *file_cache_get(const char *path) {
+    size_t path_len = strlen(path);
+    uint64_t hash = path_hash(path, path_len);
+    size_t bucket = hash % FILE_CACHE_BUCKETS;
+    file_cache_shard *shard = &cache.shards[bucket % FILE_CACHE_SHARDS];
+
+    int enabled = __atomic_load_n(&cache.enabled, __ATOMIC_RELAXED);
+    unsigned long generation = 0;
+    unsigned long missing_generation = 0;
+    file_entry *entry;
+    if (enabled) {
+        missing_generation = __atomic_load_n(&cache.missing_generation, __ATOMIC_ACQUIRE);
+        pthread_rwlock_rdlock(&shard->lock);
+        if ((entry = bucket_find(bucket, hash, path, path_len)) != NULL) {
+            file_entry_ref(entry);
+            table_touch(entry);
+            pthread_rwlock_unlock(&shard->lock);
+            return entry;
+        }
+        int error = missing_find(hash, path, path_len);
+        generation = shard->generation;
+        pthread_rwlock_unlock(&shard->lock);
+        if (error != 0) {
+            errno = error;
+            return NULL;
+        }
+    }
 
-    void *mapped_file = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
-    close(fd);
-    if (mapped_file == MAP_FAILED) {
-        *file = NULL;
-        *file_size = 0;
+    // miss: syscalls are done without lock
+    file_entry *loaded = file_entry_load(path, path_len, hash);
+    if (loaded == NULL && enabled && (errno == ENOENT || errno == ENOTDIR)) {
+        int error = errno;
+        pthread_rwlock_wrlock(&shard->lock);
+        missing_add(hash, path, path_len, missing_generation, error);
+        pthread_rwlock_unlock(&shard->lock);
+        errno = error;
+    }
+    if (loaded == NULL || !enabled) {
+        return loaded;
+    }
+
+    pthread_mutex_lock(&cache.clock_lock);
+    table_make_room();
+    pthread_rwlock_wrlock(&shard->lock);
+    if (shard->generation != generation) {
+        // something has changed while loading, don't cache what could be stale
+        pthread_rwlock_unlock(&shard->lock);
+        pthread_mutex_unlock(&cache.clock_lock);
+        return loaded;
+    }
+    if ((entry = bucket_find(bucket, hash, path, path_len)) != NULL) {
+        // another worker loaded it first
+        file_entry_ref(entry);
+        pthread_rwlock_unlock(&shard->lock);
+        pthread_mutex_unlock(&cache.clock_lock);
+        file_entry_unref(loaded);
+        return entry;
+    }
+    if (__atomic_load_n(&cache.fds, __ATOMIC_RELAXED) < cache.max_fds) {
+        __atomic_add_fetch(&cache.fds, 1, __ATOMIC_RELAXED);
+        file_entry_ref(loaded); // table reference
+        loaded->cached = 1;
+        loaded->next = cache.buckets[bucket];
+        cache.buckets[bucket] = loaded;
+        loaded->table_referenced = 1;
+        loaded->table_slot = cache.clock_len;
+        cache.clock[cache.clock_len++] = loaded;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    pthread_mutex_unlock(&cache.clock_lock);
+
+    return loaded;
+}
+
+void file_cache_invalidate(const char *path) {
+    size_t path_len = strlen(path);
+    uint64_t hash = path_hash(path, path_len);
+    size_t bucket = hash % FILE_CACHE_BUCKETS;
+    file_cache_shard *shard = &cache.shards[bucket % FILE_CACHE_SHARDS];
+
+    file_entry *removed = NULL;
+    pthread_rwlock_wrlock(&shard->lock);
+    shard->generation++;
+    for (file_entry **entry = &cache.buckets[bucket]; *entry != NULL; entry = &(*entry)->next) {
+        if ((*entry)->hash == hash && (*entry)->path_len == path_len && memcmp((*entry)->path, path, path_len) == 0) {
+            removed = *entry;
+            *entry = removed->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (removed != NULL) {
+        table_forget(removed);
+        file_entry_uncache(removed);
+    }
+    file_entry_unref(removed); // in-flight responses keep their own references
+}
+
+void file_cache_flush() {
+    __atomic_add_fetch(&cache.missing_generation, 1, __ATOMIC_RELEASE);
+    for (size_t bucket = 0; bucket < FILE_CACHE_BUCKETS; bucket++) {
+        file_cache_shard *shard = &cache.shards[bucket % FILE_CACHE_SHARDS];
+        pthread_rwlock_wrlock(&shard->lock);
+        shard->generation++;
+        file_entry *entry = cache.buckets[bucket];
+        cache.buckets[bucket] = NULL;
+        pthread_rwlock_unlock(&shard->lock);
+
+        while (entry != NULL) {
+            file_entry *next = entry->next;
+            table_forget(entry);
+            file_entry_uncache(entry);
+            file_entry_unref(entry);
+            entry = next;
+        }
+    }
+}
+
+//
+// content cache
+//
+
+#define CACHE_LINE 64
+
+// small files are kept in memory, eviction is CLOCK: hits only set referenced bit,
+// the hand sweeps slots under lock on insertion and evicts entries which weren't hit since last sweep
+static struct {
+    size_t budget;
+    size_t max_object;
+
+    pthread_mutex_t lock;
+    file_entry **clock; // slots, every entry in it is referenced
+    int clock_cap;
+    int clock_len;
+    int clock_hand;
+
+    size_t bytes;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} content = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void file_content_cache_init(size_t budget, size_t max_object) {
+    if (budget == 0 || max_object == 0) {
         return;
     }
+    // a blob needs an entry holding descriptor, but released entry gives its descriptor back
+    // before its blob is dropped, so slots can still run out: insertion evicts then
+    content.clock_cap = cache.max_fds > 0 ? cache.max_fds : FILE_CACHE_MAX_ENTRIES;
+    if ((content.clock = calloc(content.clock_cap, sizeof(file_entry *))) == NULL) {
+        perror("Content cache: malloc error, cache disabled");
+        return;
+    }
+    content.max_object = max_object < budget ? max_object : budget;
+    content.budget = budget;
+}
+
+void file_blob_ref(file_blob *blob) {
+    __atomic_add_fetch(&blob->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void file_blob_unref(file_blob *blob) {
+    if (blob != NULL && __atomic_sub_fetch(&blob->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(blob);
+    }
+}
+
+static size_t align_to_cache_line(size_t size) {
+    return (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+}
+
+// file_blob_load reads file content into a new blob. Content is read with pread(),
+// not from mapping, so file truncated meanwhile can't crash us with SIGBUS.
+static file_blob *file_blob_load(const file_entry *entry) {
+    size_t size = align_to_cache_line(sizeof(file_blob) + entry->size);
+    file_blob *blob = aligned_alloc(CACHE_LINE, size);
+    if (blob == NULL) {
+        return NULL;
+    }
+
+    size_t read_len = 0;
+    while (read_len < entry->size) {
+        ssize_t n = pread(entry->fd, blob->data + read_len, entry->size - read_len, read_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(blob); // file has changed, inotify will invalidate it
+            return NULL;
+        }
+        read_len += n;
+    }
+
+    blob->refcnt = 1; // cache reference
+    blob->size = size;
+    blob->body = blob->data;
+    blob->body_len = entry->size;
 
-    *file = mapped_file;
-    *file_size = size;
+    return blob;
 }
 
-void file_close(void *file, size_t file_size) {
-    munmap(file, file_size);
+// file_blob_new copies generated content into a blob which isn't cached, e.g. status page.
+file_blob *file_blob_new(const char *body, size_t len) {
+    size_t size = align_to_cache_line(sizeof(file_blob) + len);
+    file_blob *blob = aligned_alloc(CACHE_LINE, size);
+    if (blob == NULL) {
+        return NULL;
+    }
+    memcpy(blob->data, body, len);
+    blob->refcnt = 1;
+    blob->size = size;
+    blob->body = blob->data;
+    blob->body_len = len;
+    return blob;
+}
+
+// clock_remove detaches blob from entry in slot, caller holds content.lock.
+static void clock_remove(int slot) {
+    file_entry *entry = content.clock[slot];
+    pthread_rwlock_t *lock = entry_lock(entry);
+    pthread_rwlock_wrlock(lock);
+    file_blob *blob = entry->blob;
+    entry->blob = NULL;
+    pthread_rwlock_unlock(lock);
+    entry->clock_slot = -1;
+
+    content.clock_len--;
+    if (slot != content.clock_len) {
+        content.clock[slot] = content.clock[content.clock_len];
+        content.clock[slot]->clock_slot = slot;
+    }
+    if (content.clock_hand >= content.clock_len) {
+        content.clock_hand = 0;
+    }
+    content.bytes -= blob->size;
+
+    file_blob_unref(blob); // in-flight responses keep their own references
+    file_entry_unref(entry);
+}
+
+// clock_make_room evicts not recently used blobs until size fits and a slot is free,
+// caller holds content.lock.
+static void clock_make_room(size_t size) {
+    while (content.clock_len > 0 &&
+            (content.bytes + size > content.budget || content.clock_len == content.clock_cap)) {
+        file_entry *entry = content.clock[content.clock_hand];
+        if (__atomic_load_n(&entry->clock_referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->clock_referenced, 0, __ATOMIC_RELAXED);
+            content.clock_hand = (content.clock_hand + 1) % content.clock_len;
+            continue;
+        }
+        clock_remove(content.clock_hand);
+        __atomic_add_fetch(&content.evictions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void file_content_drop(file_entry *entry) {
+    if (content.budget == 0) {
+        return;
+    }
+    pthread_mutex_lock(&content.lock);
+    if (entry->clock_slot >= 0) {
+        clock_remove(entry->clock_slot);
+    }
+    pthread_mutex_unlock(&content.lock);
 }
 
-struct stat *file_get_info(const char *path) {
-    struct stat *file_stats = malloc(sizeof(struct stat));
-    if (file_stats == NULL) {
+// file_content_get returns referenced in-memory content of the file or NULL if it isn't cacheable.
+file_blob *file_content_get(file_entry *entry) {
+    if (content.budget == 0 || entry->size > content.max_object) {
         return NULL;
     }
-    if (stat(path, file_stats) < 0) {
-        free(file_stats);
+
+    // shard lock is shared by readers, eviction takes it exclusively to detach blob
+    pthread_rwlock_t *lock = entry_lock(entry);
+    pthread_rwlock_rdlock(lock);
+    file_blob *blob = entry->blob;
+    if (blob != NULL) {
+        file_blob_ref(blob);
+    }
+    pthread_rwlock_unlock(lock);
+    if (blob != NULL) {
+        if (!__atomic_load_n(&entry->clock_referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->clock_referenced, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_add_fetch(&content.hits, 1, __ATOMIC_RELAXED);
+        return blob;
+    }
+    __atomic_add_fetch(&content.misses, 1, __ATOMIC_RELAXED);
+
+    if (!__atomic_load_n(&entry->cached, __ATOMIC_RELAXED) ||
+        (blob = file_blob_load(entry)) == NULL) {
         return NULL;
     }
 
-    return file_stats;
+    pthread_mutex_lock(&content.lock);
+    // invalidation clears cached before dropping content under this lock, so we can't insert stale blob
+    if (!__atomic_load_n(&entry->cached, __ATOMIC_RELAXED) || entry->clock_slot >= 0) {
+        pthread_mutex_unlock(&content.lock);
+        return blob; // gone or loaded by another worker, serve our copy once
+    }
+    clock_make_room(blob->size);
+    if (content.bytes + blob->size > content.budget || content.clock_len == content.clock_cap) {
+        pthread_mutex_unlock(&content.lock);
+        return blob;
+    }
+    file_entry_ref(entry);
+    __atomic_store_n(&entry->clock_referenced, 1, __ATOMIC_RELAXED);
+    entry->clock_slot = content.clock_len;
+    content.clock[content.clock_len++] = entry;
+    content.bytes += blob->size;
+
+    file_blob_ref(blob); // one for cache, one for caller
+    pthread_rwlock_wrlock(lock);
+    __atomic_store_n(&entry->blob, blob, __ATOMIC_RELEASE); // file_content_ready() reads it without lock
+    pthread_rwlock_unlock(lock);
+    pthread_mutex_unlock(&content.lock);
+
+    return blob;
+}
+
+// file_content_ready tells if body of the file can be sent without waiting for disk:
+// file fitting content cache must be there, bigger one must have been warmed.
+int file_content_ready(const file_entry *entry) {
+    if (content.budget > 0 && entry->size <= content.max_object) {
+        return __atomic_load_n(&entry->blob, __ATOMIC_ACQUIRE) != NULL;
+    }
+    return __atomic_load_n(&entry->warm, __ATOMIC_ACQUIRE);
+}
+
+void file_content_stats_get(file_content_stats *stats) {
+    stats->hits = __atomic_load_n(&content.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&content.misses, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&content.evictions, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&content.lock);
+    stats->bytes = content.bytes;
+    stats->objects = content.clock_len;
+    pthread_mutex_unlock(&content.lock);
+}
+
+// file_warm brings body of the file sent from disk into page cache, it blocks and is called by I/O threads.
+// The first window from offset is faulted in before return, so the first sendfile() doesn't wait,
+// some more is read ahead by kernel meanwhile. Page cache may drop it later,
+// the flag only tells that file has been read once.
+void file_warm(file_entry *entry, size_t offset, size_t len) {
+    if (len > 0) {
+        posix_fadvise(entry->fd, offset, len < FILE_WARM_READAHEAD ? len : FILE_WARM_READAHEAD, POSIX_FADV_WILLNEED);
+        size_t start = offset & ~((size_t)sysconf(_SC_PAGESIZE) - 1); // mmap offset is page aligned
+        size_t end = offset + (len < FILE_WARM_WINDOW ? len : FILE_WARM_WINDOW);
+        void *window = mmap(NULL, end - start, PROT_READ, MAP_SHARED | MAP_POPULATE, entry->fd, start);
+        if (window != MAP_FAILED) {
+            munmap(window, end - start);
+        }
+    }
+    __atomic_store_n(&entry->warm, 1, __ATOMIC_RELEASE);
+}
+
+//
+// inotify watcher
+//
+
+static int watch_add(const char *path) {
+    int wd = inotify_add_watch(cache.inotify_fd, path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd < 0) {
+        fprintf(stderr, "File cache: cannot watch %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache.watches_len; i++) {
+        if (cache.watches[i].wd == wd && strcmp(cache.watches[i].path, path) == 0) {
+            return 0; // already watched; the same directory reached by another path gets one more record
+        }
+    }
+    if (cache.watches_len == cache.watches_cap) {
+        size_t cap = cache.watches_cap == 0 ? 64 : cache.watches_cap * 2;
+        file_watch *tmp = realloc(cache.watches, cap * sizeof(file_watch));
+        if (tmp == NULL) {
+            return -1;
+        }
+        cache.watches = tmp;
+        cache.watches_cap = cap;
+    }
+    if ((cache.watches[cache.watches_len].path = strdup(path)) == NULL) {
+        return -1;
+    }
+    cache.watches[cache.watches_len].wd = wd;
+    cache.watches_len++;
+
+    return 0;
+}
+
+static int watch_symlinked(const char *path);
+
+static int watch_tree_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw) {
+    (void)sb;
+    (void)ftw;
+    if (type == FTW_D) {
+        return watch_add(path) < 0 ? FTW_STOP : FTW_CONTINUE;
+    }
+    if (type == FTW_SL) {
+        watch_symlinked(path);
+    }
+    return FTW_CONTINUE;
+}
+
+// watch_tree watches directory and all its subdirectories, symlinked ones included.
+static int watch_tree(const char *root) {
+    return nftw(root, watch_tree_entry, 16, FTW_PHYS | FTW_ACTIONRETVAL) == 0 ? 0 : -1;
+}
+
+// watch_symlinked watches directory behind symlink by the link path, files under it are requested by it.
+// nftw() doesn't descend through symlinks, so the link's entries are walked here.
+static int watch_symlinked(const char *path) {
+    struct stat target;
+    if (stat(path, &target) < 0 || !S_ISDIR(target.st_mode)) {
+        return 0;
+    }
+    if (cache.watch_symlink_depth == WATCH_MAX_SYMLINK_DEPTH) {
+        fprintf(stderr, "File cache: too many nested symlinks at %s, not watched\n", path);
+        return 0;
+    }
+    if (watch_add(path) < 0) {
+        return -1;
+    }
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    cache.watch_symlink_depth++;
+    char child[PATH_MAX];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+                (entry->d_type != DT_DIR && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)) {
+            continue;
+        }
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) < (int)sizeof(child)) {
+            watch_tree(child);
+        }
+    }
+    cache.watch_symlink_depth--;
+    closedir(dir);
+    return 0;
+}
+
+static void watch_remove(int wd) {
+    for (size_t i = 0; i < cache.watches_len; ) {
+        if (cache.watches[i].wd == wd) {
+            free(cache.watches[i].path);
+            cache.watches[i] = cache.watches[--cache.watches_len];
+        } else {
+            i++;
+        }
+    }
+}
+
+// watch_forget drops records of path and directories under it, e.g. when symlink to directory is removed.
+// Directory is unwatched once no other path leads to it. Returns the number of dropped records.
+static int watch_forget(const char *path) {
+    size_t len = strlen(path);
+    int forgotten = 0;
+    for (size_t i = 0; i < cache.watches_len; ) {
+        const char *watched = cache.watches[i].path;
+        if (strncmp(watched, path, len) != 0 || (watched[len] != '\0' && watched[len] != '/')) {
+            i++;
+            continue;
+        }
+        int wd = cache.watches[i].wd;
+        free(cache.watches[i].path);
+        cache.watches[i] = cache.watches[--cache.watches_len];
+        forgotten++;
+
+        int shared = 0;
+        for (size_t j = 0; j < cache.watches_len; j++) {
+            shared |= cache.watches[j].wd == wd;
+        }
+        if (!shared) {
+            inotify_rm_watch(cache.inotify_fd, wd);
+        }
+    }
+    return forgotten;
+}
+
+static void watch_handle_path(const char *dir, const struct inotify_event *event);
+
+static void watch_handle(const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        // events are lost, nothing in cache can be trusted
+        file_cache_flush();
+        return;
+    }
+    if (event->mask & IN_IGNORED) {
+        watch_remove(event->wd);
+        return;
+    }
+
+    // directory may be reached by several paths through symlinks, files are cached by each of them;
+    // records may be added or dropped by handling, so every path is copied out first
+    char dir[PATH_MAX];
+    for (size_t i = 0; i < cache.watches_len; i++) {
+        if (cache.watches[i].wd == event->wd && strlen(cache.watches[i].path) < sizeof(dir)) {
+            strcpy(dir, cache.watches[i].path);
+            watch_handle_path(dir, event);
+        }
+    }
+}
+
+// watch_handle_path handles event of directory watched under dir path.
+static void watch_handle_path(const char *dir, const struct inotify_event *event) {
+    if (event->len == 0) {
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            file_cache_flush(); // whole subtree is gone, cheaper to drop everything
+        }
+        return;
+    }
+
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        __atomic_add_fetch(&cache.missing_generation, 1, __ATOMIC_RELEASE); // it may be on a missing path
+    }
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, event->name) >= (int)sizeof(path)) {
+        return;
+    }
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_tree(path);
+        }
+        if (event->mask & (IN_MOVED_FROM | IN_MOVED_TO)) {
+            file_cache_flush(); // files under renamed directory changed their paths
+        }
+        return;
+    }
+    if (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO) && watch_forget(path) > 0) {
+        file_cache_flush(); // symlink to directory is gone or replaced, files under it may differ
+    }
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+        watch_symlinked(path); // if it's a new symlink to directory
+    }
+    file_cache_invalidate(path);
+
+    // original file holds its sidecars, so it's stale too
+    size_t len = strlen(path);
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        size_t suffix_len = strlen(encodings[i].suffix);
+        if (len > suffix_len && strcmp(path + len - suffix_len, encodings[i].suffix) == 0) {
+            path[len - suffix_len] = '\0';
+            file_cache_invalidate(path);
+            break;
+        }
+    }
+}
+
+static void *file_cache_watch(void *arg) {
+    (void)arg;
+
+    char events[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(cache.inotify_fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("File cache: inotify read error, cache disabled");
+            __atomic_store_n(&cache.enabled, 0, __ATOMIC_RELAXED);
+            file_cache_flush();
+            return NULL;
+        }
+
+        for (char *p = events; p < events + n; ) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            watch_handle(event);
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+// file_cache_init enables caching of files under root; entries are invalidated by inotify events.
+// If watching is impossible every request loads file by itself.
+// Cache keeps at most a quarter of descriptor limit open, evicting least recently used files beyond it.
+int file_cache_init(const char *root) {
+    for (int i = 0; i < FILE_CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&cache.shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&cache.clock_lock, NULL);
+
+    cache.max_fds = FILE_CACHE_MAX_ENTRIES;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+            limit.rlim_cur / FILE_CACHE_FD_SHARE < (rlim_t)cache.max_fds) {
+        cache.max_fds = (int)(limit.rlim_cur / FILE_CACHE_FD_SHARE);
+    }
+    if (cache.max_fds == 0 || (cache.clock = calloc(cache.max_fds, sizeof(file_entry *))) == NULL) {
+        fprintf(stderr, "File cache: no room for %d entries, cache disabled\n", cache.max_fds);
+        return -1;
+    }
+
+    if ((cache.inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        perror("File cache: inotify init error, cache disabled");
+        free(cache.clock);
+        return -1;
+    }
+    if (watch_tree(root) < 0) {
+        fprintf(stderr, "File cache: cannot watch %s, cache disabled\n", root);
+        close(cache.inotify_fd);
+        free(cache.clock);
+        return -1;
+    }
+    if (pthread_create(&cache.watcher, NULL, file_cache_watch, NULL) != 0) {
+        perror("File cache: watcher thread creation error, cache disabled");
+        close(cache.inotify_fd);
+        free(cache.clock);
+        return -1;
+    }
+    __atomic_store_n(&cache.enabled, 1, __ATOMIC_RELAXED);
+
+    return 0;
 }
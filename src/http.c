@@ -1,62 +1,98 @@
 #include "http.h"
+#include "http_internal.h"
 
 #include "file.h"
+#include "metrics.h"
+#include "parser.h"
+#include "scan.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <strings.h>
 #include <time.h>
 #include <sys/stat.h>
 
-#define INITIAL_HEADERS_BUF_SIZE 1024
-
-const char *http_end_of_request = "\r\n\r\n";
-const char *crlf = "\r\n";
+#define MAX_FREE_RESPONSES 1024 // per worker
+#define REQUEST_ARENA_CHUNK_SIZE 4096
 
 static const char *default_directory_file = "index.html";
 
-static const char *status_200_ok = "200 OK";
-static const char *status_400_bad_request = "400 Bad Request";
-static const char *status_403_forbidden = "403 Forbidden";
-static const char *status_404_not_found = "404 Not_Found";
-static const char *status_405_method_not_allowed = "405 Method Not Allowed";
-static const char *status_505_http_version_not_supported = "505 HTTP Version Not Supported";
-
-static const char *header_server = "Server";
-static const char *header_date = "Date";
-static const char *header_connection_close = "Connection: close";
-
-static const char *header_content_length = "Content-Length";
-static const char *header_content_type = "Content-Type";
-
-static const char *mime_type_html = "text/html";
-static const char *mime_type_css = "text/css";
-static const char *mime_type_js = "application/javascript";
-static const char *mime_type_jpeg = "image/jpeg";
-static const char *mime_type_png = "image/png";
-static const char *mime_type_gif = "image/gif";
-static const char *mime_type_swf = "application/x-shockwave-flash";
-
-typedef struct http_request {
-    char *http_method;
-    char *http_version;
-    char *path;
-    char *query;
-
-    char *host;
-} http_request;
-
-static http_request *http_parse(const buffer *raw_request);
-static void http_request_free(http_request *request);
-
-static int respond_with_bad_request(const http_request *request, http_response *response);
+#define SERVER_HEADER "Server: v1.0\r\n"
+
+// pre-built responses without body, Connection and Date lines are appended by write_headers_tail()
+static const char response_400_bad_request[] =
+    "HTTP/1.1 400 Bad Request\r\n" SERVER_HEADER "Content-Length: 0\r\n";
+static const char response_403_forbidden[] =
+    "HTTP/1.1 403 Forbidden\r\n" SERVER_HEADER "Content-Length: 0\r\n";
+static const char response_404_not_found[] =
+    "HTTP/1.1 404 Not Found\r\n" SERVER_HEADER "Content-Length: 0\r\n";
+static const char response_405_method_not_allowed[] =
+    "HTTP/1.1 405 Method Not Allowed\r\n" SERVER_HEADER "Allow: GET, HEAD\r\n" "Content-Length: 0\r\n";
+static const char response_416_range_not_satisfiable_format[] =
+    "HTTP/1.1 416 Range Not Satisfiable\r\n" SERVER_HEADER "Content-Range: bytes */%zu\r\n" "Content-Length: 0\r\n";
+static const char response_431_request_header_fields_too_large[] =
+    "HTTP/1.1 431 Request Header Fields Too Large\r\n" SERVER_HEADER "Content-Length: 0\r\n";
+static const char response_505_http_version_not_supported[] =
+    "HTTP/1.1 505 HTTP Version Not Supported\r\n" SERVER_HEADER "Content-Length: 0\r\n";
+
+// file headers are rendered once per cached file, see file_headers()
+static const char *file_headers_format =
+    "HTTP/1.1 200 OK\r\n" SERVER_HEADER "Content-Length: %zu\r\n";
+static const char *file_headers_fields_format =
+    "Content-Type: %s\r\n" "%s%s%s%s" "Accept-Ranges: bytes\r\n" "ETag: %s\r\n" "Last-Modified: %s\r\n";
+
+static const char *metrics_headers_format =
+    "HTTP/1.1 200 OK\r\n" SERVER_HEADER "Content-Length: %zu\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n" "Cache-Control: no-store\r\n";
+
+#define INITIAL_METRICS_BUF_SIZE (16 * 1024)
+
+// validators are repeated in 304, it has neither body nor Content-Length
+static const char *not_modified_headers_format =
+    "HTTP/1.1 304 Not Modified\r\n" SERVER_HEADER "ETag: %s\r\n" "Last-Modified: %s\r\n" "%s";
+
+// partial response reuses file headers after Content-Length
+static const char *partial_headers_format =
+    "HTTP/1.1 206 Partial Content\r\n" SERVER_HEADER "Content-Length: %zu\r\n" "Content-Range: bytes %zu-%zu/%zu\r\n";
+
+// ETag is built from inode, size and mtime, like validators of most static servers: no content hashing
+#define ETAG_MAX_LEN (3 * 16 + 4)
+#define HTTP_DATE_LEN (sizeof("Sun, 06 Nov 1994 08:49:37 GMT") - 1)
+
+// Date line of every worker is formatted once a second by http_date_update(), with extra CRLF after it
+#define DATE_LINE_LEN (sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n") - 1)
+static _Thread_local char date_line[DATE_LINE_LEN + 2];
+static _Thread_local time_t date_line_time;
+
+static const char *header_connection_close = "Connection: close\r\n";
+static const char *header_connection_keep_alive = "Connection: keep-alive\r\n";
+static const char *header_vary = "Vary: Accept-Encoding\r\n";
+
+static int respond_with_bad_request(http_response *response);
+static int respond_with_request_too_large(http_response *response);
 static int respond_with_unsupported_http_version(http_response *response);
-static int respond_with_method_not_allowed(const http_request *request, http_response *response);
+static int respond_with_method_not_allowed(http_response *response);
+
+static int process_request(const char *raw_request, const http_request *request, http_response *response,
+    const char *static_root, int nonblocking);
+static int http_keep_alive(const http_request *request);
+static int negotiate_encoding(unsigned available, const char *value, size_t len);
 
-static int process_request(const http_request *request, http_response *response, const char *static_root);
+static http_response *handle_request(const char *raw_request, const http_request *request,
+    const char *static_root, http_pools *pools, int nonblocking);
+
+http_response *http_handler(const char *raw_request, const http_request *request, const char *static_root,
+        http_pools *pools, int nonblocking) {
+    http_response *response = handle_request(raw_request, request, static_root, pools, nonblocking);
+    arena_reset(&pools->request); // nothing allocated from arena outlives the request handling
+    return response;
+}
 
-http_response *http_handler(const buffer *raw_request, const char *static_root) {
-    if (raw_request == NULL) {
+static http_response *handle_request(const char *raw_request, const http_request *request,
+        const char *static_root, http_pools *pools, int nonblocking) {
+    if (raw_request == NULL || request == NULL) {
         fprintf(stderr, "http: got empty raw request\n");
         return NULL;
     }
@@ -65,198 +101,550 @@ http_response *http_handler(const buffer *raw_request, const char *static_root)
         return NULL;
     }
 
-    http_request *request = http_parse(raw_request);
-    if (request == NULL) {
-        fprintf(stderr, "http: got empty parsed request\n");
-        return NULL;
-    }
-
-    http_response *response = http_response_new();
+    http_response *response = http_response_new(pools);
     if (response == NULL) {
         fprintf(stderr, "http: cannot allocate response\n");
-        http_request_free(request);
         return NULL;
     }
 
     do {
-        if (request->http_method == NULL || request->path == NULL || request->http_version == NULL) {
-            if ((respond_with_bad_request(request, response)) < 0) {
+        if (request->too_large) {
+            if ((respond_with_request_too_large(response)) < 0) {
+                fprintf(stderr, "http: error respond with request too large\n");
+                http_response_free(response);
+                return NULL;
+            }
+            break;
+        }
+
+        if (request->malformed) {
+            if ((respond_with_bad_request(response)) < 0) {
                 fprintf(stderr, "http: error respond with bad request\n");
-                http_request_free(request);
                 http_response_free(response);
                 return NULL;
             }
             break;
         }
 
-        if (strncmp(request->http_version, "HTTP/1.1", strlen(request->http_version)) != 0 && // todo: check host?
-            strncmp(request->http_version, "HTTP/1.0", strlen(request->http_version)) != 0) {
+        if (request->version_major != 1 || request->version_minor > 1) { // todo: check host?
             if ((respond_with_unsupported_http_version(response)) < 0) {
                 fprintf(stderr, "http: error respond with bad protocol version\n");
-                http_request_free(request);
                 http_response_free(response);
                 return NULL;
             }
             break;
         }
 
-        if (strncmp(request->http_method, "GET", strlen(request->http_method)) == 0 ||
-            strncmp(request->http_method, "HEAD", strlen(request->http_method)) == 0) {
-            if ((process_request(request, response, static_root)) < 0) {
-                fprintf(stderr, "http: processing method %s error\n", request->http_method);
-                http_request_free(request);
+        response->keep_alive = http_keep_alive(request);
+
+        if (request->method == HTTP_METHOD_GET || request->method == HTTP_METHOD_HEAD) {
+            if ((process_request(raw_request, request, response, static_root, nonblocking)) < 0) {
+                int process_errno = errno;
+                if (process_errno != EWOULDBLOCK) {
+                    fprintf(stderr, "http: processing method %d error\n", request->method);
+                }
                 http_response_free(response);
+                errno = process_errno;
                 return NULL;
             }
             break;
         }
 
-        if ((respond_with_method_not_allowed(request, response)) < 0) {
+        if ((respond_with_method_not_allowed(response)) < 0) {
             fprintf(stderr, "http: error respond with method not allowed\n");
-            http_request_free(request);
             http_response_free(response);
             return NULL;
         }
     } while (0);
 
-    http_request_free(request);
     return response;
 }
 
+static const char *week_days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 
-static int write_start_string(http_response *response, const char *version, const char *status) {
-    if ((buffer_append_string_dynamically(&response->headers, version)) < 0) return -1;
-    if ((buffer_append_string_dynamically(&response->headers, " ")) < 0) return -1;
-    if ((buffer_append_string_dynamically(&response->headers, status)) < 0) return -1;
+static char *format_digits(char *p, int value, int width) {
+    for (int i = width - 1; i >= 0; i--) {
+        p[i] = '0' + value % 10;
+        value /= 10;
+    }
+    return p + width;
+}
 
-    return buffer_append_string_dynamically(&response->headers, crlf);
+// format_http_date writes IMF-fixdate (RFC 7231) by hand, so the result doesn't depend on locale.
+// Returns pointer past HTTP_DATE_LEN written bytes.
+static char *format_http_date(char *p, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+
+    memcpy(p, week_days[tm.tm_wday], 3);
+    memcpy(p + 3, ", ", 2);
+    p = format_digits(p + 5, tm.tm_mday, 2);
+    *p++ = ' ';
+    memcpy(p, months[tm.tm_mon], 3);
+    p[3] = ' ';
+    p = format_digits(p + 4, (tm.tm_year + 1900) % 10000, 4);
+    *p++ = ' ';
+    p = format_digits(p, tm.tm_hour, 2);
+    *p++ = ':';
+    p = format_digits(p, tm.tm_min, 2);
+    *p++ = ':';
+    p = format_digits(p, tm.tm_sec, 2);
+    memcpy(p, " GMT", 4);
+    return p + 4;
 }
 
-static int write_server_and_date(http_response *response) {
-    if ((buffer_append_string_dynamically(&response->headers, header_server)) < 0) return -1;
-    if ((buffer_append_string_dynamically(&response->headers, ": v1.0\r\n")) < 0) return -1;
-    if ((buffer_append_string_dynamically(&response->headers, header_date)) < 0) return -1;
-    time_t timer = time(NULL);
-    char *now = malloc(27);
-    sprintf(now, ": %.24s", ctime((&timer)));
-    if ((buffer_append_string_dynamically(&response->headers, now)) < 0) {
-        free(now);
-        return -1;
+void http_date_update(time_t now) {
+    if (now == date_line_time) {
+        return;
     }
-    free(now);
+    memcpy(date_line, "Date: ", 6);
+    memcpy(format_http_date(date_line + 6, now), "\r\n\r\n", 4);
+    date_line_time = now;
+}
+
+// format_etag writes strong ETag with quotes and terminating zero, dst has ETAG_MAX_LEN + 1 bytes.
+static void format_etag(char *dst, ino_t ino, size_t size, time_t mtime) {
+    snprintf(dst, ETAG_MAX_LEN + 1, "\"%llx-%llx-%llx\"",
+        (unsigned long long)ino, (unsigned long long)size, (unsigned long long)mtime);
+}
 
-    return buffer_append_string_dynamically(&response->headers, crlf);
+// format_last_modified writes Last-Modified value with terminating zero, dst has HTTP_DATE_LEN + 1 bytes.
+static void format_last_modified(char *dst, time_t mtime) {
+    *format_http_date(dst, mtime) = '\0';
 }
 
-static int write_headers_beginning(http_response *response, const char *version, const char *status) {
-    if ((write_start_string(response, version, status) < 0)) return -1;
-    if ((write_server_and_date(response)) < 0) return -1;
+// write_headers_tail finishes response headers with lines which differ between requests.
+static int write_headers_tail(http_response *response) {
+    const char *status = response->headers->data + sizeof("HTTP/1.1 ") - 1; // every block starts with status line
+    response->status = (status[0] - '0') * 100 + (status[1] - '0') * 10 + (status[2] - '0');
+
+    const char *connection = response->keep_alive ? header_connection_keep_alive : header_connection_close;
+    if ((buffer_append_dynamically(&response->headers, connection, strlen(connection))) < 0) return -1;
 
-    return buffer_append_string_dynamically(&response->headers, header_connection_close);
+    if (date_line_time == 0) {
+        http_date_update(time(NULL)); // thread without date timer
+    }
+    // date line is followed by CRLF which ends headers
+    return buffer_append_dynamically(&response->headers, date_line, DATE_LINE_LEN + 2);
+}
+
+// write_headers writes pre-rendered headers block and the per-request tail.
+static int write_headers(http_response *response, const char *block, size_t block_len) {
+    if ((buffer_append_dynamically(&response->headers, block, block_len)) < 0) return -1;
+
+    return write_headers_tail(response);
 }
 
 static int respond_with_unsupported_http_version(http_response *response) {
-    if ((write_headers_beginning(response, "HTTP/1.1", status_505_http_version_not_supported)) < 0) return -1;
+    return write_headers(response, response_505_http_version_not_supported,
+        sizeof(response_505_http_version_not_supported) - 1);
+}
 
-    return buffer_append_string_dynamically(&response->headers, http_end_of_request);
+static int respond_with_bad_request(http_response *response) {
+    return write_headers(response, response_400_bad_request, sizeof(response_400_bad_request) - 1);
 }
 
-static int respond_with_bad_request(const http_request *request, http_response *response) {
-    if ((write_headers_beginning(response, request->http_version == NULL ? "HTTP/1.1" : request->http_version,
-        status_400_bad_request)) < 0) return -1;
+static int respond_with_request_too_large(http_response *response) {
+    return write_headers(response, response_431_request_header_fields_too_large,
+        sizeof(response_431_request_header_fields_too_large) - 1);
+}
 
-    return buffer_append_string_dynamically(&response->headers, http_end_of_request);
+static int respond_with_forbidden(http_response *response) {
+    return write_headers(response, response_403_forbidden, sizeof(response_403_forbidden) - 1);
 }
 
-static int respond_with_forbidden(const http_request *request, http_response *response) {
-    if ((write_headers_beginning(response, request->http_version, status_403_forbidden)) < 0) return -1;
+static int respond_with_not_found(http_response *response) {
+    return write_headers(response, response_404_not_found, sizeof(response_404_not_found) - 1);
+}
 
-    return buffer_append_string_dynamically(&response->headers, http_end_of_request);
+static int respond_with_method_not_allowed(http_response *response) {
+    return write_headers(response, response_405_method_not_allowed, sizeof(response_405_method_not_allowed) - 1);
 }
 
-static int respond_with_not_found(const http_request *request, http_response *response) {
-    if ((write_headers_beginning(response, request->http_version, status_404_not_found)) < 0) return -1;
+// file_varies tells if response depends on Accept-Encoding: sidecar and the original it stands for
+// both say so to caches.
+static int file_varies(const file_entry *file) {
+    int vary = file->encoding != NULL;
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        vary |= file->encoded[i] != NULL;
+    }
+    return vary;
+}
+
+// file_headers returns 200 headers block of the file, rendering it on first use.
+// Workers may race to render it, the first one wins and the block stays with the entry.
+static const file_headers_block *file_headers(file_entry *file) {
+    file_headers_block *headers = __atomic_load_n(&file->headers, __ATOMIC_ACQUIRE);
+    if (headers != NULL) {
+        return headers;
+    }
 
-    return buffer_append_string_dynamically(&response->headers, http_end_of_request);
+    const char *encoding = file->encoding != NULL ? file->encoding : "";
+    const char *encoding_header = file->encoding != NULL ? "Content-Encoding: " : "";
+    const char *encoding_end = file->encoding != NULL ? "\r\n" : "";
+    const char *vary_header = file_varies(file) ? header_vary : "";
+    char etag[ETAG_MAX_LEN + 1];
+    format_etag(etag, file->ino, file->size, file->mtime);
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_last_modified(last_modified, file->mtime);
+
+    int fields_off = snprintf(NULL, 0, file_headers_format, file->size);
+    int headers_len = fields_off + snprintf(NULL, 0, file_headers_fields_format, file->mime_type,
+        encoding_header, encoding, encoding_end, vary_header, etag, last_modified);
+    if ((headers = malloc(sizeof(file_headers_block) + headers_len + 1)) == NULL) {
+        return NULL;
+    }
+    headers->len = headers_len;
+    headers->fields_off = fields_off;
+    snprintf(headers->data, fields_off + 1, file_headers_format, file->size);
+    snprintf(headers->data + fields_off, headers_len - fields_off + 1, file_headers_fields_format, file->mime_type,
+        encoding_header, encoding, encoding_end, vary_header, etag, last_modified);
+
+    file_headers_block *expected = NULL;
+    if (!__atomic_compare_exchange_n(&file->headers, &expected, headers, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(headers);
+        headers = expected;
+    }
+    return headers;
 }
 
-static int respond_with_method_not_allowed(const http_request *request, http_response *response) {
-    if ((write_headers_beginning(response, request->http_version, status_405_method_not_allowed)) < 0) return -1;
+static int is_ows(char c) {
+    return c == ' ' || c == '\t';
+}
 
-    return buffer_append_string_dynamically(&response->headers, http_end_of_request);
+// attach_body makes response body a slice of the file, from content cache if it's there.
+static void attach_body(http_response *response, file_entry *file, size_t offset, size_t len) {
+    response->body_offset = offset;
+    response->body_len = len;
+    if ((response->body_blob = file_content_get(file)) == NULL) {
+        file_entry_ref(file);
+        response->body_file = file;
+    }
 }
 
-static int respond_ok(const http_request *request, http_response *response, const char *file_path, size_t file_len) {
-    if ((write_headers_beginning(response, request->http_version, status_200_ok)) < 0) return -1;
-    if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-    if ((buffer_append_string_dynamically(&response->headers, header_content_length)) < 0) return -1;
+int http_respond_ok(http_response *response, file_entry *file, int with_body) {
+    const file_headers_block *headers = file_headers(file);
+    if (headers == NULL) {
+        return -1;
+    }
+    if (with_body) {
+        attach_body(response, file, 0, file->size);
+    }
+    return write_headers(response, headers->data, headers->len);
+}
+
+// respond_partial sends bytes first..last of the file, both inclusive.
+static int respond_partial(http_response *response, file_entry *file, size_t first, size_t last, int with_body) {
+    const file_headers_block *headers = file_headers(file);
+    if (headers == NULL) {
+        return -1;
+    }
+    char status[256];
+    int status_len = snprintf(status, sizeof(status), partial_headers_format,
+        last - first + 1, first, last, file->size);
+    if ((buffer_append_dynamically(&response->headers, status, status_len)) < 0) return -1;
+
+    if (with_body) {
+        attach_body(response, file, first, last - first + 1);
+    }
+    return write_headers(response, headers->data + headers->fields_off, headers->len - headers->fields_off);
+}
 
-    char string_file_len[32];
-    snprintf(string_file_len, sizeof(string_file_len), ": %zu", file_len);
+static int respond_with_range_not_satisfiable(http_response *response, file_entry *file) {
+    char headers[256];
+    int headers_len = snprintf(headers, sizeof(headers), response_416_range_not_satisfiable_format, file->size);
+    return write_headers(response, headers, headers_len);
+}
 
-    if ((buffer_append_string_dynamically(&response->headers, string_file_len)) < 0) return -1;
+// parse_http_date parses IMF-fixdate, the only format we send, e.g. `Sun, 06 Nov 1994 08:49:37 GMT`.
+static int parse_http_date(const char *value, size_t len, time_t *t) {
+    if (len != sizeof("Sun, 06 Nov 1994 08:49:37 GMT") - 1) {
+        return -1;
+    }
+    char date[32];
+    memcpy(date, value, len);
+    date[len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    *t = timegm(&tm);
+    return 0;
+}
 
-    char *ext = strrchr(file_path, '.');
-    if (ext != NULL) {
-        do {
-            if ((strncmp(ext, ".html", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_html)) < 0) return -1;
-                break;
-            }
-            if ((strncmp(ext, ".css", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_css)) < 0) return -1;
-                break;
-            }
-            if ((strncmp(ext, ".js", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_js)) < 0) return -1;
-                break;
-            }
-            if ((strncmp(ext, ".jpg", strlen(ext))) == 0 || (strncmp(ext, ".jpeg", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_jpeg)) < 0) return -1;
-                break;
+// if_range_matches tells if If-Range validator still matches the file, so Range can be honoured.
+// Entity tag is compared strongly, date must be exactly Last-Modified.
+static int if_range_matches(const char *value, size_t len, const file_entry *file) {
+    if (len > 0 && value[0] == '"') {
+        char etag[ETAG_MAX_LEN + 1];
+        format_etag(etag, file->ino, file->size, file->mtime);
+        return len == strlen(etag) && memcmp(value, etag, len) == 0;
+    }
+    time_t date;
+    return parse_http_date(value, len, &date) == 0 && date == file->mtime;
+}
+
+// etag_list_matches does weak comparison of If-None-Match list with our strong etag.
+static int etag_list_matches(const char *value, size_t len, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *end = value + len;
+    for (const char *p = value; p < end; ) {
+        if (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+            continue;
+        }
+        if (*p == '*') {
+            return 1; // any current representation
+        }
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        if (*p != '"') {
+            return 0; // malformed
+        }
+        const char *close = memchr(p + 1, '"', end - p - 1);
+        if (close == NULL) {
+            return 0;
+        }
+        if ((size_t)(close - p + 1) == etag_len && memcmp(p, etag, etag_len) == 0) {
+            return 1;
+        }
+        p = close + 1;
+    }
+    return 0;
+}
+
+// not_modified evaluates If-None-Match, or If-Modified-Since when there's no If-None-Match (RFC 9110 13.2.2).
+static int not_modified(const char *raw_request, const http_request *request,
+        ino_t ino, size_t size, time_t mtime) {
+    if (request->if_none_match.len > 0) {
+        char etag[ETAG_MAX_LEN + 1];
+        format_etag(etag, ino, size, mtime);
+        return etag_list_matches(raw_request + request->if_none_match.off, request->if_none_match.len, etag);
+    }
+    time_t since;
+    return request->if_modified_since.len > 0 &&
+        parse_http_date(raw_request + request->if_modified_since.off, request->if_modified_since.len, &since) == 0 &&
+        mtime <= since;
+}
+
+static int respond_with_not_modified(http_response *response, ino_t ino, size_t size, time_t mtime, int vary) {
+    char etag[ETAG_MAX_LEN + 1];
+    format_etag(etag, ino, size, mtime);
+    char last_modified[HTTP_DATE_LEN + 1];
+    format_last_modified(last_modified, mtime);
+    char headers[512];
+    int headers_len = snprintf(headers, sizeof(headers), not_modified_headers_format,
+        etag, last_modified, vary ? header_vary : "");
+    return write_headers(response, headers, headers_len);
+}
+
+// respond_not_modified_by_stat answers conditional request for file which isn't cached
+// looking only at stat() of it and its sidecars, so 304 never opens anything.
+// Returns 1 if 304 is written, 0 if request needs the file.
+static int respond_not_modified_by_stat(http_response *response, const char *raw_request,
+        const http_request *request, const char *path) {
+    struct stat file_stats;
+    if (stat(path, &file_stats) < 0 || !S_ISREG(file_stats.st_mode)) {
+        return 0; // full handling reports the error
+    }
+    struct stat encoded_stats[FILE_ENCODINGS];
+    file_stat_encoded(path, encoded_stats);
+    unsigned available = 0;
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        available |= encoded_stats[i].st_mode != 0 ? 1u << i : 0;
+    }
+
+    const struct stat *variant = &file_stats;
+    if (request->accept_encoding.len > 0) {
+        int encoding = negotiate_encoding(available, raw_request + request->accept_encoding.off,
+            request->accept_encoding.len);
+        if (encoding >= 0) {
+            variant = &encoded_stats[encoding];
+        }
+    }
+    if (!not_modified(raw_request, request, variant->st_ino, variant->st_size, variant->st_mtime)) {
+        return 0;
+    }
+    if (respond_with_not_modified(response, variant->st_ino, variant->st_size, variant->st_mtime,
+            available != 0) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+// parse_byte_pos parses non-negative decimal, saturating at SIZE_MAX.
+static const char *parse_byte_pos(const char *p, const char *end, size_t *pos) {
+    if (p == end || !isdigit(*p)) {
+        return NULL;
+    }
+    size_t value = 0;
+    for (; p < end && isdigit(*p); p++) {
+        size_t digit = *p - '0';
+        value = value > (SIZE_MAX - digit) / 10 ? SIZE_MAX : value * 10 + digit;
+    }
+    *pos = value;
+    return p;
+}
+
+enum range_result {
+    RANGE_IGNORE = 0, // send the whole file
+    RANGE_PARTIAL,
+    RANGE_NOT_SATISFIABLE,
+};
+
+// parse_range resolves `Range: bytes=` value against file size into inclusive first..last.
+// Only a single range is served; invalid and multiple ranges are ignored, as RFC 9110 allows.
+static int parse_range(const char *value, size_t len, size_t size, size_t *first, size_t *last) {
+    const char *end = value + len;
+    if (len < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return RANGE_IGNORE;
+    }
+    const char *p = value + 6;
+    while (p < end && is_ows(*p)) {
+        p++;
+    }
+
+    size_t start = 0, stop = 0;
+    if (p < end && *p == '-') {
+        // suffix: last N bytes
+        size_t suffix;
+        if ((p = parse_byte_pos(p + 1, end, &suffix)) == NULL) {
+            return RANGE_IGNORE;
+        }
+        if (suffix == 0 || size == 0) {
+            start = SIZE_MAX; // unsatisfiable, checked once the syntax is known to be valid
+        } else {
+            start = suffix < size ? size - suffix : 0;
+            stop = size - 1;
+        }
+    } else {
+        if ((p = parse_byte_pos(p, end, &start)) == NULL || p == end || *p != '-') {
+            return RANGE_IGNORE;
+        }
+        p++;
+        stop = SIZE_MAX;
+        if (p < end && isdigit(*p)) {
+            p = parse_byte_pos(p, end, &stop);
+            if (stop < start) {
+                return RANGE_IGNORE;
             }
-            if ((strncmp(ext, ".png", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_png)) < 0) return -1;
-                break;
+        }
+        if (size > 0 && stop > size - 1) {
+            stop = size - 1;
+        }
+    }
+    while (p < end && is_ows(*p)) {
+        p++;
+    }
+    if (p != end) {
+        return RANGE_IGNORE; // garbage or more than one range
+    }
+
+    if (start >= size) {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    *first = start;
+    *last = stop;
+    return RANGE_PARTIAL;
+}
+
+// parse_qvalue parses weight of Accept-Encoding item in thousandths, -1 if it's invalid.
+static int parse_qvalue(const char *p, const char *end) {
+    if (p == end || (*p != '0' && *p != '1')) {
+        return -1;
+    }
+    int q = (*p++ - '0') * 1000;
+    if (p < end && *p == '.') {
+        p++;
+        for (int scale = 100; scale > 0 && p < end && isdigit(*p); scale /= 10) {
+            q += (*p++ - '0') * scale;
+        }
+    }
+    return q > 1000 ? 1000 : q;
+}
+
+// negotiate_encoding picks the sidecar accepted by Accept-Encoding with the highest weight, br on a tie.
+// Returns -1 if there's no acceptable one, then the original file is sent.
+// available has bit per file_encoding of existing sidecar.
+static int negotiate_encoding(unsigned available, const char *value, size_t len) {
+    static const struct {
+        const char *name;
+        int encoding;
+    } codings[] = {
+        { "br", FILE_ENCODING_BR }, { "gzip", FILE_ENCODING_GZIP }, { "x-gzip", FILE_ENCODING_GZIP },
+    };
+    int weights[FILE_ENCODINGS];
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        weights[i] = -1; // not listed
+    }
+    int any_weight = -1;
+
+    const char *end = value + len;
+    for (const char *p = value; p < end; ) {
+        const char *item_end = memchr(p, ',', end - p);
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        while (p < item_end && is_ows(*p)) {
+            p++;
+        }
+        const char *coding = p;
+        while (p < item_end && *p != ';' && !is_ows(*p)) {
+            p++;
+        }
+        size_t coding_len = p - coding;
+
+        int weight = 1000;
+        for (const char *param; (param = memchr(p, ';', item_end - p)) != NULL; ) {
+            p = param + 1;
+            while (p < item_end && is_ows(*p)) {
+                p++;
             }
-            if ((strncmp(ext, ".gif", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_gif)) < 0) return -1;
-                break;
+            if (item_end - p >= 2 && (*p == 'q' || *p == 'Q') && p[1] == '=') {
+                weight = parse_qvalue(p + 2, item_end);
             }
-            if ((strncmp(ext, ".swf", strlen(ext))) == 0) {
-                if ((buffer_append_string_dynamically(&response->headers, crlf)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, header_content_type)) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, ": ")) < 0) return -1;
-                if ((buffer_append_string_dynamically(&response->headers, mime_type_swf)) < 0) return -1;
+        }
+
+        if (coding_len == 1 && *coding == '*') {
+            any_weight = weight;
+        }
+        for (size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); i++) {
+            if (coding_len == strlen(codings[i].name) && strncasecmp(coding, codings[i].name, coding_len) == 0) {
+                weights[codings[i].encoding] = weight;
             }
-        } while (0);
+        }
+        p = item_end + 1;
     }
 
-    return buffer_append_string_dynamically(&response->headers, http_end_of_request);
+    int best = -1;
+    int best_weight = 0; // q=0 means not acceptable
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        int weight = weights[i] >= 0 ? weights[i] : any_weight;
+        if ((available & (1u << i)) && weight > best_weight) {
+            best = i;
+            best_weight = weight;
+        }
+    }
+    return best;
 }
 
-static void url_decode(char *dst, const char *src) {
+size_t http_url_decode(char *dst, const char *src, size_t len) {
+    const char *end = src + len;
+    const char *start = dst;
     char a, b;
-    while (*src) {
-        if ((*src == '%') &&
+    while (src < end) {
+        size_t plain = scan.escape(src, end - src); // copy everything up to the next escape at once
+        memcpy(dst, src, plain);
+        dst += plain;
+        src += plain;
+        if (src == end) {
+            break;
+        }
+        if ((*src == '%') && end - src > 2 &&
             ((a = src[1]) && (b = src[2])) &&
             (isxdigit(a) && isxdigit(b))) {
             if (a >= 'a')
@@ -280,282 +668,284 @@ static void url_decode(char *dst, const char *src) {
             *dst++ = *src++;
         }
     }
-    *dst++ = '\0';
+    *dst = '\0';
+    return dst - start;
+}
+
+// normalize_path collapses `//` and `/./` in place so every file has one cache key.
+// Returns -1 if path has `..` segment escaping document root.
+static int normalize_path(char *path, size_t len) {
+    // nothing to rewrite before the first `//` or `/.`, most paths don't have one at all
+    size_t clean = scan.dot_segment(path, len);
+    if (clean == len) {
+        return 0;
+    }
+    char *dst = path + clean;
+    const char *src = path + clean;
+    while (*src) {
+        if (*src == '/' && dst > path && dst[-1] == '/') {
+            src++; // duplicate slash
+            continue;
+        }
+        if (*src == '.' && (dst == path || dst[-1] == '/')) {
+            if (src[1] == '/' || src[1] == '\0') {
+                src += src[1] == '/' ? 2 : 1; // `.` segment
+                continue;
+            }
+            if (src[1] == '.' && (src[2] == '/' || src[2] == '\0')) {
+                return -1;
+            }
+        }
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+    return 0;
 }
 
-static char *clean_and_get_full_path(const char *static_root, const char *path) {
-    char *file_path = malloc(strlen(path));
-    if (file_path == NULL) {
+char *http_full_path(arena *arena, const char *static_root, const char *path, size_t path_len) {
+    size_t root_len = strlen(static_root);
+    size_t default_len = strlen(default_directory_file);
+    // decoded path is never longer than the raw one, room for index.html is reserved upfront
+    char *full_path = arena_alloc(arena, root_len + path_len + default_len + 1);
+    if (full_path == NULL) {
         return NULL;
     }
+    memcpy(full_path, static_root, root_len);
+    char *file_path = full_path + root_len;
 
-    url_decode(file_path, path);
+    size_t decoded_len = http_url_decode(file_path, path, path_len);
+    if (file_path[0] != '/' || strlen(file_path) != decoded_len || normalize_path(file_path, decoded_len) < 0) {
+        // relative and absolute-form targets aren't served, neither are paths with %00
+        errno = EACCES;
+        return NULL;
+    }
 
     // check directory
     size_t file_path_len = strlen(file_path);
     if (file_path[file_path_len - 1] == '/') {
         // append index.html
-        size_t default_len = strlen(default_directory_file);
-        char *tmp = realloc(file_path, file_path_len + default_len + 1);
-        if (tmp == NULL) {
-            free(file_path);
-            return NULL;
-        }
-        file_path = tmp;
-
-        memcpy(file_path + file_path_len, default_directory_file, default_len);
-        file_path[file_path_len + default_len] = '\0';
+        memcpy(file_path + file_path_len, default_directory_file, default_len + 1);
     }
 
-    // concat root and path
-    size_t full_path_len = strlen(static_root) + strlen(file_path) + 1;
-    char *full_path = malloc(full_path_len);
-    if (full_path == NULL) {
-        free(file_path);
-        return NULL;
-    }
-    snprintf(full_path, full_path_len, "%s%s", static_root, file_path);
-    free(file_path);
-
     return full_path;
 }
 
-static int process_request(const http_request *request, http_response *response, const char *static_root) {
-    if (strstr(request->path, "/../")) { // document root escaping forbidden
-        if ((respond_with_forbidden(request, response)) < 0) {
+// file_variant picks the original file or its sidecar by Accept-Encoding of request.
+// Sidecars are resolved even if client accepts none, headers of the original depend on them.
+static file_entry *file_variant(file_entry *file, const char *raw_request, const http_request *request) {
+    file_entry *const *encoded = file_entry_encoded(file);
+    if (request->accept_encoding.len == 0) {
+        return file;
+    }
+    unsigned available = 0;
+    for (int i = 0; i < FILE_ENCODINGS; i++) {
+        available |= encoded[i] != NULL ? 1u << i : 0;
+    }
+    int encoding = negotiate_encoding(available, raw_request + request->accept_encoding.off,
+        request->accept_encoding.len);
+    return encoding >= 0 ? encoded[encoding] : file;
+}
+
+// respond_with_metrics renders metrics of all workers into a blob of its own.
+static int respond_with_metrics(http_response *response, int with_body) {
+    buffer *body = buffer_new(INITIAL_METRICS_BUF_SIZE);
+    if (body == NULL) {
+        return -1;
+    }
+    if (metrics_render(&body) < 0) {
+        buffer_free(body);
+        return -1;
+    }
+    char headers[256];
+    int headers_len = snprintf(headers, sizeof(headers), metrics_headers_format, body->len);
+    if (with_body) {
+        if ((response->body_blob = file_blob_new(body->data, body->len)) == NULL) {
+            buffer_free(body);
             return -1;
         }
+        response->body_offset = 0;
+        response->body_len = body->len;
     }
+    buffer_free(body);
+    return write_headers(response, headers, headers_len);
+}
 
-    char *full_path = clean_and_get_full_path(static_root, request->path);
-    size_t file_len;
-    if ((strncmp(request->http_method, "GET", strlen(request->http_method))) == 0) {
-        void *file = (void *) response->body;
-        file_open(full_path, &file, &file_len);
-        if (file == NULL) {
-            switch (errno) {
-                case ENOENT: // file doesn't exist
-                case EINVAL:
-                    if ((respond_with_not_found(request, response)) < 0) {
-                        free(full_path);
-                        return -1;
-                    }
-                    break;
-                default:
-                    free(full_path);
-                    return -1;
-            }
-            free(full_path);
-            return 0;
-        }
+static int process_request(const char *raw_request, const http_request *request, http_response *response,
+        const char *static_root, int nonblocking) {
+    if (request->path.len == sizeof(METRICS_PATH) - 1 &&
+            memcmp(raw_request + request->path.off, METRICS_PATH, request->path.len) == 0) {
+        return respond_with_metrics(response, request->method == HTTP_METHOD_GET);
+    }
 
-        response->body = file;
-        response->body_len = file_len;
-    } else {
-        // HEAD
-        struct stat *file_stats = file_get_info(full_path);
-        if (file_stats == NULL) {
-            switch (errno) {
-                case ENOENT: // file doesn't exist
-                case EINVAL:
-                    if ((respond_with_not_found(request, response)) < 0) {
-                        free(full_path);
-                        return -1;
-                    }
-                    break;
-                default:
-                    free(full_path);
-                    return -1;
-            }
-            free(full_path);
-            return 0;
+    char *full_path = http_full_path(&response->pools->request, static_root,
+        raw_request + request->path.off, request->path.len);
+    if (full_path == NULL) {
+        if (errno == EACCES) { // document root escaping forbidden
+            return respond_with_forbidden(response);
         }
-        file_len = file_stats->st_size;
-        free(file_stats);
+        return -1;
     }
 
-    int r = respond_ok(request, response, full_path, file_len);
-    free(full_path);
-    return r;
-}
-
-//
-// http_response
-//
-
-http_response *http_response_new() {
-    http_response *response = calloc(1, sizeof(http_response));
-    if (response == NULL) {
-        return NULL;
+    int conditional = request->if_none_match.len > 0 || request->if_modified_since.len > 0;
+    file_entry *file = NULL;
+    if (conditional || nonblocking) {
+        file = file_cache_find(full_path);
+        if (file == NULL && (errno == ENOENT || errno == ENOTDIR)) {
+            return respond_with_not_found(response); // known to be missing, nothing to stat or open
+        }
     }
-    if ((response->headers = buffer_new(INITIAL_HEADERS_BUF_SIZE)) == NULL) {
-        free(response);
-        return NULL;
+    if (file == NULL && nonblocking) {
+        errno = EWOULDBLOCK; // stat() or open() is needed
+        return -1;
+    }
+    if (file == NULL && conditional) {
+        int r = respond_not_modified_by_stat(response, raw_request, request, full_path);
+        if (r != 0) {
+            return r < 0 ? -1 : 0;
+        }
+    }
+    if (file == NULL && (file = file_cache_get(full_path)) == NULL) {
+        switch (errno) {
+            case ENOENT: // file doesn't exist
+            case ENOTDIR:
+            case ENAMETOOLONG:
+            case EINVAL:
+                return respond_with_not_found(response);
+            case EACCES:
+                return respond_with_forbidden(response);
+            default:
+                return -1;
+        }
     }
 
-    return response;
-}
+    if (nonblocking && !file_entry_encoded_resolved(file)) {
+        file_entry_unref(file);
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+    file_entry *variant = file_variant(file, raw_request, request);
 
-void http_response_free(http_response *resp) {
-    if (resp == NULL) {
-        return;
+    if (conditional && not_modified(raw_request, request, variant->ino, variant->size, variant->mtime)) {
+        int r = respond_with_not_modified(response, variant->ino, variant->size, variant->mtime,
+            file_varies(variant));
+        file_entry_unref(file);
+        return r;
     }
 
-    buffer_free(resp->headers);
-    if (resp->body != NULL) {
-        file_close(resp->body, resp->body_len);
+    int r;
+    size_t first, last;
+    int range = RANGE_IGNORE;
+    if (request->method == HTTP_METHOD_GET && request->range.len > 0 && (request->if_range.len == 0 ||
+            if_range_matches(raw_request + request->if_range.off, request->if_range.len, variant))) {
+        range = parse_range(raw_request + request->range.off, request->range.len, variant->size, &first, &last);
+    }
+    int with_body = range == RANGE_PARTIAL || (range == RANGE_IGNORE && request->method == HTTP_METHOD_GET);
+    if (nonblocking && with_body && variant->size > 0 && !file_content_ready(variant)) {
+        file_entry_unref(file);
+        errno = EWOULDBLOCK;
+        return -1;
     }
+    switch (range) {
+        case RANGE_PARTIAL:
+            r = respond_partial(response, variant, first, last, 1);
+            break;
+        case RANGE_NOT_SATISFIABLE:
+            r = respond_with_range_not_satisfiable(response, variant);
+            break;
+        default:
+            r = http_respond_ok(response, variant, request->method == HTTP_METHOD_GET);
+    }
+    file_entry_unref(file);
+    return r;
 }
 
-//
-// http_request (internal)
-//
-
-static http_request *http_request_new() {
-    return calloc(1, sizeof(http_request));
+void http_prefetch(const char *raw_request, const http_request *request, const char *static_root, arena *arena) {
+    if (request->too_large || request->malformed || request->version_major != 1 || request->version_minor > 1 ||
+            (request->method != HTTP_METHOD_GET && request->method != HTTP_METHOD_HEAD)) {
+        return; // answered without file system
+    }
+    char *full_path = http_full_path(arena, static_root, raw_request + request->path.off, request->path.len);
+    file_entry *file;
+    if (full_path == NULL || (file = file_cache_get(full_path)) == NULL) {
+        arena_reset(arena);
+        return; // missing file is remembered by the cache, other errors are answered by worker again
+    }
+    arena_reset(arena);
+
+    // the same representation and range as the worker picks
+    file_entry *variant = file_variant(file, raw_request, request);
+    size_t first = 0, last = variant->size - 1;
+    int range = RANGE_IGNORE;
+    if (request->method == HTTP_METHOD_GET && request->range.len > 0 && (request->if_range.len == 0 ||
+            if_range_matches(raw_request + request->if_range.off, request->if_range.len, variant))) {
+        range = parse_range(raw_request + request->range.off, request->range.len, variant->size, &first, &last);
+    }
+    if (range != RANGE_PARTIAL) {
+        first = 0;
+        last = variant->size - 1;
+    }
+    if (request->method == HTTP_METHOD_GET && variant->size > 0 && range != RANGE_NOT_SATISFIABLE) {
+        file_blob *blob = file_content_get(variant);
+        if (blob != NULL) {
+            file_blob_unref(blob); // stays in content cache if it fits there
+        } else {
+            file_warm(variant, first, last - first + 1);
+        }
+    }
+    file_entry_unref(file);
 }
 
-static void http_request_free(http_request *req) {
-    if (req == NULL) {
-        return;
+// http_keep_alive tells if connection persists after the response:
+// HTTP/1.1 keeps it unless `Connection: close`, HTTP/1.0 closes it unless `Connection: keep-alive`.
+// Request body must not be taken for the next request, so only one the server drops keeps it open.
+static int http_keep_alive(const http_request *request) {
+    if (request->transfer_encoding || request->content_length > HTTP_MAX_DISCARDED_BODY) {
+        return 0;
+    }
+    if (request->version_minor == 1) {
+        return !request->connection_close;
     }
 
-    free(req->http_method);
-    free(req->http_version);
-    free(req->path);
-    free(req->query);
-    free(req->host);
-    free(req);
+    return request->connection_keep_alive;
 }
 
 //
-// parse
+// http_response
 //
 
-static http_request *http_parse(const buffer *raw_request) {
-    http_request *request = http_request_new();
-    if (request == NULL) {
-        return NULL;
-    }
-
-    size_t lines_cap = 4;
-    size_t lines_len = 0;
-    char **lines = malloc(lines_cap * sizeof(char *));
-    if (lines == NULL) {
-        free(request);
-        return NULL;
-    }
-
-    // split raw request into lines
-    char *cur_line = raw_request->data; // start at beginning
-    size_t remaining_length = raw_request->len;
-    size_t word_len;
-    size_t sep_len = strlen(crlf);
-    char *cur_sep_position;
-    while ((cur_sep_position = memmem(cur_line, remaining_length, crlf, sep_len)) != NULL) {
-        word_len = cur_sep_position - cur_line;
-        if (word_len == 0) { // that's end (because it's substring between crlf and crlf
-            // we don't care if request starts with crlf
-            break;
-        }
+void http_pools_init(http_pools *pools) {
+    // response objects carry initial header buffer storage right after them
+    object_pool_init(&pools->responses, sizeof(http_response) + HTTP_INITIAL_HEADERS_BUF_SIZE, MAX_FREE_RESPONSES);
+    arena_init(&pools->request, REQUEST_ARENA_CHUNK_SIZE);
+}
 
-        if (lines_len == lines_cap) {
-            char **tmp = realloc(lines, lines_cap * sizeof(char *) * 2);
-            if (tmp == NULL) {
-                http_request_free(request);
-                for (size_t j = 0; j < lines_len; j++) {
-                    free(lines[j]);
-                }
-                free(lines);
-                return NULL;
-            }
-            lines = tmp;
-            lines_cap *= 2;
-        }
-        lines[lines_len] = malloc(word_len + 1);
-        memcpy(lines[lines_len], cur_line, word_len);
-        lines[lines_len][word_len] = '\0'; // terminate string
-        lines_len++;
-
-        cur_line = cur_sep_position + sep_len;
-        if (cur_line >= (raw_request->data + raw_request->len)) {
-            // end of string, this should never happen, if string has crlf-crlf ending
-            fprintf(stderr, "Got strange raw_request: `%.*s\n`", (int)raw_request->len, raw_request->data);
-            break;
-        }
-        remaining_length -= (word_len + sep_len);
-    }
+void http_pools_destroy(http_pools *pools) {
+    object_pool_destroy(&pools->responses);
+    arena_destroy(&pools->request);
+}
 
-    if (lines_len == 0) { // oops, there are no headers
-        http_request_free(request);
-        for (size_t j = 0; j < lines_len; j++) {
-            free(lines[j]);
-        }
-        free(lines);
+http_response *http_response_new(http_pools *pools) {
+    http_response *response = object_pool_get(&pools->responses);
+    if (response == NULL) {
         return NULL;
     }
+    memset(response, 0, sizeof(http_response));
+    response->pools = pools;
+    buffer_init(&response->headers_buf, response->headers_data, HTTP_INITIAL_HEADERS_BUF_SIZE);
+    response->headers = &response->headers_buf;
 
-    // first line should be METHOD /PATH HTTP/VERSION
-    char *query;
-    for (size_t i = 0; (cur_line = strsep(&lines[0], " ")) != NULL; i++) {
-        switch (i) {
-            case 0: // method
-                if ((request->http_method = strdup(cur_line)) == NULL) {
-                    http_request_free(request);
-                    for (size_t j = 0; j < lines_len; j++) {
-                        free(lines[j]);
-                    }
-                    free(lines);
-                    return NULL;
-                }
-                break;
-            case 1: // path
-                if ((query = strstr(cur_line, "?")) != NULL) {
-                    *query = '\0';
-                    if ((request->query = strdup(++query)) == NULL) {
-                        http_request_free(request);
-                        for (size_t j = 0; j < lines_len; j++) {
-                            free(lines[j]);
-                        }
-                        free(lines);
-                    }
-                }
-                if ((request->path = strdup(cur_line)) == NULL) {
-                    http_request_free(request);
-                    for (size_t j = 0; j < lines_len; j++) {
-                        free(lines[j]);
-                    }
-                    free(lines);
-                }
-                break;
-            case 2: // http version
-                if ((request->http_version = strdup(cur_line)) == NULL) {
-                    http_request_free(request);
-                    for (size_t j = 0; j < lines_len; j++) {
-                        free(lines[j]);
-                    }
-                    free(lines);
-                    return NULL;
-                }
-                break;
-            default: // unexpected tokens, expected 3
-                http_request_free(request);
-                for (size_t j = 0; j < lines_len; j++) {
-                    free(lines[j]);
-                }
-                free(lines);
-                return NULL;
-        }
-    }
+    return response;
+}
 
-    for (size_t i = 1; i < lines_len; i++) {
-        // todo: parse headers
+void http_response_free(http_response *resp) {
+    if (resp == NULL) {
+        return;
     }
 
-    for (size_t i = 0; i < lines_len; i++) {
-        free(lines[i]);
+    if (!resp->headers->external) {
+        free(resp->headers->data); // headers outgrew pooled storage
     }
-    free(lines);
-
-    return request;
+    file_blob_unref(resp->body_blob);
+    file_entry_unref(resp->body_file);
+    object_pool_put(&resp->pools->responses, resp);
 }
@@ -0,0 +1,175 @@
+#include "iopool.h"
+
+#include "http.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define IO_ARENA_CHUNK_SIZE 4096 // full path of the request
+
+struct io_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    io_job *head; // FIFO of submitted jobs
+    io_job *tail;
+    int stopping;
+
+    pthread_t *threads;
+    int threads_len;
+};
+
+static void *io_pool_process(void *arg);
+
+io_pool *io_pool_new(int threads, const cpu_set_t *cpus) {
+    io_pool *pool = calloc(1, sizeof(io_pool));
+    if (pool == NULL) {
+        perror("I/O pool allocate error");
+        return NULL;
+    }
+    if ((pool->threads = calloc(threads, sizeof(pthread_t))) == NULL) {
+        perror("I/O pool allocate error");
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (cpus != NULL) {
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+        }
+        int r = pthread_create(&pool->threads[i], &attr, io_pool_process, pool);
+        pthread_attr_destroy(&attr);
+        if (r != 0) {
+            errno = r;
+            perror("I/O pool pthread creation error");
+            io_pool_free(pool);
+            return NULL;
+        }
+        pool->threads_len++;
+    }
+    return pool;
+}
+
+void io_pool_free(io_pool *pool) {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threads_len; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->ready);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+io_job *io_job_new(void *owner, io_completions *done, const char *static_root,
+        const char *raw, size_t raw_len, const http_request *request) {
+    io_job *job = malloc(sizeof(io_job) + raw_len);
+    if (job == NULL) {
+        return NULL;
+    }
+    job->next = NULL;
+    job->owner = owner;
+    job->done = done;
+    job->static_root = static_root;
+    memcpy(&job->request, request, sizeof(http_request));
+    job->raw_len = raw_len;
+    memcpy(job->raw, raw, raw_len);
+    return job;
+}
+
+void io_pool_submit(io_pool *pool, io_job *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pthread_cond_signal(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int io_completions_init(io_completions *done) {
+    done->jobs = NULL;
+    if ((done->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void io_completions_destroy(io_completions *done) {
+    close(done->fd);
+}
+
+// io_completions_take reads eventfd before taking the jobs: a job pushed after that finds the stack
+// empty and writes eventfd again, so the worker can't miss it.
+io_job *io_completions_take(io_completions *done) {
+    uint64_t wakeups;
+    if (read(done->fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        perror("I/O completion eventfd read error");
+    }
+    return __atomic_exchange_n(&done->jobs, NULL, __ATOMIC_ACQ_REL);
+}
+
+// io_complete pushes job to the worker's stack, worker is woken up only by the push which finds it empty.
+static void io_complete(io_job *job) {
+    io_completions *done = job->done;
+    io_job *head = __atomic_load_n(&done->jobs, __ATOMIC_RELAXED);
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&done->jobs, &head, job, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(done->fd, &one, sizeof(one)) < 0) {
+            perror("I/O completion wakeup error"); // job is taken with the next one
+        }
+    }
+}
+
+static void *io_pool_process(void *arg) {
+    io_pool *pool = (io_pool *)arg;
+    arena arena;
+    arena_init(&arena, IO_ARENA_CHUNK_SIZE);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        io_job *job = pool->head;
+        if (job == NULL) {
+            break; // stopping and nothing is left
+        }
+        if ((pool->head = job->next) == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        http_prefetch(job->raw, &job->request, job->static_root, &arena);
+        io_complete(job);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    arena_destroy(&arena);
+    return NULL;
+}
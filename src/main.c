@@ -34,11 +34,13 @@ int main(int argc, char **argv) {
 
     serve_config *cfg = parse_serve_config(cfg_location);
     if (cfg == NULL) {
+        free(cfg_location);
         return 1;
     }
     cfg->addr = INADDR_ANY;
 
-    int r = listen_and_serve_http(cfg);
-    free(cfg);
+    int r = listen_and_serve_http(cfg, cfg_location, argv);
+    free_serve_config(cfg);
+    free(cfg_location);
     return r;
 }
@@ -0,0 +1,235 @@
+#include "metrics.h"
+
+#include "file.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static worker_metrics *workers;
+static int workers_len;
+
+static const int tracked_statuses[METRICS_STATUSES - 1] = { 200, 206, 304, 400, 403, 404, 405, 416, 431, 505 };
+static const char *close_reasons[CLOSE_REASONS] = { "done", "eof", "timeout", "error", "internal" };
+static const char *pool_names[] = { "clients", "responses", "request_arena" };
+
+int metrics_init(int n) {
+    if ((workers = aligned_alloc(64, n * sizeof(worker_metrics))) == NULL) {
+        perror("Metrics allocate error");
+        return -1;
+    }
+    memset(workers, 0, n * sizeof(worker_metrics));
+    workers_len = n;
+    return 0;
+}
+
+worker_metrics *metrics_worker(int i) {
+    return &workers[i];
+}
+
+int metrics_status_index(int status) {
+    for (int i = 0; i < METRICS_STATUSES - 1; i++) {
+        if (tracked_statuses[i] == status) {
+            return i;
+        }
+    }
+    return METRICS_STATUSES - 1;
+}
+
+static int hist_index(uint64_t us) {
+    if (us >= (uint64_t)2 << METRICS_HIST_MAX_BITS) {
+        return METRICS_HIST_BUCKETS - 1; // overflow, the last finite bucket ends right below
+    }
+    int msb = 63 - __builtin_clzll(us | 1);
+    if (msb < METRICS_HIST_SUB_BITS) {
+        return (int)us;
+    }
+    int shift = msb - METRICS_HIST_SUB_BITS;
+    return ((shift + 1) << METRICS_HIST_SUB_BITS) + (int)((us >> shift) - (1 << METRICS_HIST_SUB_BITS));
+}
+
+// hist_upper_us returns exclusive upper bound of bucket.
+static uint64_t hist_upper_us(int index) {
+    if (index < 1 << METRICS_HIST_SUB_BITS) {
+        return index + 1;
+    }
+    int shift = (index >> METRICS_HIST_SUB_BITS) - 1;
+    uint64_t low = ((uint64_t)(index & ((1 << METRICS_HIST_SUB_BITS) - 1)) + (1 << METRICS_HIST_SUB_BITS)) << shift;
+    return low + ((uint64_t)1 << shift);
+}
+
+void metrics_observe(metrics_histogram *hist, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    metrics_add(&hist->counts[hist_index(us)], 1);
+    metrics_add(&hist->sum_us, us);
+}
+
+uint64_t metrics_loop_lag(worker_metrics *m, uint64_t armed_ns) {
+    uint64_t now = metrics_now_ns();
+    uint64_t due = armed_ns + METRICS_LOOP_LAG_INTERVAL_MS * 1000000ULL;
+    metrics_observe(&m->loop_lag, now > due ? now - due : 0);
+    return now;
+}
+
+void metrics_request_done(worker_metrics *m, const http_response *response, uint64_t start_ns) {
+    metrics_add(&m->requests[metrics_status_index(response->status)], 1);
+    metrics_add(&m->bytes_sent, response->headers->len + response->body_len);
+    metrics_observe(&m->total, metrics_now_ns() - start_ns);
+}
+
+//
+// rendering
+//
+
+static uint64_t load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static int append_format(buffer **buf, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line)) {
+        return -1;
+    }
+    return buffer_append_dynamically(buf, line, len);
+}
+
+static int append_header(buffer **buf, const char *name, const char *type, const char *help) {
+    return append_format(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// append_per_worker writes one sample per worker of the counter at offset in worker_metrics.
+static int append_per_worker(buffer **buf, const char *name, const char *type, const char *help, size_t offset) {
+    if (append_header(buf, name, type, help) < 0) return -1;
+    for (int i = 0; i < workers_len; i++) {
+        uint64_t value = load((const uint64_t *)((const char *)&workers[i] + offset));
+        if (append_format(buf, "%s{worker=\"%d\"} %llu\n", name, i, (unsigned long long)value) < 0) return -1;
+    }
+    return 0;
+}
+
+static int append_histogram(buffer **buf, const char *name, const char *help, size_t offset) {
+    if (append_header(buf, name, "histogram", help) < 0) return -1;
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+    for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        for (int i = 0; i < workers_len; i++) {
+            const metrics_histogram *hist = (const metrics_histogram *)((const char *)&workers[i] + offset);
+            count += load(&hist->counts[b]);
+        }
+        if (b == METRICS_HIST_BUCKETS - 1) {
+            break; // overflow bucket is counted by +Inf only
+        }
+        if (append_format(buf, "%s_bucket{le=\"%g\"} %llu\n", name, hist_upper_us(b) / 1e6,
+                (unsigned long long)count) < 0) return -1;
+    }
+    for (int i = 0; i < workers_len; i++) {
+        sum_us += load(&((const metrics_histogram *)((const char *)&workers[i] + offset))->sum_us);
+    }
+    if (append_format(buf, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count) < 0) return -1;
+    if (append_format(buf, "%s_sum %.6f\n", name, sum_us / 1e6) < 0) return -1;
+    return append_format(buf, "%s_count %llu\n", name, (unsigned long long)count);
+}
+
+static int append_pools(buffer **buf, const char *name, const char *help, int misses) {
+    if (append_header(buf, name, "counter", help) < 0) return -1;
+    for (int i = 0; i < workers_len; i++) {
+        const worker_metrics *m = &workers[i];
+        unsigned long values[3][2] = { { 0, 0 }, { 0, 0 }, { 0, 0 } };
+        if (m->clients != NULL) {
+            values[0][0] = __atomic_load_n(&m->clients->hits, __ATOMIC_RELAXED);
+            values[0][1] = __atomic_load_n(&m->clients->misses, __ATOMIC_RELAXED);
+        }
+        if (m->http_pools != NULL) {
+            values[1][0] = __atomic_load_n(&m->http_pools->responses.hits, __ATOMIC_RELAXED);
+            values[1][1] = __atomic_load_n(&m->http_pools->responses.misses, __ATOMIC_RELAXED);
+            values[2][0] = __atomic_load_n(&m->http_pools->request.hits, __ATOMIC_RELAXED);
+            values[2][1] = __atomic_load_n(&m->http_pools->request.misses, __ATOMIC_RELAXED);
+        }
+        for (int p = 0; p < 3; p++) {
+            if (append_format(buf, "%s{worker=\"%d\",pool=\"%s\"} %lu\n", name, i, pool_names[p],
+                    values[p][misses]) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+int metrics_render(buffer **buf) {
+    if (append_per_worker(buf, "httpd_connections_accepted_total", "counter", "Accepted connections.",
+            offsetof(worker_metrics, accepted)) < 0) return -1;
+
+    if (append_header(buf, "httpd_connections_active", "gauge", "Open connections.") < 0) return -1;
+    for (int i = 0; i < workers_len; i++) {
+        uint64_t active = load(&workers[i].accepted);
+        for (int r = 0; r < CLOSE_REASONS; r++) {
+            active -= load(&workers[i].closed[r]);
+        }
+        if (append_format(buf, "httpd_connections_active{worker=\"%d\"} %lld\n", i, (long long)active) < 0) return -1;
+    }
+
+    if (append_header(buf, "httpd_connections_closed_total", "counter", "Closed connections by reason.") < 0) return -1;
+    for (int r = 0; r < CLOSE_REASONS; r++) {
+        uint64_t closed = 0;
+        for (int i = 0; i < workers_len; i++) {
+            closed += load(&workers[i].closed[r]);
+        }
+        if (append_format(buf, "httpd_connections_closed_total{reason=\"%s\"} %llu\n", close_reasons[r],
+                (unsigned long long)closed) < 0) return -1;
+    }
+
+    if (append_header(buf, "httpd_requests_total", "counter", "Responses by status code.") < 0) return -1;
+    for (int s = 0; s < METRICS_STATUSES; s++) {
+        uint64_t requests = 0;
+        for (int i = 0; i < workers_len; i++) {
+            requests += load(&workers[i].requests[s]);
+        }
+        if (s < METRICS_STATUSES - 1) {
+            if (append_format(buf, "httpd_requests_total{code=\"%d\"} %llu\n", tracked_statuses[s],
+                    (unsigned long long)requests) < 0) return -1;
+        } else if (append_format(buf, "httpd_requests_total{code=\"other\"} %llu\n",
+                (unsigned long long)requests) < 0) return -1;
+    }
+
+    if (append_per_worker(buf, "httpd_queued_response_bytes", "gauge", "Response bytes not written to sockets yet.",
+            offsetof(worker_metrics, load_queued_bytes)) < 0) return -1;
+    if (append_per_worker(buf, "httpd_dispatched_total", "counter", "Connections passed to worker by accept thread.",
+            offsetof(worker_metrics, dispatched)) < 0) return -1;
+    if (append_per_worker(buf, "httpd_dispatch_dropped_total", "counter", "Connections dropped as worker queue was full.",
+            offsetof(worker_metrics, dispatch_dropped)) < 0) return -1;
+
+    if (append_per_worker(buf, "httpd_request_parse_errors_total", "counter", "Malformed or too large requests.",
+            offsetof(worker_metrics, parse_errors)) < 0) return -1;
+    if (append_per_worker(buf, "httpd_response_bytes_total", "counter", "Response bytes written, headers included.",
+            offsetof(worker_metrics, bytes_sent)) < 0) return -1;
+    if (append_per_worker(buf, "httpd_access_log_dropped_total", "counter", "Access log records dropped on full ring.",
+            offsetof(worker_metrics, log_dropped)) < 0) return -1;
+    if (append_per_worker(buf, "httpd_io_offloaded_total", "counter", "Requests which waited for I/O pool.",
+            offsetof(worker_metrics, io_offloaded)) < 0) return -1;
+    if (append_histogram(buf, "httpd_time_to_first_byte_seconds", "Request start to the first response byte.",
+            offsetof(worker_metrics, ttfb)) < 0) return -1;
+    if (append_histogram(buf, "httpd_response_seconds", "Request start to the last response byte.",
+            offsetof(worker_metrics, total)) < 0) return -1;
+    if (append_histogram(buf, "httpd_loop_lag_seconds", "Delay of worker's periodic timer, time its loop was stalled.",
+            offsetof(worker_metrics, loop_lag)) < 0) return -1;
+
+    file_content_stats stats;
+    file_content_stats_get(&stats);
+    if (append_header(buf, "httpd_content_cache_hits_total", "counter", "Content cache hits.") < 0 ||
+        append_format(buf, "httpd_content_cache_hits_total %lu\n", stats.hits) < 0) return -1;
+    if (append_header(buf, "httpd_content_cache_misses_total", "counter", "Content cache misses.") < 0 ||
+        append_format(buf, "httpd_content_cache_misses_total %lu\n", stats.misses) < 0) return -1;
+    if (append_header(buf, "httpd_content_cache_evictions_total", "counter", "Content cache evictions.") < 0 ||
+        append_format(buf, "httpd_content_cache_evictions_total %lu\n", stats.evictions) < 0) return -1;
+    if (append_header(buf, "httpd_content_cache_bytes", "gauge", "Memory used by cached content.") < 0 ||
+        append_format(buf, "httpd_content_cache_bytes %zu\n", stats.bytes) < 0) return -1;
+    if (append_header(buf, "httpd_content_cache_objects", "gauge", "Files in content cache.") < 0 ||
+        append_format(buf, "httpd_content_cache_objects %zu\n", stats.objects) < 0) return -1;
+
+    if (append_pools(buf, "httpd_pool_hits_total", "Allocations served by worker pools.", 0) < 0) return -1;
+    return append_pools(buf, "httpd_pool_misses_total", "Allocations which went to malloc.", 1);
+}
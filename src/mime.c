@@ -0,0 +1,172 @@
+#include "mime.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIME_MAX_EXT_LEN 15
+#define MIME_MAX_LINE_LEN 1024
+#define MIME_INITIAL_SLOTS 256 // power of two
+
+// mime_slot is open addressing table slot, table is kept at most half full
+typedef struct mime_slot {
+    char ext[MIME_MAX_EXT_LEN + 1]; // lowercase, empty if slot is free
+    const char *type;
+} mime_slot;
+
+static mime_slot *slots;
+static size_t slots_mask;
+static size_t used;
+
+// types every server knows, mime.types file adds to them or overrides
+static const char *builtin_types[][2] = {
+    { "html", "text/html" }, { "htm", "text/html" }, { "css", "text/css" }, { "txt", "text/plain" },
+    { "xml", "text/xml" }, { "csv", "text/csv" }, { "md", "text/markdown" },
+    { "js", "application/javascript" }, { "mjs", "application/javascript" }, { "json", "application/json" },
+    { "map", "application/json" }, { "wasm", "application/wasm" }, { "pdf", "application/pdf" },
+    { "zip", "application/zip" }, { "gz", "application/gzip" }, { "tar", "application/x-tar" },
+    { "swf", "application/x-shockwave-flash" }, { "webmanifest", "application/manifest+json" },
+    { "jpg", "image/jpeg" }, { "jpeg", "image/jpeg" }, { "png", "image/png" }, { "gif", "image/gif" },
+    { "svg", "image/svg+xml" }, { "svgz", "image/svg+xml" }, { "ico", "image/x-icon" }, { "webp", "image/webp" },
+    { "avif", "image/avif" }, { "bmp", "image/bmp" }, { "tif", "image/tiff" }, { "tiff", "image/tiff" },
+    { "woff", "font/woff" }, { "woff2", "font/woff2" }, { "ttf", "font/ttf" }, { "otf", "font/otf" },
+    { "mp3", "audio/mpeg" }, { "ogg", "audio/ogg" }, { "wav", "audio/wav" }, { "m4a", "audio/mp4" },
+    { "mp4", "video/mp4" }, { "m4v", "video/mp4" }, { "webm", "video/webm" }, { "mov", "video/quicktime" },
+};
+
+// ext_hash is FNV-1a over lowercased extension, lowercase copy goes to lower.
+static uint32_t ext_hash(const char *ext, size_t len, char *lower) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        char c = ext[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        lower[i] = c;
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+    lower[len] = '\0';
+    return hash;
+}
+
+static mime_slot *find_slot(mime_slot *table, size_t mask, const char *lower, uint32_t hash) {
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        if (table[i].ext[0] == '\0' || strcmp(table[i].ext, lower) == 0) {
+            return &table[i];
+        }
+    }
+}
+
+static int grow_table() {
+    size_t size = slots == NULL ? MIME_INITIAL_SLOTS : (slots_mask + 1) * 2;
+    mime_slot *table = calloc(size, sizeof(mime_slot));
+    if (table == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; slots != NULL && i <= slots_mask; i++) {
+        if (slots[i].ext[0] != '\0') {
+            char lower[MIME_MAX_EXT_LEN + 1];
+            uint32_t hash = ext_hash(slots[i].ext, strlen(slots[i].ext), lower);
+            *find_slot(table, size - 1, lower, hash) = slots[i];
+        }
+    }
+    free(slots);
+    slots = table;
+    slots_mask = size - 1;
+    return 0;
+}
+
+// mime_add maps extension to type, type string must live forever.
+static int mime_add(const char *ext, size_t len, const char *type) {
+    if (len == 0 || len > MIME_MAX_EXT_LEN) {
+        return 0; // can't be looked up anyway
+    }
+    if (slots == NULL || (used + 1) * 2 > slots_mask + 1) {
+        if (grow_table() < 0) {
+            return -1;
+        }
+    }
+
+    char lower[MIME_MAX_EXT_LEN + 1];
+    uint32_t hash = ext_hash(ext, len, lower);
+    mime_slot *slot = find_slot(slots, slots_mask, lower, hash);
+    if (slot->ext[0] == '\0') {
+        memcpy(slot->ext, lower, len + 1);
+        used++;
+    }
+    slot->type = type;
+    return 0;
+}
+
+static int mime_load(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Mime types `%s` read error: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[MIME_MAX_LINE_LEN];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *save;
+        char *type = strtok_r(line, " \t\r\n;", &save);
+        if (type == NULL) {
+            continue;
+        }
+        char *ext = strtok_r(NULL, " \t\r\n;", &save);
+        if (ext == NULL) {
+            continue; // type without extensions
+        }
+        if ((type = strdup(type)) == NULL) {
+            fprintf(stderr, "Mime types `%s` allocate error: %s\n", path, strerror(errno));
+            fclose(file);
+            return -1;
+        }
+        for (; ext != NULL; ext = strtok_r(NULL, " \t\r\n;", &save)) {
+            if (mime_add(ext, strlen(ext), type) < 0) {
+                fprintf(stderr, "Mime types `%s` allocate error: %s\n", path, strerror(errno));
+                fclose(file);
+                return -1;
+            }
+        }
+    }
+
+    fclose(file);
+    return 0;
+}
+
+int mime_init(const char *path) {
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        if (mime_add(builtin_types[i][0], strlen(builtin_types[i][0]), builtin_types[i][1]) < 0) {
+            perror("Mime types init error");
+            return -1;
+        }
+    }
+    if (path != NULL) {
+        return mime_load(path);
+    }
+    return 0;
+}
+
+const char *mime_type_lookup(const char *ext, size_t len) {
+    if (slots == NULL || len == 0 || len > MIME_MAX_EXT_LEN) {
+        return NULL;
+    }
+    char lower[MIME_MAX_EXT_LEN + 1];
+    uint32_t hash = ext_hash(ext, len, lower);
+    return find_slot(slots, slots_mask, lower, hash)->type;
+}
+
+const char *mime_type_of_path(const char *path) {
+    const char *dot = strrchr(path, '.');
+    const char *type = NULL;
+    if (dot != NULL && strchr(dot, '/') == NULL) {
+        type = mime_type_lookup(dot + 1, strlen(dot + 1));
+    }
+    return type != NULL ? type : MIME_DEFAULT_TYPE;
+}
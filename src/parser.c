@@ -0,0 +1,273 @@
+#include "parser.h"
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+enum parser_state {
+    STATE_REQUEST_LINE = 0,
+    STATE_HEADER_LINE,
+    STATE_DONE,
+    STATE_ERROR,
+};
+
+typedef struct method_name {
+    const char *name;
+    size_t len;
+    http_method method;
+} method_name;
+
+static const method_name methods[] = {
+    { "GET", 3, HTTP_METHOD_GET },
+    { "HEAD", 4, HTTP_METHOD_HEAD },
+    { "POST", 4, HTTP_METHOD_POST },
+    { "PUT", 3, HTTP_METHOD_PUT },
+    { "DELETE", 6, HTTP_METHOD_DELETE },
+    { "OPTIONS", 7, HTTP_METHOD_OPTIONS },
+    { "TRACE", 5, HTTP_METHOD_TRACE },
+    { "CONNECT", 7, HTTP_METHOD_CONNECT },
+    { "PATCH", 5, HTTP_METHOD_PATCH },
+};
+
+void http_parser_init(http_parser *parser, size_t limit) {
+    memset(parser, 0, sizeof(http_parser));
+    parser->limit = limit;
+}
+
+const char *http_method_name(http_method method) {
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (methods[i].method == method) {
+            return methods[i].name;
+        }
+    }
+    return "-";
+}
+
+static http_method parse_method(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (methods[i].len == len && memcmp(methods[i].name, name, len) == 0) {
+            return methods[i].method;
+        }
+    }
+    return HTTP_METHOD_UNKNOWN;
+}
+
+// parse_request_line parses `METHOD SP request-target SP HTTP/x.y` in data[start, end).
+static int parse_request_line(http_request *request, const char *data, size_t start, size_t end) {
+    size_t i = start + scan.tchar(data + start, end - start);
+    if (i == start || i == end || data[i] != ' ') {
+        return -1;
+    }
+    request->method = parse_method(data + start, i - start);
+
+    // line has no control bytes already, so target ends at the next space
+    size_t target = ++i;
+    const char *sp = memchr(data + target, ' ', end - target);
+    if (sp == NULL || sp == data + target) {
+        return -1;
+    }
+    i = sp - data;
+    const char *q = memchr(data + target, '?', i - target);
+    size_t query = q != NULL ? (size_t)(q - data) : 0;
+    if (query != 0) {
+        request->path = (http_slice){ target, query - target };
+        request->query = (http_slice){ query + 1, i - query - 1 };
+    } else {
+        request->path = (http_slice){ target, i - target };
+    }
+
+    const char *version = data + i + 1;
+    if (end - i - 1 != 8 || memcmp(version, "HTTP/", 5) != 0 ||
+        version[5] < '0' || version[5] > '9' || version[6] != '.' || version[7] < '0' || version[7] > '9') {
+        return -1;
+    }
+    request->version_major = version[5] - '0';
+    request->version_minor = version[7] - '0';
+
+    return 0;
+}
+
+static int token_equal(const char *token, size_t len, const char *expected) {
+    return strlen(expected) == len && strncasecmp(token, expected, len) == 0;
+}
+
+// parse_connection finds close and keep-alive tokens in comma separated Connection value.
+static void parse_connection(http_request *request, const char *value, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) {
+            i++;
+        }
+        size_t start = i;
+        while (i < len && value[i] != ',' && value[i] != ' ' && value[i] != '\t') {
+            i++;
+        }
+        if (token_equal(value + start, i - start, "close")) {
+            request->connection_close = 1;
+        } else if (token_equal(value + start, i - start, "keep-alive")) {
+            request->connection_keep_alive = 1;
+        }
+    }
+}
+
+// parse_content_length parses Content-Length value, repeated header must have the same one.
+// Lists and anything but digits are rejected: body length must be certain, or the next request is misread.
+static int parse_content_length(http_request *request, const char *value, size_t len) {
+    if (len == 0) {
+        return -1;
+    }
+    size_t length = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (value[i] < '0' || value[i] > '9') {
+            return -1;
+        }
+        size_t digit = value[i] - '0';
+        if (length > (SIZE_MAX - digit) / 10) {
+            return -1;
+        }
+        length = length * 10 + digit;
+    }
+    if (request->has_content_length && request->content_length != length) {
+        return -1;
+    }
+    request->content_length = length;
+    request->has_content_length = 1;
+    return 0;
+}
+
+// parse_header_line parses `name: value` in data[start, end), remembering headers we need.
+static int parse_header_line(http_request *request, const char *data, size_t start, size_t end) {
+    size_t i = start + scan.tchar(data + start, end - start);
+    if (i == start || i == end || data[i] != ':') {
+        return -1; // also rejects obsolete line folding
+    }
+    const char *name = data + start;
+    size_t name_len = i - start;
+
+    i++;
+    while (i < end && (data[i] == ' ' || data[i] == '\t')) {
+        i++;
+    }
+    size_t value_end = end;
+    while (value_end > i && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t')) {
+        value_end--;
+    }
+    http_slice value = { i, value_end - i };
+
+    http_slice *slot = NULL;
+    switch (name_len) {
+        case 4:
+            slot = strncasecmp(name, "Host", 4) == 0 ? &request->host : NULL;
+            break;
+        case 5:
+            slot = strncasecmp(name, "Range", 5) == 0 ? &request->range : NULL;
+            break;
+        case 8:
+            slot = strncasecmp(name, "If-Range", 8) == 0 ? &request->if_range : NULL;
+            break;
+        case 10:
+            if (strncasecmp(name, "Connection", 10) == 0) {
+                slot = &request->connection;
+                parse_connection(request, data + value.off, value.len);
+            }
+            break;
+        case 13:
+            slot = strncasecmp(name, "If-None-Match", 13) == 0 ? &request->if_none_match : NULL;
+            break;
+        case 14:
+            if (strncasecmp(name, "Content-Length", 14) == 0 &&
+                    parse_content_length(request, data + value.off, value.len) < 0) {
+                return -1;
+            }
+            break;
+        case 15:
+            slot = strncasecmp(name, "Accept-Encoding", 15) == 0 ? &request->accept_encoding : NULL;
+            break;
+        case 17:
+            if (strncasecmp(name, "Transfer-Encoding", 17) == 0) {
+                request->transfer_encoding = 1;
+            } else if (strncasecmp(name, "If-Modified-Since", 17) == 0) {
+                slot = &request->if_modified_since;
+            }
+            break;
+    }
+    if (slot != NULL) {
+        *slot = value;
+    }
+
+    return 0;
+}
+
+// parse_again reports that request is incomplete, unless it has already used up the whole limit.
+static int parse_again(http_parser *parser, size_t len) {
+    if (parser->limit != 0 && len == parser->limit) {
+        parser->state = STATE_ERROR;
+        parser->request.malformed = 1;
+        parser->request.too_large = 1;
+        return HTTP_PARSE_ERROR;
+    }
+    return HTTP_PARSE_AGAIN;
+}
+
+int http_parser_execute(http_parser *parser, const char *data, size_t len) {
+    if (parser->limit != 0 && len > parser->limit) {
+        len = parser->limit; // bytes after the limit can't be a part of request we accept
+    }
+    while (parser->state == STATE_REQUEST_LINE || parser->state == STATE_HEADER_LINE) {
+        // the first control byte must be the line ending, any other one makes request malformed
+        size_t end = parser->pos + scan.ctl(data + parser->pos, len - parser->pos);
+        if (end == len) {
+            parser->pos = len; // don't rescan these bytes next time
+            return parse_again(parser, len);
+        }
+        if (data[end] == '\r') {
+            if (end + 1 == len) {
+                parser->pos = end;
+                return parse_again(parser, len);
+            }
+            if (data[end + 1] != '\n') {
+                parser->state = STATE_ERROR;
+                break;
+            }
+            parser->pos = end + 2;
+        } else if (data[end] == '\n') {
+            parser->pos = end + 1;
+        } else {
+            parser->state = STATE_ERROR;
+            break;
+        }
+
+        size_t start = parser->line_start;
+        parser->line_start = parser->pos;
+
+        if (parser->state == STATE_REQUEST_LINE) {
+            if (end == start) {
+                continue; // empty lines before request line are ignored
+            }
+            if (parse_request_line(&parser->request, data, start, end) < 0) {
+                parser->state = STATE_ERROR;
+                break;
+            }
+            parser->state = STATE_HEADER_LINE;
+            continue;
+        }
+
+        if (end == start) {
+            // both headers make body length ambiguous between us and proxies in front (RFC 9112 6.1)
+            parser->state = parser->request.has_content_length && parser->request.transfer_encoding ?
+                STATE_ERROR : STATE_DONE;
+            break;
+        }
+        if (parse_header_line(&parser->request, data, start, end) < 0) {
+            parser->state = STATE_ERROR;
+            break;
+        }
+    }
+
+    if (parser->state == STATE_ERROR) {
+        parser->request.malformed = 1;
+        return HTTP_PARSE_ERROR;
+    }
+    return HTTP_PARSE_DONE;
+}
@@ -0,0 +1,123 @@
+#include "pool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+} arena_chunk;
+
+//
+// object_pool
+//
+
+void object_pool_init(object_pool *pool, size_t obj_size, size_t max_free) {
+    assert(obj_size >= sizeof(void *));
+
+    pool->obj_size = obj_size;
+    pool->max_free = max_free;
+    pool->free_list = NULL;
+    pool->free_count = 0;
+    pool->hits = 0;
+    pool->misses = 0;
+}
+
+void object_pool_destroy(object_pool *pool) {
+    while (pool->free_list != NULL) {
+        void *obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+        free(obj);
+    }
+    pool->free_count = 0;
+}
+
+void *object_pool_get(object_pool *pool) {
+    void *obj = pool->free_list;
+    if (obj != NULL) {
+        pool->free_list = *(void **)obj;
+        pool->free_count--;
+        __atomic_store_n(&pool->hits, pool->hits + 1, __ATOMIC_RELAXED);
+        return obj;
+    }
+
+    __atomic_store_n(&pool->misses, pool->misses + 1, __ATOMIC_RELAXED);
+    return malloc(pool->obj_size);
+}
+
+void object_pool_put(object_pool *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    if (pool->free_count >= pool->max_free) {
+        free(obj);
+        return;
+    }
+
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->free_count++;
+}
+
+//
+// arena
+//
+
+void arena_init(arena *arena, size_t chunk_size) {
+    arena->chunks = NULL;
+    arena->chunk_size = chunk_size;
+    arena->hits = 0;
+    arena->misses = 0;
+}
+
+void arena_destroy(arena *arena) {
+    while (arena->chunks != NULL) {
+        arena_chunk *chunk = arena->chunks;
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+}
+
+void *arena_alloc(arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_chunk *chunk = arena->chunks;
+    if (chunk != NULL && chunk->size - chunk->used >= size) {
+        __atomic_store_n(&arena->hits, arena->hits + 1, __ATOMIC_RELAXED);
+        void *p = chunk->data + chunk->used;
+        chunk->used += size;
+        return p;
+    }
+
+    __atomic_store_n(&arena->misses, arena->misses + 1, __ATOMIC_RELAXED);
+    size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+    if ((chunk = malloc(sizeof(arena_chunk) + chunk_size)) == NULL) {
+        return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->used = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+
+    return chunk->data;
+}
+
+void arena_reset(arena *arena) {
+    arena_chunk *chunk = arena->chunks;
+    if (chunk == NULL) {
+        return;
+    }
+    // the oldest chunk is the last one, extra chunks were needed only by unusually big requests
+    while (chunk->next != NULL) {
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    chunk->used = 0;
+    arena->chunks = chunk;
+}
@@ -0,0 +1,312 @@
+#include "scan.h"
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static const char *level_names[] = { "scalar", "sse4.2", "avx2" };
+
+// token characters (RFC 7230) as a two-level bitmap: byte c is a token if
+// tchar_lo_table[c & 0xf] has bit (c >> 4) set, hi table maps high nibble to that bit,
+// so pshufb lookup of both nibbles classifies 16 or 32 bytes at once. Non-ASCII maps to 0.
+static const uint8_t tchar_lo_table[16] __attribute__((aligned(16))) = {
+    0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70,
+};
+static const uint8_t tchar_hi_table[16] __attribute__((aligned(16))) = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+//
+// scalar
+//
+
+static size_t ctl_scalar(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        if ((c < 0x20 && c != '\t') || c == 0x7f) {
+            return i;
+        }
+    }
+    return len;
+}
+
+static size_t tchar_scalar(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        if (!(tchar_lo_table[c & 0x0f] & tchar_hi_table[c >> 4])) {
+            return i;
+        }
+    }
+    return len;
+}
+
+static size_t escape_scalar(const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '%' || data[i] == '+') {
+            return i;
+        }
+    }
+    return len;
+}
+
+static size_t dot_segment_scalar(const char *data, size_t len) {
+    for (size_t i = 0; i + 1 < len; i++) {
+        if (data[i] == '/' && (data[i + 1] == '/' || data[i + 1] == '.')) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#ifdef SCAN_X86
+
+// Vector functions check the last partial block with one more load ending at len: bytes it
+// shares with the previous block have no match already, so first match in it is the answer.
+// Inputs shorter than one block go to the narrower implementation.
+
+//
+// SSE4.2
+//
+
+#define SSE42 __attribute__((target("sse4.2")))
+
+SSE42 static int ctl_block_sse42(const char *p) {
+    static const char ranges[16] __attribute__((aligned(16))) = "\x00\x08\x0a\x1f\x7f\x7f";
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return _mm_cmpestri(_mm_load_si128((const __m128i *)ranges), 6, v, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+}
+
+SSE42 static size_t ctl_sse42(const char *data, size_t len) {
+    if (len < 16) {
+        return ctl_scalar(data, len);
+    }
+    size_t i = 0;
+    for (;; i += 16) {
+        if (i + 16 > len) {
+            i = len - 16;
+        }
+        int idx = ctl_block_sse42(data + i);
+        if (idx < 16) {
+            return i + idx;
+        }
+        if (i + 16 == len) {
+            return len;
+        }
+    }
+}
+
+SSE42 static int tchar_block_sse42(const char *p) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i lo = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)tchar_lo_table), _mm_and_si128(v, nibble));
+    __m128i hi = _mm_shuffle_epi8(_mm_load_si128((const __m128i *)tchar_hi_table),
+        _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+    return mask != 0 ? __builtin_ctz(mask) : 16;
+}
+
+SSE42 static size_t tchar_sse42(const char *data, size_t len) {
+    if (len < 16) {
+        return tchar_scalar(data, len);
+    }
+    size_t i = 0;
+    for (;; i += 16) {
+        if (i + 16 > len) {
+            i = len - 16;
+        }
+        int idx = tchar_block_sse42(data + i);
+        if (idx < 16) {
+            return i + idx;
+        }
+        if (i + 16 == len) {
+            return len;
+        }
+    }
+}
+
+SSE42 static int escape_block_sse42(const char *p) {
+    const __m128i set = _mm_setr_epi8('%', '+', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return _mm_cmpestri(set, 2, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+}
+
+SSE42 static size_t escape_sse42(const char *data, size_t len) {
+    if (len < 16) {
+        return escape_scalar(data, len);
+    }
+    size_t i = 0;
+    for (;; i += 16) {
+        if (i + 16 > len) {
+            i = len - 16;
+        }
+        int idx = escape_block_sse42(data + i);
+        if (idx < 16) {
+            return i + idx;
+        }
+        if (i + 16 == len) {
+            return len;
+        }
+    }
+}
+
+// dot_segment blocks compare 16 bytes with the same bytes shifted by one, so they need 17 bytes.
+SSE42 static int dot_segment_block_sse42(const char *p) {
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dot = _mm_set1_epi8('.');
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i next = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi8(v, slash),
+        _mm_or_si128(_mm_cmpeq_epi8(next, slash), _mm_cmpeq_epi8(next, dot)));
+    int mask = _mm_movemask_epi8(m);
+    return mask != 0 ? __builtin_ctz(mask) : 16;
+}
+
+SSE42 static size_t dot_segment_sse42(const char *data, size_t len) {
+    if (len < 17) {
+        return dot_segment_scalar(data, len);
+    }
+    size_t i = 0;
+    for (;; i += 16) {
+        if (i + 17 > len) {
+            i = len - 17;
+        }
+        int idx = dot_segment_block_sse42(data + i);
+        if (idx < 16) {
+            return i + idx;
+        }
+        if (i + 17 == len) {
+            return len;
+        }
+    }
+}
+
+//
+// AVX2
+//
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static unsigned ctl_mask_avx2(const char *p) {
+    const __m256i max_ctl = _mm256_set1_epi8(0x1f);
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, max_ctl), v); // v <= 0x1f
+    ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), ctl);
+    ctl = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+    return _mm256_movemask_epi8(ctl);
+}
+
+AVX2 static unsigned tchar_mask_avx2(const char *p) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tchar_lo_table));
+    const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)tchar_hi_table));
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+    __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()));
+}
+
+AVX2 static unsigned escape_mask_avx2(const char *p) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('+'))));
+}
+
+AVX2 static unsigned dot_segment_mask_avx2(const char *p) {
+    const __m256i slash = _mm256_set1_epi8('/');
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i next = _mm256_loadu_si256((const __m256i *)(p + 1));
+    return _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v, slash),
+        _mm256_or_si256(_mm256_cmpeq_epi8(next, slash), _mm256_cmpeq_epi8(next, _mm256_set1_epi8('.')))));
+}
+
+// scan_avx2 runs mask function over 32 byte blocks, block_len is 32 plus bytes block looks ahead.
+AVX2 static inline size_t scan_avx2(const char *data, size_t len, size_t block_len,
+        unsigned (*block_mask)(const char *), size_t (*narrow)(const char *, size_t)) {
+    if (len < block_len) {
+        return narrow(data, len);
+    }
+    size_t i = 0;
+    for (;; i += 32) {
+        if (i + block_len > len) {
+            i = len - block_len;
+        }
+        unsigned mask = block_mask(data + i);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+        if (i + block_len == len) {
+            return len;
+        }
+    }
+}
+
+AVX2 static size_t ctl_avx2(const char *data, size_t len) {
+    return scan_avx2(data, len, 32, ctl_mask_avx2, ctl_sse42);
+}
+
+AVX2 static size_t tchar_avx2(const char *data, size_t len) {
+    return scan_avx2(data, len, 32, tchar_mask_avx2, tchar_sse42);
+}
+
+AVX2 static size_t escape_avx2(const char *data, size_t len) {
+    return scan_avx2(data, len, 32, escape_mask_avx2, escape_sse42);
+}
+
+AVX2 static size_t dot_segment_avx2(const char *data, size_t len) {
+    return scan_avx2(data, len, 33, dot_segment_mask_avx2, dot_segment_sse42);
+}
+
+#endif // SCAN_X86
+
+scan_impl scan = { ctl_scalar, tchar_scalar, escape_scalar, dot_segment_scalar };
+
+static int level_supported(int level) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    switch (level) {
+        case SCAN_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case SCAN_SSE42:
+            return __builtin_cpu_supports("sse4.2");
+    }
+#endif
+    return level == SCAN_SCALAR;
+}
+
+int scan_init_level(int level) {
+    if (!level_supported(level)) {
+        return -1;
+    }
+    switch (level) {
+#ifdef SCAN_X86
+        case SCAN_AVX2:
+            scan = (scan_impl){ ctl_avx2, tchar_avx2, escape_avx2, dot_segment_avx2 };
+            break;
+        case SCAN_SSE42:
+            scan = (scan_impl){ ctl_sse42, tchar_sse42, escape_sse42, dot_segment_sse42 };
+            break;
+#endif
+        default:
+            scan = (scan_impl){ ctl_scalar, tchar_scalar, escape_scalar, dot_segment_scalar };
+    }
+    return 0;
+}
+
+// scan_init picks the widest implementation CPU supports and returns its level.
+int scan_init() {
+    for (int level = SCAN_AVX2; level > SCAN_SCALAR; level--) {
+        if (scan_init_level(level) == 0) {
+            return level;
+        }
+    }
+    scan_init_level(SCAN_SCALAR);
+    return SCAN_SCALAR;
+}
+
+const char *scan_level_name(int level) {
+    return level >= SCAN_SCALAR && level <= SCAN_AVX2 ? level_names[level] : "unknown";
+}
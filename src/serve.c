@@ -1,34 +1,104 @@
 #include "serve.h"
 
+#include "accesslog.h"
 #include "buffer.h"
+#include "file.h"
 #include "http.h"
+#include "iopool.h"
+#include "metrics.h"
+#include "mime.h"
+#include "pool.h"
+#include "scan.h"
+#include "uring.h"
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/event.h>
 #include <event2/event-config.h>
-#include <event2/thread.h>
+#include <event2/listener.h>
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_QUEUE_LEN 65535
 #define CLIENT_IO_TIMEOUT 60 // 1 minute
+#define DRAIN_IDLE_TIMEOUT 1 // draining worker closes connections which wait for the next request that long
+#define DRAIN_SIGNAL_INTERVAL_NS 100000000 // 100 ms, how often draining main thread checks for signals
+#define MAX_FREE_CLIENTS 4096 // per worker
+#define HANDOFF_RING_LEN 1024 // accepted clients waiting for worker, power of two
+#define DISPATCH_BYTES_PER_CONN (1024 * 1024) // queued response bytes which weigh as one more connection
+#define MAX_NUMA_NODES 64
+#define LISTEN_FDS_ENV "HTTPD_LISTEN_FDS" // listening sockets passed to new process on upgrade: 3,4,5
+#define READY_FD_ENV "HTTPD_READY_FD" // pipe new process writes to once it accepts connections
 
-#define CHUNK_SIZE 4096
-#define MAX_REQUEST_BODY_SIZE 4096 // 4 kb
+// dispatcher is state of accept thread which picks worker for every client
+typedef struct dispatcher {
+    int next; // round-robin, or where least-conn starts so ties go to different workers
+    uint64_t random; // xorshift state for p2c
+} dispatcher;
+
+// client_handoff passes accepted client from accept thread to worker
+typedef struct client_handoff {
+    int clientfd;
+    struct sockaddr_in address;
+} client_handoff;
+
+// handoff_ring is single-producer single-consumer queue from accept thread to worker
+typedef struct handoff_ring {
+    size_t tail __attribute__((aligned(64))); // written by accept thread
+    size_t head __attribute__((aligned(64))); // written by worker
+    client_handoff clients[HANDOFF_RING_LEN] __attribute__((aligned(64)));
+} handoff_ring;
 
 typedef struct worker {
     pthread_t worker_thread;
     struct event_base *worker_ev_base;
+    struct evconnlistener *listener; // reuseport mode only
+    handoff_ring *handoff; // accept thread mode only
+    int handoff_fd; // eventfd which wakes worker up when handoff ring becomes non-empty
+    struct event *handoff_event;
+    int listen_fd; // worker's own socket in reuseport mode, the shared one with io_uring backend
+    int listen_fd_owned; // surplus sockets of io_uring backend go with it
+    int *surplus_fds; // inherited sockets beyond one per worker, accepted from too and passed on upgrade
+    int surplus_fds_len;
+    struct evconnlistener **surplus_listeners; // of libevent backend
+    struct event *date_timer;
+    struct event *lag_timer; // one-shot, re-armed on every run, see metrics_loop_lag()
+    uint64_t lag_armed;
+    int cpu; // worker thread is pinned to, -1 if it isn't
+    io_pool *io_pool; // of worker's NUMA node, NULL if file system is used right in the loop
+    io_completions io_done;
+    struct event *io_event;
+
+    const serve_config *cfg;
+    worker_metrics *metrics;
+    access_log_ring *access_log; // NULL if access log is off
+    int stop; // set by main thread: 1 drains worker, 2 closes all its connections
+
+    // used only from worker thread
+    object_pool clients;
+    http_pools http_pools;
+    struct client_ctx *client_list; // open connections, for draining
+    int draining; // stop level worker has acted on
 } worker;
 
 typedef struct server {
@@ -37,198 +107,1267 @@ typedef struct server {
 
     serve_config *cfg;
     worker *workers;
+    int *cpus; // workers are pinned to, round-robin; NULL if they aren't
+    int *cpu_nodes; // NUMA node of every CPU of cpus
+    int cpus_len;
+    io_pool **io_pools; // by NUMA node, NULL where no worker runs
+    int io_pools_len;
+
+    const char *cfg_path; // re-read by the new process on SIGHUP
+    char *const *argv; // new process is started with
+    char exe[PATH_MAX]; // binary started on SIGUSR2, resolved at start as it may be replaced on disk
+    int signal_fd;
+    int *inherited; // listening sockets from the old process, -1 once taken by a worker
+    int inherited_len;
+    int ready_fd; // old process waits for a byte in it, -1 if this one wasn't started for upgrade
+    int upgrade_fd; // readiness pipe of the new process while it starts, -1 otherwise
+    pid_t upgrade_pid;
 } server;
 
 typedef struct client_ctx {
     struct sockaddr_in address;
-    char *cfg_static_root;
+    worker *worker;
+    struct client_ctx *prev;
+    struct client_ctx *next;
+    struct bufferevent *bev;
+    const char *cfg_static_root;
+    size_t max_header_size;
 
-    buffer *read_buf;
+    http_parser parser; // state of request at the beginning of bufferevent input
+    uint64_t request_start; // when the first bytes of current request were seen, 0 between requests
 
-    http_response *response;
-    size_t wrote_bytes_to_socket;
+    io_job *io_job; // request waits for I/O pool, it's handled again when the job is done
+    http_response *response; // in flight, NULL while waiting for request
+    size_t queued; // bytes of response counted in worker's load
+    access_log_record log_record; // of the response in flight
+    int log_pending; // log_record is to be written
+    time_t idle_since; // when the last response was written, 0 before the first one
+    size_t body_left; // bytes of request body still to be dropped from input before the next request
+    int linger; // request body is left unread, connection is closed with lingering after the response
+    time_t linger_until; // lingering has started, client's data is dropped until then
+    size_t linger_left; // bytes to drop before giving up on lingering
 } client_ctx;
 
-static int server_accept(const server *server);
-static int init_worker_pool(worker *pool, int size);
+static int server_listen(server *server);
+static int server_inherit(server *server);
+static int server_inherited_socket(server *server, int reuseport);
+static void server_ready(server *server);
+static int server_cpus(server *server, const cpu_set_t *allowed);
+static int server_io_pools(server *server);
+static void free_io_pools(server *server);
+static void server_serve(server *server);
+static int server_drain(server *server);
+static int init_worker_pool(server *server, worker *pool, int size);
+static void free_worker_pool(worker *pool, int size);
+static void free_server(server *server);
 
-int listen_and_serve_http(const serve_config *cfg) {
+int listen_and_serve_http(const serve_config *cfg, const char *cfg_path, char *const argv[]) {
     assert(cfg != NULL);
     assert(cfg->static_root != NULL);
 
-    evthread_use_pthreads();
+    // main thread takes these signals from signalfd, threads started from here on inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (mime_init(cfg->mime_types) < 0) {
+        return SERVE_CONFIG_ERROR;
+    }
+    if (cfg->io_uring && uring_probe() < 0) {
+        fprintf(stderr, "io_uring backend isn't supported by kernel: %s\n", strerror(errno));
+        return SERVE_CONFIG_ERROR;
+    }
+    signal(SIGPIPE, SIG_IGN); // writes to reset connections fail with EPIPE instead
+
+    server server = {
+        .sockfd = -1,
+        .cfg_path = cfg_path,
+        .argv = argv,
+        .signal_fd = -1,
+        .ready_fd = -1,
+        .upgrade_fd = -1,
+    };
+    if (server_inherit(&server) < 0) {
+        free_server(&server);
+        return SERVE_MEMORY_ERROR;
+    }
+    if ((server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        perror("Signalfd error");
+        free_server(&server);
+        return SERVE_SYSCONF_ERROR;
+    }
+    ssize_t exe_len = readlink("/proc/self/exe", server.exe, sizeof(server.exe) - 1);
+    if (exe_len < 0) {
+        perror("Cannot resolve executable path");
+        free_server(&server);
+        return SERVE_SYSCONF_ERROR;
+    }
+    server.exe[exe_len] = '\0';
 
-    server server;
     if ((server.cfg = malloc(sizeof(serve_config))) == NULL) {
         perror("Malloc error");
+        free_server(&server);
         return SERVE_MEMORY_ERROR;
     }
     memcpy(server.cfg, cfg, sizeof(serve_config));
     if ((server.cfg->static_root = strdup(cfg->static_root)) == NULL) {
         perror("Strdup cfg->static_root error");
-        free(server.cfg);
+        free_server(&server);
         return SERVE_MEMORY_ERROR;
     }
 
-    if ((server.sockfd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-        perror("Socket error");
-        free(server.cfg->static_root);
-        free(server.cfg);
-        return SERVE_SOCKET_ERROR;
-    }
-
     server.name = (struct sockaddr_in){
         .sin_family = AF_INET,
         .sin_port = htons(server.cfg->port),
         .sin_addr.s_addr = htonl(server.cfg->addr),
     };
-    if (bind(server.sockfd, (struct sockaddr *)&server.name, sizeof(struct sockaddr_in)) < 0) {
-        perror("Bind error");
-        free(server.cfg->static_root);
-        free(server.cfg);
-        return SERVE_BIND_ERROR;
-    }
+    file_cache_init(server.cfg->static_root);
+    file_content_cache_init(server.cfg->cache_size, server.cfg->cache_max_object);
+    printf("Request scanning: %s\n", scan_level_name(scan_init()));
 
-    if (listen(server.sockfd, MAX_QUEUE_LEN) < 0) {
-        perror("Listen error");
-        free(server.cfg->static_root);
-        free(server.cfg);
-        return SERVE_LISTEN_ERROR;
+    if (!server.cfg->reuseport) {
+        int r = server_listen(&server);
+        if (r != 0) {
+            free_server(&server);
+            return r;
+        }
     }
 
+    // cpuset of container or taskset, not all CPUs of the machine
+    cpu_set_t allowed_cpus;
+    if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) < 0) {
+        perror("Cannot get allowed CPUs");
+        free_server(&server);
+        return SERVE_SYSCONF_ERROR;
+    }
     if (server.cfg->worker_num <= 0) {
-        if ((server.cfg->worker_num = sysconf(_SC_NPROCESSORS_ONLN)) < 0) {
-            perror("Cannot get number of CPU");
-            free(server.cfg->static_root);
-            free(server.cfg);
-            return SERVE_SYSCONF_ERROR;
-        }
+        server.cfg->worker_num = CPU_COUNT(&allowed_cpus);
+    }
+    int r;
+    if ((r = server_cpus(&server, &allowed_cpus)) != 0) {
+        free_server(&server);
+        return r;
     }
 
+    if (metrics_init(server.cfg->worker_num) < 0) {
+        free_server(&server);
+        return SERVE_MEMORY_ERROR;
+    }
+    if (access_log_init(server.cfg->access_log, server.cfg->access_log_sample, server.cfg->worker_num) < 0) {
+        free_server(&server);
+        return SERVE_CONFIG_ERROR;
+    }
     if ((server.workers = calloc(server.cfg->worker_num, sizeof(worker))) == NULL) {
         perror("Malloc error");
-        free(server.cfg->static_root);
-        free(server.cfg);
+        access_log_stop();
+        free_server(&server);
         return SERVE_MEMORY_ERROR;
     }
-    int r;
-    if ((r = init_worker_pool(server.workers, server.cfg->worker_num)) != 0) {
-        free(server.workers);
-        free(server.cfg->static_root);
-        free(server.cfg);
+    if ((r = server_io_pools(&server)) != 0) {
+        access_log_stop();
+        free_server(&server);
+        return r;
+    }
+    if ((r = init_worker_pool(&server, server.workers, server.cfg->worker_num)) != 0) {
+        free_io_pools(&server);
+        access_log_stop();
+        free_server(&server);
         return r;
     }
     printf("Initialized %d workers\n", server.cfg->worker_num);
 
-    r = server_accept(&server);
+    if (server.cfg->reuseport || server.cfg->io_uring) {
+        printf("Accepting connections at %s:%hu in every worker (%s%s)\n",
+            inet_ntoa(server.name.sin_addr),
+            ntohs(server.name.sin_port),
+            server.cfg->io_uring ? "io_uring" : "libevent",
+            server.cfg->reuseport ? ", SO_REUSEPORT" : "");
+    } else {
+        printf("Accepting connections at %s:%hu\n",
+            inet_ntoa(server.name.sin_addr),
+            ntohs(server.name.sin_port));
+    }
+    server_ready(&server);
+    server_serve(&server);
+    r = server_drain(&server);
 
+    file_content_stats stats;
+    file_content_stats_get(&stats);
+    printf("Content cache: %lu hits, %lu misses, %lu evictions, %zu bytes in %zu files\n",
+        stats.hits, stats.misses, stats.evictions, stats.bytes, stats.objects);
     for (int i = 0; i < server.cfg->worker_num; i++) {
-        event_base_free(server.workers[i].worker_ev_base);
+        const worker *w = &server.workers[i];
+        printf("Worker %d pools (hits/misses): clients %lu/%lu, responses %lu/%lu, request arena %lu/%lu\n", i,
+            w->clients.hits, w->clients.misses,
+            w->http_pools.responses.hits, w->http_pools.responses.misses,
+            w->http_pools.request.hits, w->http_pools.request.misses);
     }
-    free(server.workers);
-    free(server.cfg->static_root);
-    free(server.cfg);
-    close(server.sockfd);
+
+    access_log_stop();
+    free_io_pools(&server); // done jobs are pushed to workers, so they go after it
+    free_worker_pool(server.workers, server.cfg->worker_num);
+    free_server(&server);
     printf("Server stopped\n");
     return r;
 }
 
+// free_server releases what listen_and_serve_http() has set up so far, apart from threads.
+static void free_server(server *server) {
+    if (server->sockfd >= 0) {
+        close(server->sockfd);
+    }
+    for (int i = 0; i < server->inherited_len; i++) {
+        if (server->inherited[i] >= 0) {
+            close(server->inherited[i]);
+        }
+    }
+    free(server->inherited);
+    if (server->ready_fd >= 0) {
+        close(server->ready_fd); // old process sees EOF and keeps serving
+    }
+    if (server->upgrade_fd >= 0) {
+        close(server->upgrade_fd);
+    }
+    if (server->signal_fd >= 0) {
+        close(server->signal_fd);
+    }
+    free(server->workers);
+    free(server->cpus);
+    free(server->cpu_nodes);
+    if (server->cfg != NULL) {
+        free(server->cfg->static_root);
+        free(server->cfg);
+    }
+}
+
+static int server_listen(server *server) {
+    // accept thread takes clients until EAGAIN, so the socket is nonblocking
+    if ((server->sockfd = server_inherited_socket(server, 0)) >= 0) {
+        if (fcntl(server->sockfd, F_SETFL, fcntl(server->sockfd, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("Fcntl error");
+            return SERVE_SOCKET_ERROR;
+        }
+        return 0;
+    }
+    if ((server->sockfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0) {
+        perror("Socket error");
+        return SERVE_SOCKET_ERROR;
+    }
+
+    if (bind(server->sockfd, (struct sockaddr *)&server->name, sizeof(struct sockaddr_in)) < 0) {
+        perror("Bind error");
+        close(server->sockfd);
+        server->sockfd = -1;
+        return SERVE_BIND_ERROR;
+    }
+
+    if (listen(server->sockfd, MAX_QUEUE_LEN) < 0) {
+        perror("Listen error");
+        close(server->sockfd);
+        server->sockfd = -1;
+        return SERVE_LISTEN_ERROR;
+    }
+
+    return 0;
+}
+
+// cpu_node returns NUMA node of cpu as sysfs shows it, 0 if it's unknown.
+static int cpu_node(int cpu) {
+    char path[64];
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+    return 0;
+}
+
+// server_cpus resolves CPUs which workers are pinned to: all allowed ones for auto,
+// configured ones must be allowed too.
+static int server_cpus(server *server, const cpu_set_t *allowed) {
+    const serve_config *cfg = server->cfg;
+    server->cpus = NULL;
+    server->cpu_nodes = NULL;
+    server->cpus_len = 0;
+    if (cfg->cpu_affinity == CPU_AFFINITY_OFF) {
+        return 0;
+    }
+
+    int len = cfg->cpu_affinity == CPU_AFFINITY_AUTO ? CPU_COUNT(allowed) : cfg->cpus_len;
+    if ((server->cpus = malloc(len * sizeof(int))) == NULL ||
+            (server->cpu_nodes = malloc(len * sizeof(int))) == NULL) {
+        perror("Malloc error");
+        free(server->cpus);
+        server->cpus = NULL;
+        return SERVE_MEMORY_ERROR;
+    }
+    if (cfg->cpu_affinity == CPU_AFFINITY_AUTO) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && server->cpus_len < len; cpu++) {
+            if (CPU_ISSET(cpu, allowed)) {
+                server->cpus[server->cpus_len++] = cpu;
+            }
+        }
+    } else {
+        for (int i = 0; i < len; i++) {
+            int cpu = cfg->cpus[i];
+            if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, allowed)) {
+                fprintf(stderr, "CPU %d of cpu_affinity isn't allowed to the process\n", cpu);
+                free(server->cpus);
+                free(server->cpu_nodes);
+                server->cpus = NULL;
+                server->cpu_nodes = NULL;
+                server->cpus_len = 0;
+                return SERVE_CONFIG_ERROR;
+            }
+            server->cpus[server->cpus_len++] = cpu;
+        }
+    }
+    // sysfs is looked up once, workers and I/O pools are placed by the table
+    for (int i = 0; i < server->cpus_len; i++) {
+        server->cpu_nodes[i] = cpu_node(server->cpus[i]);
+    }
+
+    printf("Pinning workers to CPUs:");
+    for (int i = 0; i < server->cpus_len; i++) {
+        printf(" %d", server->cpus[i]);
+    }
+    printf("\n");
+    return 0;
+}
+
+// worker_node returns NUMA node of i-th worker, unpinned workers count as node 0.
+static int worker_node(const server *server, int i) {
+    return server->cpus_len > 0 ? server->cpu_nodes[i % server->cpus_len] : 0;
+}
+
+// server_io_pools starts I/O pool on every NUMA node which has workers, pinned workers share
+// their CPUs with it: pool threads mostly sleep in disk reads.
+static int server_io_pools(server *server) {
+    const serve_config *cfg = server->cfg;
+    server->io_pools = NULL;
+    server->io_pools_len = 0;
+    if (cfg->io_threads == 0) {
+        return 0;
+    }
+
+    int nodes = 1;
+    for (int i = 0; i < cfg->worker_num; i++) {
+        if (worker_node(server, i) >= nodes) {
+            nodes = worker_node(server, i) + 1;
+        }
+    }
+    if ((server->io_pools = calloc(nodes, sizeof(io_pool *))) == NULL) {
+        perror("Malloc error");
+        return SERVE_MEMORY_ERROR;
+    }
+    server->io_pools_len = nodes;
+    for (int node = 0; node < nodes; node++) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        int workers = 0;
+        for (int i = 0; i < cfg->worker_num; i++) {
+            if (worker_node(server, i) == node) {
+                workers++;
+                if (server->cpus_len > 0) {
+                    CPU_SET(server->cpus[i % server->cpus_len], &cpus);
+                }
+            }
+        }
+        if (workers == 0) {
+            continue;
+        }
+        if ((server->io_pools[node] = io_pool_new(cfg->io_threads, server->cpus_len > 0 ? &cpus : NULL)) == NULL) {
+            free_io_pools(server);
+            return SERVE_PTHREAD_ERROR;
+        }
+    }
+    printf("Offloading file system calls to %d I/O threads per node\n", cfg->io_threads);
+    return 0;
+}
+
+static void free_io_pools(server *server) {
+    for (int node = 0; node < server->io_pools_len; node++) {
+        io_pool_free(server->io_pools[node]);
+    }
+    free(server->io_pools);
+    server->io_pools = NULL;
+    server->io_pools_len = 0;
+}
+
+// listen_reuseport opens worker's own listening socket, used by io_uring backend.
+static int listen_reuseport(const struct sockaddr_in *name) {
+    int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+        perror("Socket error");
+        return -1;
+    }
+    int on = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("Setsockopt error");
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (const struct sockaddr *)name, sizeof(struct sockaddr_in)) < 0) {
+        perror("Bind error");
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, MAX_QUEUE_LEN) < 0) {
+        perror("Listen error");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//
+// upgrade
+//
+
+// parse_fd parses descriptor number at s, end is set past it. Returns -1 if there is no valid number.
+static int parse_fd(const char *s, char **end) {
+    errno = 0;
+    long fd = strtol(s, end, 10);
+    if (*end == s || errno != 0 || fd < 0 || fd > INT_MAX) {
+        return -1;
+    }
+    return (int)fd;
+}
+
+// inherited_listener tells if fd is a listening TCP socket, anything else isn't taken over.
+static int inherited_listener(int fd) {
+    struct stat st;
+    int value = 0;
+    socklen_t value_len = sizeof(value);
+    if (fstat(fd, &st) < 0 || !S_ISSOCK(st.st_mode) ||
+            getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &value_len) < 0 || !value) {
+        return 0;
+    }
+    value_len = sizeof(value);
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &value_len) == 0 && value == SOCK_STREAM;
+}
+
+// server_inherit takes listening sockets and readiness pipe passed by the process which started this one,
+// environment is cleaned up so they don't go further. Descriptors which aren't what they are said to be
+// are left alone: workers bind new sockets then. Called before any thread starts.
+static int server_inherit(server *server) {
+    const char *ready = getenv(READY_FD_ENV);
+    if (ready != NULL) {
+        char *end;
+        int fd = parse_fd(ready, &end);
+        struct stat st;
+        if (fd < 0 || *end != '\0' || fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+            fprintf(stderr, "%s=%s isn't a pipe, ignoring it\n", READY_FD_ENV, ready);
+        } else {
+            server->ready_fd = fd;
+            fcntl(server->ready_fd, F_SETFD, FD_CLOEXEC);
+        }
+        unsetenv(READY_FD_ENV);
+    }
+    const char *fds = getenv(LISTEN_FDS_ENV);
+    if (fds == NULL) {
+        return 0;
+    }
+    int len = 1;
+    for (const char *p = fds; *p != '\0'; p++) {
+        len += *p == ',';
+    }
+    if ((server->inherited = malloc(len * sizeof(int))) == NULL) {
+        perror("Malloc error");
+        return -1;
+    }
+    const char *p = fds;
+    while (server->inherited_len < len) {
+        char *end;
+        int fd = parse_fd(p, &end);
+        if (fd < 0 || (*end != ',' && *end != '\0')) {
+            fprintf(stderr, "%s=%s is malformed, ignoring the rest of it\n", LISTEN_FDS_ENV, fds);
+            break;
+        }
+        if (inherited_listener(fd)) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            server->inherited[server->inherited_len++] = fd;
+        } else {
+            fprintf(stderr, "Inherited descriptor %d isn't a listening socket, ignoring it\n", fd);
+        }
+        if (*end == '\0') {
+            break;
+        }
+        p = end + 1;
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    printf("Inherited %d listening sockets\n", server->inherited_len);
+    return 0;
+}
+
+// server_inherited_socket takes inherited listening socket bound to server's address, SO_REUSEPORT one
+// if reuseport is set. Returns -1 if there is no such socket, then worker binds a new one.
+static int server_inherited_socket(server *server, int reuseport) {
+    for (int i = 0; i < server->inherited_len; i++) {
+        int fd = server->inherited[i];
+        struct sockaddr_in name;
+        socklen_t name_len = sizeof(name);
+        int on = 0;
+        socklen_t on_len = sizeof(on);
+        if (fd < 0 ||
+                getsockname(fd, (struct sockaddr *)&name, &name_len) < 0 ||
+                name_len != sizeof(name) ||
+                name.sin_family != AF_INET ||
+                name.sin_port != server->name.sin_port ||
+                name.sin_addr.s_addr != server->name.sin_addr.s_addr ||
+                getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, &on_len) < 0 ||
+                (on != 0) != (reuseport != 0)) {
+            continue;
+        }
+        server->inherited[i] = -1;
+        return fd;
+    }
+    return -1;
+}
+
+// server_ready tells the old process that workers accept connections, so it may drain.
+// Sockets it has passed and no worker has taken are closed: address or mode has changed.
+static void server_ready(server *server) {
+    for (int i = 0; i < server->inherited_len; i++) {
+        if (server->inherited[i] >= 0) {
+            close(server->inherited[i]);
+            server->inherited[i] = -1;
+        }
+    }
+    if (server->ready_fd < 0) {
+        return;
+    }
+    if (write(server->ready_fd, "1", 1) < 0) {
+        perror("Cannot notify old process");
+    }
+    close(server->ready_fd);
+    server->ready_fd = -1;
+}
+
+// server_upgrade starts binary at path with the same arguments. Listening sockets and write end
+// of readiness pipe are passed through environment; until the new process writes to the pipe
+// or exits, this one keeps serving.
+static int server_upgrade(server *server, const char *path) {
+    if (server->upgrade_fd >= 0) {
+        fprintf(stderr, "New process %d is still starting, ignoring upgrade\n", server->upgrade_pid);
+        return -1;
+    }
+    int fds_len = 0;
+    int fds_cap = server->cfg->worker_num + 1;
+    for (int i = 0; i < server->cfg->worker_num; i++) {
+        fds_cap += server->workers[i].surplus_fds_len;
+    }
+    int *fds = malloc(fds_cap * sizeof(int));
+    char *fds_env = malloc(sizeof(LISTEN_FDS_ENV "=") + fds_cap * 12);
+    size_t env_len = 0;
+    while (environ[env_len] != NULL) {
+        env_len++;
+    }
+    char **env = malloc((env_len + 3) * sizeof(char *));
+    if (fds == NULL || fds_env == NULL || env == NULL) {
+        perror("Malloc error");
+        free(fds);
+        free(fds_env);
+        free(env);
+        return -1;
+    }
+
+    if (server->sockfd >= 0) {
+        fds[fds_len++] = server->sockfd;
+    }
+    if (server->cfg->reuseport) {
+        for (int i = 0; i < server->cfg->worker_num; i++) {
+            fds[fds_len++] = server->workers[i].listen_fd;
+            for (int j = 0; j < server->workers[i].surplus_fds_len; j++) {
+                fds[fds_len++] = server->workers[i].surplus_fds[j];
+            }
+        }
+    }
+    char *p = fds_env + sprintf(fds_env, "%s=", LISTEN_FDS_ENV);
+    for (int i = 0; i < fds_len; i++) {
+        p += sprintf(p, i == 0 ? "%d" : ",%d", fds[i]);
+    }
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        perror("Pipe error");
+        free(fds);
+        free(fds_env);
+        free(env);
+        return -1;
+    }
+    char ready_env[sizeof(READY_FD_ENV "=") + 12];
+    sprintf(ready_env, "%s=%d", READY_FD_ENV, ready[1]);
+    memcpy(env, environ, env_len * sizeof(char *));
+    env[env_len] = fds_env;
+    env[env_len + 1] = ready_env;
+    env[env_len + 2] = NULL;
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // only async-signal-safe calls in the child of multithreaded process
+        for (int i = 0; i < fds_len; i++) {
+            fcntl(fds[i], F_SETFD, 0);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+        execve(path, server->argv, env);
+        _exit(127);
+    }
+    close(ready[1]);
+    free(fds);
+    free(fds_env);
+    free(env);
+    if (pid < 0) {
+        perror("Fork error");
+        close(ready[0]);
+        return -1;
+    }
+    printf("Started new process %d: %s\n", pid, path);
+    server->upgrade_pid = pid;
+    server->upgrade_fd = ready[0];
+    return 0;
+}
+
+// server_upgrade_done reads readiness pipe of the new process, returns 1 if it has taken over.
+// EOF means it has exited before that, so this process goes on.
+static int server_upgrade_done(server *server) {
+    char ready;
+    ssize_t r = read(server->upgrade_fd, &ready, 1);
+    if (r < 0 && errno == EINTR) {
+        return 0;
+    }
+    close(server->upgrade_fd);
+    server->upgrade_fd = -1;
+    if (r == 1) {
+        printf("New process %d is ready, draining\n", server->upgrade_pid);
+        return 1;
+    }
+
+    int status = 0;
+    waitpid(server->upgrade_pid, &status, 0);
+    if (WIFSIGNALED(status)) {
+        fprintf(stderr, "New process %d was killed by signal %d, keeping this one\n",
+            server->upgrade_pid, WTERMSIG(status));
+    } else {
+        fprintf(stderr, "New process %d exited with status %d, keeping this one\n",
+            server->upgrade_pid, WEXITSTATUS(status));
+    }
+    return 0;
+}
+
+// server_signal handles signal taken from signalfd, returns 1 if server should stop.
+static int server_signal(server *server, int signo) {
+    switch (signo) {
+        case SIGHUP: {
+            // config is checked here to keep the old process quiet; new one parses it again anyway
+            serve_config *cfg = parse_serve_config(server->cfg_path);
+            if (cfg == NULL || cfg->static_root == NULL) {
+                fprintf(stderr, "Config `%s` is invalid, keeping the current one\n", server->cfg_path);
+                free_serve_config(cfg);
+                return 0;
+            }
+            free_serve_config(cfg);
+            printf("Reloading config `%s`\n", server->cfg_path);
+            server_upgrade(server, "/proc/self/exe"); // the running binary, even if replaced on disk
+            return 0;
+        }
+        case SIGUSR2:
+            printf("Upgrading binary\n");
+            server_upgrade(server, server->exe);
+            return 0;
+        default:
+            if (server->upgrade_fd >= 0) {
+                kill(server->upgrade_pid, SIGTERM); // not ready yet, it would outlive the stop
+            }
+            printf("Stopping on signal %d\n", signo);
+            return 1;
+    }
+}
+
+#define CLIENT_NAME_LEN (INET_ADDRSTRLEN + sizeof(":65535"))
+
+// client_name formats address as ip:port into name of CLIENT_NAME_LEN bytes,
+// unlike inet_ntoa() it's safe to call from several workers.
+static const char *client_name(const struct sockaddr_in *address, char *name) {
+    inet_ntop(AF_INET, &address->sin_addr, name, INET_ADDRSTRLEN);
+    sprintf(name + strlen(name), ":%hu", ntohs(address->sin_port));
+    return name;
+}
+
 static void worker_read_cb(struct bufferevent *bev, void *ctx);
 static void worker_write_cb(struct bufferevent *bev, void *ctx);
 static void worker_event_cb(struct bufferevent *bev, short events, void *ctx);
+static void client_linger(struct bufferevent *bev, client_ctx *client);
+static void client_drop_lingering(struct bufferevent *bev, client_ctx *client);
 
-static client_ctx *new_client_ctx(const struct sockaddr_in *inet_data, const char *static_root);
-static void free_client_ctx(client_ctx *ctx);
+static client_ctx *new_client_ctx(worker *w, const struct sockaddr_in *inet_data);
+static void free_client_ctx(client_ctx *ctx, enum metrics_close_reason reason);
 
-int server_accept(const server *server) {
-    assert(server != NULL);
-    assert(server->workers != NULL);
+static int worker_attach_client(worker *w, int clientfd, const struct sockaddr_in *client);
+static int server_dispatch(const server *server, dispatcher *d);
+static int worker_handoff(worker *w, int clientfd, const struct sockaddr_in *client);
+static void worker_handoff_cb(evutil_socket_t fd, short what, void *arg);
+static void worker_accept_cb(struct evconnlistener *listener, evutil_socket_t clientfd,
+    struct sockaddr *address, int socklen, void *ctx);
+static void worker_accept_error_cb(struct evconnlistener *listener, void *ctx);
 
-    printf("Accepting connections at %s:%hu\n", 
-        inet_ntoa(server->name.sin_addr), 
-        ntohs(server->name.sin_port));
-
-    int i = 0; // round-robin
+// server_accept takes clients from the shared socket until there are none and passes them to workers.
+static void server_accept(const server *server, dispatcher *d) {
+    char name[CLIENT_NAME_LEN];
     while (1) {
         struct sockaddr_in client;
         unsigned int addrlen = sizeof(struct sockaddr_in);
-        int clientfd = accept(server->sockfd, (struct sockaddr *)&client, &addrlen);
+        int clientfd = accept4(server->sockfd, (struct sockaddr *)&client, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
         if (clientfd < 0) {
-            perror("Accept error");
-            continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Accept error");
+            }
+            return;
         }
-        printf("Accepted client: %s:%hu\n", inet_ntoa(client.sin_addr), client.sin_port);
 
-        client_ctx *client_data = new_client_ctx(&client, server->cfg->static_root);
-        if (client_data == NULL) {
-            fprintf(stderr, "Memory error: client struct malloc error: %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client.sin_addr), client.sin_port);
+        // client objects and bufferevent are created in worker thread, so event bases need no locks
+        worker *w = &server->workers[server_dispatch(server, d)];
+        if (worker_handoff(w, clientfd, &client) < 0) {
+            fprintf(stderr, "Cannot pass client to worker: %s; dropping client %s\n",
+                    strerror(errno), client_name(&client, name));
+            metrics_add(&w->metrics->dispatch_dropped, 1);
             close(clientfd);
             continue;
         }
+        metrics_add(&w->metrics->dispatched, 1);
+    }
+}
 
-        if (evutil_make_socket_nonblocking(clientfd) != 0) {
-            fprintf(stderr, "Cannot make socket nonblocking: %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client.sin_addr), client.sin_port);
-            free_client_ctx(client_data);
-            close(clientfd);
+// server_serve runs main thread until server should stop: it handles signals, waits for the new process
+// on upgrade and without reuseport and io_uring it is the accept thread too.
+static void server_serve(server *server) {
+    dispatcher d = { .next = 0, .random = (uint64_t)time(NULL) | 1 };
+    int accepting = !server->cfg->reuseport && !server->cfg->io_uring;
+    struct pollfd fds[3] = {
+        { .fd = server->signal_fd, .events = POLLIN },
+        { .fd = -1, .events = POLLIN }, // readiness pipe of the new process, while it starts
+        { .fd = accepting ? server->sockfd : -1, .events = POLLIN },
+    };
+    while (1) {
+        fds[1].fd = server->upgrade_fd;
+        if (poll(fds, 3, -1) < 0) {
+            if (errno != EINTR) {
+                perror("Poll error");
+            }
             continue;
         }
+        if (fds[2].revents != 0) {
+            server_accept(server, &d);
+        }
+        if (fds[1].revents != 0 && server_upgrade_done(server)) {
+            return;
+        }
+        struct signalfd_siginfo info;
+        if (fds[0].revents != 0 && read(server->signal_fd, &info, sizeof(info)) == sizeof(info) &&
+                server_signal(server, info.ssi_signo)) {
+            return;
+        }
+    }
+}
 
-        struct bufferevent *client_ev = bufferevent_socket_new(server->workers[i].worker_ev_base,
-            clientfd, BEV_OPT_CLOSE_ON_FREE); // close client socket when freeing the bufferevent
-        if (client_ev == NULL) {
-            fprintf(stderr, "Accepting: event new error: %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client.sin_addr), client.sin_port);
-            free_client_ctx(client_data);
-            close(clientfd);
-            continue;
+// server_drain_signaled reads signals which came while draining, returns 1 if one of them stops
+// the server right away: it's the second SIGTERM or SIGINT.
+static int server_drain_signaled(server *server) {
+    struct signalfd_siginfo info;
+    int stop = 0;
+    while (read(server->signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT) {
+            printf("Stopping on signal %d: closing the rest of connections\n", info.ssi_signo);
+            stop = 1;
         }
-        bufferevent_setcb(client_ev, worker_read_cb, worker_write_cb, worker_event_cb, client_data);
-        static const struct timeval io_timeout = { CLIENT_IO_TIMEOUT, 0 };
-        if (bufferevent_set_timeouts(client_ev, &io_timeout, &io_timeout) < 0) {
-            fprintf(stderr, "Accepting: event set timeouts error: %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client.sin_addr), client.sin_port);
-            free_client_ctx(client_data);
-            bufferevent_free(client_ev);
-            continue;
+    }
+    return stop;
+}
+
+// server_drain stops accepting and waits for workers to finish in-flight responses for up to
+// shutdown_timeout or until SIGTERM or SIGINT comes again, then the rest of connections are closed.
+// Returns error of failed worker, if any.
+static int server_drain(server *server) {
+    const serve_config *cfg = server->cfg;
+    printf("Draining connections for up to %d seconds\n", cfg->shutdown_timeout);
+    if (!cfg->reuseport && !cfg->io_uring) {
+        close(server->sockfd); // the new process has its own descriptor
+        server->sockfd = -1;
+    }
+    for (int i = 0; i < cfg->worker_num; i++) {
+        __atomic_store_n(&server->workers[i].stop, 1, __ATOMIC_RELEASE);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += cfg->shutdown_timeout;
+    int r = 0;
+    int closing = 0;
+    for (int i = 0; i < cfg->worker_num; i++) {
+        void *worker_r = NULL;
+        // joined in short steps, signals are checked in between
+        while (!closing) {
+            struct timespec step;
+            clock_gettime(CLOCK_REALTIME, &step);
+            step.tv_nsec += DRAIN_SIGNAL_INTERVAL_NS;
+            if (step.tv_nsec >= 1000000000) {
+                step.tv_sec++;
+                step.tv_nsec -= 1000000000;
+            }
+            int timeout = step.tv_sec > deadline.tv_sec ||
+                (step.tv_sec == deadline.tv_sec && step.tv_nsec >= deadline.tv_nsec);
+            if (pthread_timedjoin_np(server->workers[i].worker_thread, &worker_r,
+                    timeout ? &deadline : &step) != ETIMEDOUT) {
+                break;
+            }
+            if (timeout) {
+                fprintf(stderr, "Shutdown timeout: closing the rest of connections\n");
+                closing = 1;
+            } else {
+                closing = server_drain_signaled(server);
+            }
         }
-        if (bufferevent_enable(client_ev, EV_READ/*|EV_WRITE*/) < 0) {
-            fprintf(stderr, "Accepting: cannot enable client event (read): %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client.sin_addr), client.sin_port);
-            free_client_ctx(client_data);
-            bufferevent_free(client_ev);
-            continue;
+        if (closing) {
+            // workers which have already stopped ignore it
+            for (int j = i; j < cfg->worker_num; j++) {
+                __atomic_store_n(&server->workers[j].stop, 2, __ATOMIC_RELEASE);
+            }
+            pthread_join(server->workers[i].worker_thread, &worker_r);
         }
+        if (worker_r != NULL) {
+            r = (int)(intptr_t)worker_r;
+        }
+    }
+    return r;
+}
+
+// worker_load is what worker has to do: open connections, clients waiting in its handoff ring
+// and unwritten responses, so a worker streaming big files looks busy with few connections.
+static uint64_t worker_load(const worker *w) {
+    const handoff_ring *ring = w->handoff;
+    return __atomic_load_n(&w->metrics->load_active, __ATOMIC_RELAXED) +
+        (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) +
+        __atomic_load_n(&w->metrics->load_queued_bytes, __ATOMIC_RELAXED) / DISPATCH_BYTES_PER_CONN;
+}
+
+// server_dispatch picks worker for the next client according to the configured policy.
+static int server_dispatch(const server *server, dispatcher *d) {
+    int n = server->cfg->worker_num;
+    int best = d->next;
+    d->next = (d->next + 1) % n;
 
-        i = (i + 1) % server->cfg->worker_num; // round-robin: next worker
+    switch (server->cfg->dispatch) {
+        case DISPATCH_LEAST_CONN: {
+            uint64_t best_load = worker_load(&server->workers[best]);
+            for (int k = 1; k < n && best_load > 0; k++) {
+                int i = (best + k) % n;
+                uint64_t load = worker_load(&server->workers[i]);
+                if (load < best_load) {
+                    best_load = load;
+                    best = i;
+                }
+            }
+            return best;
+        }
+        case DISPATCH_P2C: {
+            if (n == 1) {
+                return 0;
+            }
+            d->random ^= d->random << 13;
+            d->random ^= d->random >> 7;
+            d->random ^= d->random << 17;
+            int a = d->random % n;
+            int b = (d->random >> 32) % (n - 1);
+            if (b >= a) {
+                b++; // two different workers
+            }
+            return worker_load(&server->workers[a]) <= worker_load(&server->workers[b]) ? a : b;
+        }
+        default:
+            return best;
     }
 }
 
-static void *worker_process(struct event_base *_worker_ev_base);
+// worker_handoff queues client to worker, it's called only from accept thread.
+// Worker is woken up only if it has taken everything queued before, otherwise it's still draining
+// and sees the new client itself. Stores and loads of head and tail are sequentially consistent
+// for that: either accept thread sees that worker caught up, or worker sees the new tail.
+static int worker_handoff(worker *w, int clientfd, const struct sockaddr_in *client) {
+    handoff_ring *ring = w->handoff;
+    size_t tail = ring->tail; // accept thread is the only writer
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == HANDOFF_RING_LEN) {
+        errno = EAGAIN; // worker doesn't keep up
+        return -1;
+    }
+    ring->clients[tail & (HANDOFF_RING_LEN - 1)] = (client_handoff){ clientfd, *client };
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
 
-static int init_worker_pool(worker *pool, int size) {
-    assert(pool != NULL);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail) {
+        uint64_t one = 1;
+        if (write(w->handoff_fd, &one, sizeof(one)) < 0) {
+            perror("Handoff wakeup error"); // client is queued, it's taken with the next one
+        }
+    }
+    return 0;
+}
 
-    if (size < 1) {
-        size = 1;
+// worker_handoff_cb attaches clients queued by accept thread.
+static void worker_handoff_cb(evutil_socket_t fd, short what, void *arg) {
+    (void)what;
+    worker *w = (worker *)arg;
+    uint64_t wakeups;
+    if (read(fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        perror("Handoff eventfd read error");
+    }
+
+    handoff_ring *ring = w->handoff;
+    size_t head = ring->head; // worker is the only writer
+    size_t tail;
+    while ((tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST)) != head) {
+        for (; head != tail; head++) {
+            const client_handoff *handoff = &ring->clients[head & (HANDOFF_RING_LEN - 1)];
+            worker_attach_client(w, handoff->clientfd, &handoff->address);
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST); // slots are free only now
+    }
+}
+
+// worker_attach_client creates client context and bufferevent for already nonblocking clientfd
+// on worker's event base, must be called in worker thread. On failure clientfd is closed.
+static int worker_attach_client(worker *w, int clientfd, const struct sockaddr_in *client) {
+    char name[CLIENT_NAME_LEN];
+    client_ctx *client_data = new_client_ctx(w, client);
+    if (client_data == NULL) {
+        fprintf(stderr, "Memory error: client struct malloc error: %s; dropping client %s\n",
+                strerror(errno), client_name(client, name));
+        close(clientfd);
+        return -1;
+    }
+
+    struct bufferevent *client_ev = bufferevent_socket_new(w->worker_ev_base,
+        clientfd, BEV_OPT_CLOSE_ON_FREE); // close client socket when freeing the bufferevent
+    if (client_ev == NULL) {
+        fprintf(stderr, "Accepting: event new error: %s; dropping client %s\n",
+                strerror(errno), client_name(client, name));
+        free_client_ctx(client_data, CLOSE_INTERNAL);
+        close(clientfd);
+        return -1;
+    }
+    client_data->bev = client_ev;
+    bufferevent_setcb(client_ev, worker_read_cb, worker_write_cb, worker_event_cb, client_data);
+    // input is parsed in place, so it holds at most one request head beyond what parser has seen;
+    // reading also stops there while pipelined requests wait for the current response
+    bufferevent_setwatermark(client_ev, EV_READ, 0, w->cfg->max_header_size);
+    static const struct timeval io_timeout = { CLIENT_IO_TIMEOUT, 0 };
+    if (bufferevent_set_timeouts(client_ev, &io_timeout, &io_timeout) < 0) {
+        fprintf(stderr, "Accepting: event set timeouts error: %s; dropping client %s\n",
+                strerror(errno), client_name(client, name));
+        free_client_ctx(client_data, CLOSE_INTERNAL);
+        bufferevent_free(client_ev);
+        return -1;
+    }
+    if (bufferevent_enable(client_ev, EV_READ/*|EV_WRITE*/) < 0) {
+        fprintf(stderr, "Accepting: cannot enable client event (read): %s; dropping client %s\n",
+                strerror(errno), client_name(client, name));
+        free_client_ctx(client_data, CLOSE_INTERNAL);
+        bufferevent_free(client_ev);
+        return -1;
+    }
+
+    return 0;
+}
+
+// worker_accept_cb is called by worker's own listener. libevent drains the whole backlog
+// with nonblocking accept4() on every wakeup, so we get here once per accepted client.
+static void worker_accept_cb(struct evconnlistener *listener, evutil_socket_t clientfd,
+        struct sockaddr *address, int socklen, void *ctx) {
+    (void)listener;
+    (void)socklen;
+    worker *w = (worker *)ctx;
+    struct sockaddr_in *client = (struct sockaddr_in *)address;
+
+    worker_attach_client(w, clientfd, client);
+}
+
+static void worker_accept_error_cb(struct evconnlistener *listener, void *ctx) {
+    (void)listener;
+    (void)ctx;
+    perror("Accept error");
+}
+
+static const struct timeval lag_interval = { 0, METRICS_LOOP_LAG_INTERVAL_MS * 1000 };
+
+static void *worker_process(worker *w);
+static void worker_date_cb(evutil_socket_t fd, short what, void *arg);
+static void worker_lag_cb(evutil_socket_t fd, short what, void *arg);
+static void worker_io_cb(evutil_socket_t fd, short what, void *arg);
+
+static void free_worker_pool(worker *pool, int size) {
+    for (int i = 0; i < size; i++) {
+        if (pool[i].listener != NULL) {
+            evconnlistener_free(pool[i].listener);
+        }
+        if (pool[i].listen_fd_owned) {
+            close(pool[i].listen_fd);
+        }
+        for (int j = 0; j < pool[i].surplus_fds_len; j++) {
+            if (pool[i].surplus_listeners != NULL) {
+                if (pool[i].surplus_listeners[j] != NULL) {
+                    evconnlistener_free(pool[i].surplus_listeners[j]);
+                }
+            } else if (pool[i].listen_fd_owned) {
+                close(pool[i].surplus_fds[j]);
+            }
+        }
+        free(pool[i].surplus_fds);
+        free(pool[i].surplus_listeners);
+        if (pool[i].date_timer != NULL) {
+            event_free(pool[i].date_timer);
+        }
+        if (pool[i].lag_timer != NULL) {
+            event_free(pool[i].lag_timer);
+        }
+        if (pool[i].io_event != NULL) {
+            event_free(pool[i].io_event);
+        }
+        if (pool[i].io_pool != NULL) {
+            io_job *job = io_completions_take(&pool[i].io_done); // of clients closed on shutdown timeout
+            while (job != NULL) {
+                io_job *next = job->next;
+                free(job);
+                job = next;
+            }
+            io_completions_destroy(&pool[i].io_done);
+        }
+        if (pool[i].handoff_event != NULL) {
+            event_free(pool[i].handoff_event);
+        }
+        if (pool[i].handoff != NULL) {
+            close(pool[i].handoff_fd);
+            free(pool[i].handoff);
+        }
+        event_base_free(pool[i].worker_ev_base);
+        object_pool_destroy(&pool[i].clients);
+        http_pools_destroy(&pool[i].http_pools);
     }
+}
+
+// init_workers sets up state of every worker while this thread runs on worker's CPU, so its memory
+// is first touched on worker's NUMA node; the rest is allocated lazily by the worker itself.
+// Caller restores affinity of the thread.
+static int init_workers(server *server, worker *pool, int size) {
     for (int i = 0; i < size; i++) {
-        pool[i].worker_ev_base = event_base_new();
-        if (pool[i].worker_ev_base == NULL) {
+        pool[i].cpu = server->cpus_len > 0 ? server->cpus[i % server->cpus_len] : -1;
+        if (pool[i].cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(pool[i].cpu, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+        pool[i].cfg = server->cfg;
+        object_pool_init(&pool[i].clients, sizeof(client_ctx), MAX_FREE_CLIENTS);
+        http_pools_init(&pool[i].http_pools);
+        pool[i].metrics = metrics_worker(i);
+        pool[i].metrics->clients = &pool[i].clients;
+        pool[i].metrics->http_pools = &pool[i].http_pools;
+        pool[i].access_log = access_log_worker(i);
+        // every event base is used only by its worker, libevent doesn't need to lock it;
+        // precise timer keeps loop lag from being rounded up to milliseconds
+        struct event_config *ev_config = event_config_new();
+        if (ev_config == NULL ||
+                event_config_set_flag(ev_config, EVENT_BASE_FLAG_NOLOCK | EVENT_BASE_FLAG_PRECISE_TIMER) < 0 ||
+                (pool[i].worker_ev_base = event_base_new_with_config(ev_config)) == NULL) {
             perror("Event base init error");
-            for (int j = 0; j < i; j++) {
-                event_base_free(pool[j].worker_ev_base);
+            if (ev_config != NULL) {
+                event_config_free(ev_config);
             }
+            free_worker_pool(pool, i);
             return SERVE_LIBEVENT_ERROR;
         }
+        event_config_free(ev_config);
 
-        if (pthread_create(&pool[i].worker_thread, NULL,
-                (void *)worker_process, pool[i].worker_ev_base) != 0) {
-            perror("Pthread creation error");
-            for (int j = 0; j < i; j++) {
-                event_base_free(pool[j].worker_ev_base);
+        pool[i].date_timer = event_new(pool[i].worker_ev_base, -1, EV_PERSIST, worker_date_cb, &pool[i]);
+        static const struct timeval date_interval = { 1, 0 };
+        if (pool[i].date_timer == NULL || event_add(pool[i].date_timer, &date_interval) < 0) {
+            perror("Date timer init error");
+            free_worker_pool(pool, i + 1);
+            return SERVE_LIBEVENT_ERROR;
+        }
+        // added by worker itself, so the first delay doesn't include thread start
+        if ((pool[i].lag_timer = event_new(pool[i].worker_ev_base, -1, 0, worker_lag_cb, &pool[i])) == NULL) {
+            perror("Lag timer init error");
+            free_worker_pool(pool, i + 1);
+            return SERVE_LIBEVENT_ERROR;
+        }
+
+        if (server->io_pools != NULL) {
+            if (io_completions_init(&pool[i].io_done) < 0) {
+                perror("I/O completion eventfd error");
+                free_worker_pool(pool, i + 1);
+                return SERVE_LIBEVENT_ERROR;
+            }
+            pool[i].io_pool = server->io_pools[worker_node(server, i)];
+            if (!server->cfg->io_uring) {
+                pool[i].io_event = event_new(pool[i].worker_ev_base, pool[i].io_done.fd, EV_READ | EV_PERSIST,
+                    worker_io_cb, &pool[i]);
+                if (pool[i].io_event == NULL || event_add(pool[i].io_event, NULL) < 0) {
+                    perror("I/O completion event init error");
+                    free_worker_pool(pool, i + 1);
+                    return SERVE_LIBEVENT_ERROR;
+                }
+            }
+        }
+
+        if (server->cfg->io_uring) {
+            // ring accepts itself, from its own socket or together with other workers from the shared one
+            if (server->cfg->reuseport) {
+                if ((pool[i].listen_fd = server_inherited_socket(server, 1)) < 0 &&
+                        (pool[i].listen_fd = listen_reuseport(&server->name)) < 0) {
+                    free_worker_pool(pool, i + 1);
+                    return SERVE_LISTEN_ERROR;
+                }
+                pool[i].listen_fd_owned = 1;
+            } else {
+                pool[i].listen_fd = server->sockfd;
+            }
+        } else if (server->cfg->reuseport) {
+            // every worker binds its own socket, kernel balances incoming connections between them;
+            // after upgrade worker takes over a socket of the old process with its backlog
+            int fd = server_inherited_socket(server, 1);
+            if (fd >= 0) {
+                evutil_make_socket_nonblocking(fd);
+                pool[i].listener = evconnlistener_new(pool[i].worker_ev_base, worker_accept_cb, &pool[i],
+                    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC, 0, fd);
+                if (pool[i].listener == NULL) {
+                    close(fd);
+                }
+            } else {
+                pool[i].listener = evconnlistener_new_bind(pool[i].worker_ev_base, worker_accept_cb, &pool[i],
+                    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT,
+                    MAX_QUEUE_LEN, (struct sockaddr *)&server->name, sizeof(struct sockaddr_in));
+            }
+            if (pool[i].listener == NULL) {
+                perror("Listener init error");
+                free_worker_pool(pool, i + 1);
+                return SERVE_LISTEN_ERROR;
+            }
+            evconnlistener_set_error_cb(pool[i].listener, worker_accept_error_cb);
+            pool[i].listen_fd = evconnlistener_get_fd(pool[i].listener); // passed on upgrade
+        } else {
+            // accept thread passes clients through the ring
+            if ((pool[i].handoff = aligned_alloc(64, sizeof(handoff_ring))) == NULL) {
+                perror("Handoff ring allocate error");
+                free_worker_pool(pool, i + 1);
+                return SERVE_MEMORY_ERROR;
+            }
+            pool[i].handoff->head = pool[i].handoff->tail = 0;
+            if ((pool[i].handoff_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+                perror("Handoff eventfd error");
+                free(pool[i].handoff);
+                pool[i].handoff = NULL;
+                free_worker_pool(pool, i + 1);
+                return SERVE_LIBEVENT_ERROR;
+            }
+            pool[i].handoff_event = event_new(pool[i].worker_ev_base, pool[i].handoff_fd, EV_READ | EV_PERSIST,
+                worker_handoff_cb, &pool[i]);
+            if (pool[i].handoff_event == NULL || event_add(pool[i].handoff_event, NULL) < 0) {
+                perror("Handoff event init error");
+                free_worker_pool(pool, i + 1);
+                return SERVE_LIBEVENT_ERROR;
+            }
+        }
+    }
+    return 0;
+}
+
+// init_surplus_listeners hands inherited sockets which no worker has taken to workers round-robin.
+// Old process had more workers; kernel has been queueing connections in their sockets, closing them
+// would reset those. Workers accept from them like from their own until the next upgrade passes them on.
+static int init_surplus_listeners(server *server, worker *pool, int size) {
+    int fd;
+    for (int n = 0; (fd = server_inherited_socket(server, 1)) >= 0; n++) {
+        worker *w = &pool[n % size];
+        int *fds = realloc(w->surplus_fds, (w->surplus_fds_len + 1) * sizeof(int));
+        if (fds == NULL) {
+            perror("Malloc error");
+            close(fd);
+            return SERVE_MEMORY_ERROR;
+        }
+        w->surplus_fds = fds;
+        if (!server->cfg->io_uring) {
+            struct evconnlistener **listeners = realloc(w->surplus_listeners,
+                (w->surplus_fds_len + 1) * sizeof(struct evconnlistener *));
+            if (listeners == NULL) {
+                perror("Malloc error");
+                close(fd);
+                return SERVE_MEMORY_ERROR;
             }
+            w->surplus_listeners = listeners;
+            evutil_make_socket_nonblocking(fd);
+            listeners[w->surplus_fds_len] = evconnlistener_new(w->worker_ev_base, worker_accept_cb, w,
+                LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC, 0, fd);
+            if (listeners[w->surplus_fds_len] == NULL) {
+                perror("Listener init error");
+                close(fd);
+                return SERVE_LISTEN_ERROR;
+            }
+            evconnlistener_set_error_cb(listeners[w->surplus_fds_len], worker_accept_error_cb);
+        }
+        w->surplus_fds[w->surplus_fds_len++] = fd;
+    }
+    if (server->inherited_len > 0) {
+        for (int i = 0; i < size; i++) {
+            if (pool[i].surplus_fds_len > 0) {
+                printf("Worker %d accepts from %d more inherited sockets\n", i, pool[i].surplus_fds_len);
+            }
+        }
+    }
+    return 0;
+}
+
+static int init_worker_pool(server *server, worker *pool, int size) {
+    assert(pool != NULL);
+
+    if (size < 1) {
+        size = 1;
+    }
+    cpu_set_t own_cpus;
+    pthread_getaffinity_np(pthread_self(), sizeof(own_cpus), &own_cpus);
+    int r = init_workers(server, pool, size);
+    pthread_setaffinity_np(pthread_self(), sizeof(own_cpus), &own_cpus);
+    if (r != 0) {
+        return r;
+    }
+    if (server->cfg->reuseport && (r = init_surplus_listeners(server, pool, size)) != 0) {
+        free_worker_pool(pool, size);
+        return r;
+    }
+
+    for (int i = 0; i < size; i++) {
+        // pinned from the start, so worker's own first allocations are local too
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (pool[i].cpu >= 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(pool[i].cpu, &cpus);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+        r = pthread_create(&pool[i].worker_thread, &attr, (void *)worker_process, &pool[i]);
+        pthread_attr_destroy(&attr);
+        if (r != 0) {
+            errno = r;
+            perror("Pthread creation error");
+            free_worker_pool(pool, size);
             return SERVE_PTHREAD_ERROR;
         }
     }
@@ -240,141 +1379,476 @@ static int init_worker_pool(worker *pool, int size) {
 // worker
 //
 
-static void *worker_process(struct event_base *_worker_ev_base) {
-    assert(_worker_ev_base != NULL);
+static void *worker_process(worker *w) {
+    assert(w != NULL);
+    assert(w->worker_ev_base != NULL);
+
+    if (w->cfg->io_uring) {
+        int *listen_fds = malloc((w->surplus_fds_len + 1) * sizeof(int));
+        if (listen_fds == NULL) {
+            perror("Malloc error");
+            return (void *)SERVE_MEMORY_ERROR;
+        }
+        listen_fds[0] = w->listen_fd;
+        memcpy(listen_fds + 1, w->surplus_fds, w->surplus_fds_len * sizeof(int));
+        int listen_fd_owned = w->listen_fd_owned;
+        w->listen_fd_owned = 0; // loop closes them as soon as it stops accepting
+        int r = uring_worker_loop(listen_fds, w->surplus_fds_len + 1, listen_fd_owned, w->cfg, &w->http_pools,
+            w->metrics, w->access_log, w->io_pool, w->io_pool != NULL ? &w->io_done : NULL, &w->stop);
+        free(listen_fds);
+        return (void *)(intptr_t)(r < 0 ? SERVE_LIBEVENT_ERROR : 0);
+    }
 
-    if (event_base_loop(_worker_ev_base, EVLOOP_NO_EXIT_ON_EMPTY) != 1) {
+    http_date_update(time(NULL));
+    w->lag_armed = metrics_now_ns();
+    if (event_add(w->lag_timer, &lag_interval) < 0) {
+        perror("Lag timer add error");
+        return (void *)SERVE_LIBEVENT_ERROR;
+    }
+    // EVLOOP_NO_EXIT_ON_EMPTY is set, loop runs until worker is drained
+    if (event_base_loop(w->worker_ev_base, EVLOOP_NO_EXIT_ON_EMPTY) < 0) {
         perror("Event base loop error");
         return (void *)SERVE_LIBEVENT_ERROR;
     }
-    // EVLOOP_NO_EXIT_ON_EMPTY is set, endless event loop
 
     return (void *)0;
 }
 
+static void worker_close_clients(worker *w, int idle_only);
+
+// worker_date_cb keeps worker's Date header fresh, so responses don't format time.
+// Draining worker closes idle connections here.
+static void worker_date_cb(evutil_socket_t fd, short what, void *arg) {
+    (void)fd;
+    (void)what;
+    worker *w = (worker *)arg;
+    http_date_update(time(NULL));
+    if (w->draining == 1) {
+        worker_close_clients(w, 1);
+    }
+}
+
+// client_idle tells that client has been served and hasn't started the next request for a while.
+static int client_idle(const client_ctx *client, time_t now) {
+    return client->idle_since != 0 && now - client->idle_since >= DRAIN_IDLE_TIMEOUT &&
+        client->response == NULL && client->io_job == NULL && client->request_start == 0 && client->body_left == 0 &&
+        client->linger_until == 0;
+}
+
+// worker_close_clients closes all connections of worker, or only idle ones if idle_only is set.
+static void worker_close_clients(worker *w, int idle_only) {
+    time_t now = time(NULL);
+    client_ctx *client = w->client_list;
+    while (client != NULL) {
+        client_ctx *next = client->next;
+        if (!idle_only || client_idle(client, now)) {
+            bufferevent_free(client->bev);
+            free_client_ctx(client, idle_only ? CLOSE_DONE : CLOSE_TIMEOUT);
+        }
+        client = next;
+    }
+}
+
+// worker_drain stops accepting and closes idle connections, the rest get Connection: close
+// with the next response; on level 2 all connections are closed right away.
+static void worker_drain(worker *w, int level) {
+    if (w->listener != NULL) {
+        evconnlistener_free(w->listener); // the new process has its own descriptor
+        w->listener = NULL;
+    }
+    for (int i = 0; w->surplus_listeners != NULL && i < w->surplus_fds_len; i++) {
+        if (w->surplus_listeners[i] != NULL) {
+            evconnlistener_free(w->surplus_listeners[i]);
+            w->surplus_listeners[i] = NULL;
+        }
+    }
+    w->draining = level;
+    worker_close_clients(w, level == 1);
+}
+
+// worker_drained tells that draining worker has no connections left, including ones accept thread
+// has queued before it stopped.
+static int worker_drained(const worker *w) {
+    return w->draining > 1 || (w->client_list == NULL &&
+        (w->handoff == NULL || __atomic_load_n(&w->handoff->tail, __ATOMIC_ACQUIRE) == w->handoff->head));
+}
+
+// worker_lag_cb measures how late the timer fires: callbacks which ran meanwhile held the loop.
+// It also checks if main thread stops the worker.
+static void worker_lag_cb(evutil_socket_t fd, short what, void *arg) {
+    (void)fd;
+    (void)what;
+    worker *w = (worker *)arg;
+    w->lag_armed = metrics_loop_lag(w->metrics, w->lag_armed);
+    int stop = __atomic_load_n(&w->stop, __ATOMIC_ACQUIRE);
+    if (stop > w->draining) {
+        worker_drain(w, stop);
+    }
+    if (w->draining && worker_drained(w)) {
+        event_base_loopbreak(w->worker_ev_base);
+        return;
+    }
+    if (event_add(w->lag_timer, &lag_interval) < 0) {
+        perror("Lag timer add error");
+    }
+}
+
 static void worker_event_cb(struct bufferevent *bev, short events, void *ctx) {
     client_ctx *client = (client_ctx *)ctx;
+    char name[CLIENT_NAME_LEN];
 
-    if (events & BEV_EVENT_ERROR) {
-        fprintf(stderr, "Error %s: dropping client %s:%hu\n",
-            strerror(errno), inet_ntoa(client->address.sin_addr), client->address.sin_port);
+    enum metrics_close_reason reason = CLOSE_ERROR;
+    int err = EVUTIL_SOCKET_ERROR(); // how libevent reports socket errors, errno only on Unix
+    if (client->linger_until != 0) {
+        reason = CLOSE_DONE; // response is written, lingering ends with whatever happens
+    } else if ((events & BEV_EVENT_ERROR) && err == ECONNRESET) {
+        reason = CLOSE_EOF; // client went away without reading everything, not our error
+    } else if (events & BEV_EVENT_ERROR) {
+        fprintf(stderr, "Error %s: dropping client %s\n",
+            evutil_socket_error_to_string(err), client_name(&client->address, name));
     } else if (events & BEV_EVENT_TIMEOUT) {
-        fprintf(stderr, "Client timeout: dropping client %s:%hu\n",
-            inet_ntoa(client->address.sin_addr), client->address.sin_port);
+        reason = CLOSE_TIMEOUT; // timeouts and disconnects are routine, they are only counted
     } else if (events & BEV_EVENT_EOF) {
-        fprintf(stderr, "Client disconnected: dropping client %s:%hu\n",
-            inet_ntoa(client->address.sin_addr), client->address.sin_port);
+        reason = CLOSE_EOF;
     } else if (events & (BEV_EVENT_READING | BEV_EVENT_WRITING)) {
-        fprintf(stderr, "Error while read/write process: dropping client %s:%hu\n",
-            inet_ntoa(client->address.sin_addr), client->address.sin_port);
+        fprintf(stderr, "Error while read/write process: dropping client %s\n",
+            client_name(&client->address, name));
     } else {
-        fprintf(stderr, "Unknown error %d: dropping client %s:%hu\n", events,
-            inet_ntoa(client->address.sin_addr), client->address.sin_port);
+        fprintf(stderr, "Unknown error %d: dropping client %s\n", events,
+            client_name(&client->address, name));
     }
     bufferevent_free(bev);
-    free_client_ctx(ctx);
+    free_client_ctx(ctx, reason);
+}
+
+static void release_body_file(struct evbuffer_file_segment const *segment, int flags, void *file) {
+    (void)segment;
+    (void)flags;
+    file_entry_unref((file_entry *)file);
+}
+
+static void release_body_blob(const void *data, size_t len, void *blob) {
+    (void)data;
+    (void)len;
+    file_blob_unref((file_blob *)blob);
+}
+
+// client_queue_response puts the whole response to bufferevent output: headers are copied,
+// body is referenced from content cache or attached as a file segment which libevent sends
+// with sendfile(), both without copying.
+static int client_queue_response(struct bufferevent *bev, http_response *response) {
+    struct evbuffer *output = bufferevent_get_output(bev);
+    if (evbuffer_add(output, response->headers->data, response->headers->len) < 0) {
+        return -1;
+    }
+    if (response->body_len == 0) {
+        return 0;
+    }
+
+    if (response->body_blob != NULL) {
+        file_blob_ref(response->body_blob);
+        if (evbuffer_add_reference(output, response->body_blob->body + response->body_offset, response->body_len,
+                release_body_blob, response->body_blob) < 0) {
+            file_blob_unref(response->body_blob);
+            return -1;
+        }
+        return 0;
+    }
+
+    // cached descriptor is shared, so segment doesn't close it but keeps the file referenced until sent
+    struct evbuffer_file_segment *body = evbuffer_file_segment_new(response->body_file->fd,
+        response->body_offset, response->body_len, EVBUF_FS_DISABLE_LOCKING);
+    if (body == NULL) {
+        return -1;
+    }
+    file_entry_ref(response->body_file);
+    evbuffer_file_segment_add_cleanup_cb(body, release_body_file, response->body_file);
+    int r = evbuffer_add_file_segment(output, body, 0, response->body_len);
+    evbuffer_file_segment_free(body); // output holds its own reference until body is sent
+    return r;
+}
+
+static int client_respond(struct bufferevent *bev, client_ctx *client, const char *data, int nonblocking);
+
+// client_process_request handles the first complete request in bufferevent input, if any,
+// and starts writing the response. Bytes after its end stay in the input (pipelining).
+// Request is parsed in place: input is made contiguous only if socket data landed in several chains,
+// and parser continues from where it stopped, so only new bytes are scanned.
+// Returns -1 if client was dropped.
+static int client_process_request(struct bufferevent *bev, client_ctx *client) {
+    char name[CLIENT_NAME_LEN];
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t len = evbuffer_get_length(input);
+    if (client->body_left > 0) {
+        size_t body = len < client->body_left ? len : client->body_left;
+        evbuffer_drain(input, body);
+        client->body_left -= body;
+        len -= body;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (client->request_start == 0) {
+        client->request_start = metrics_now_ns();
+    }
+    if (len > client->max_header_size) {
+        len = client->max_header_size; // rest can only be pipelined requests
+    }
+    const char *data = (const char *)evbuffer_pullup(input, len);
+    if (data == NULL) {
+        fprintf(stderr, "Processing: cannot read request: %s; dropping client %s\n",
+                strerror(errno), client_name(&client->address, name));
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_INTERNAL);
+        return -1;
+    }
+    if (http_parser_execute(&client->parser, data, len) == HTTP_PARSE_AGAIN) {
+        return 0; // wait for the rest of request
+    }
+    if (client->parser.request.malformed || client->parser.request.too_large) {
+        metrics_add(&client->worker->metrics->parse_errors, 1);
+    }
+
+    return client_respond(bev, client, data, client->worker->io_pool != NULL);
+}
+
+// client_offload passes parsed request to I/O pool, it's handled again by worker_io_cb() when the job is done.
+// If job can't be allocated, request is handled right away, blocking.
+static int client_offload(struct bufferevent *bev, client_ctx *client, const char *data) {
+    worker *w = client->worker;
+    io_job *job = io_job_new(client, &w->io_done, client->cfg_static_root, data, client->parser.pos,
+        &client->parser.request);
+    if (job == NULL) {
+        return client_respond(bev, client, data, 0);
+    }
+    client->io_job = job;
+    metrics_add(&w->metrics->io_offloaded, 1);
+    io_pool_submit(w->io_pool, job);
+    return 0;
+}
+
+// client_respond handles complete request at the beginning of data and starts writing the response.
+// If nonblocking is set, request which needs file system is offloaded instead.
+// Returns -1 if client was dropped.
+static int client_respond(struct bufferevent *bev, client_ctx *client, const char *data, int nonblocking) {
+    char name[CLIENT_NAME_LEN];
+    struct evbuffer *input = bufferevent_get_input(bev);
+    if (client->worker->draining) {
+        // response says Connection: close, so client sends the next request to the new process
+        client->parser.request.connection_close = 1;
+        client->parser.request.connection_keep_alive = 0;
+    }
+    if ((client->response = http_handler(data, &client->parser.request, client->cfg_static_root,
+            &client->worker->http_pools, nonblocking)) == NULL) {
+        if (errno == EWOULDBLOCK) {
+            return client_offload(bev, client, data);
+        }
+        fprintf(stderr, "Processing: cannot process http request (write): %s; dropping client %s\n",
+                strerror(errno), client_name(&client->address, name));
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_INTERNAL);
+        return -1;
+    }
+    if (client->worker->access_log != NULL) {
+        client->log_pending = access_log_begin(client->worker->access_log, &client->log_record, &client->address,
+            data, &client->parser.request, client->response);
+    }
+    // keep pipelined requests which are already read, body of this one is dropped before them
+    evbuffer_drain(input, client->parser.pos);
+    client->body_left = client->response->keep_alive ? client->parser.request.content_length : 0;
+    client->linger = !client->response->keep_alive &&
+        (client->parser.request.transfer_encoding || client->parser.request.content_length > 0);
+    http_parser_init(&client->parser, client->max_header_size);
+
+    if (client_queue_response(bev, client->response) < 0) {
+        fprintf(stderr, "Processing: cannot queue response: %s; dropping client %s\n",
+                strerror(errno), client_name(&client->address, name));
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_INTERNAL);
+        return -1;
+    }
+    metrics_observe(&client->worker->metrics->ttfb, metrics_now_ns() - client->request_start);
+    client->queued = client->response->headers->len + client->response->body_len;
+    metrics_add(&client->worker->metrics->load_queued_bytes, client->queued);
+    if (bufferevent_enable(bev, EV_WRITE) < 0) {
+        fprintf(stderr, "Processing: cannot enable client event (write): %s; dropping client %s\n",
+                strerror(errno), client_name(&client->address, name));
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_INTERNAL);
+        return -1;
+    }
+
+    return 0;
 }
 
 static void worker_read_cb(struct bufferevent *bev, void *ctx) {
     client_ctx *client = (client_ctx *)ctx;
 
-    char tmp[CHUNK_SIZE];
-    size_t n;
-    while ((n = bufferevent_read(bev, tmp, CHUNK_SIZE)) > 0) {
-        if (buffer_append(client->read_buf, tmp, n) < 0) {
-            // overflow of remaining space
-            fprintf(stderr, "Too big request body: %s:%hu\n", inet_ntoa(client->address.sin_addr), client->address.sin_port);
-            bufferevent_free(bev);
-            free_client_ctx(client);
-            return;
-        }
+    if (client->linger_until != 0) {
+        client_drop_lingering(bev, client);
+        return;
     }
 
-    if (memmem(client->read_buf->data, client->read_buf->len, http_end_of_request, strlen(http_end_of_request)) != NULL) {
-        // fwrite(client->read_buf->data, 1, client->read_buf->len, stdout);
-        if ((client->response = http_handler(client->read_buf, client->cfg_static_root)) == NULL) {
-            fprintf(stderr, "Processing: cannot process http request (write): %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client->address.sin_addr), client->address.sin_port);
-            bufferevent_free(bev);
-            free_client_ctx(client);
-            return;
+    if (client->response != NULL || client->io_job != NULL) {
+        // previous response is still being written or prepared, pipelined request waits in input
+        return;
+    }
+
+    client_process_request(bev, client);
+}
+
+// worker_io_cb handles requests again when I/O pool has warmed everything they need,
+// this time file system calls are allowed: they hit caches.
+static void worker_io_cb(evutil_socket_t fd, short what, void *arg) {
+    (void)fd;
+    (void)what;
+    worker *w = (worker *)arg;
+    char name[CLIENT_NAME_LEN];
+    io_job *job = io_completions_take(&w->io_done);
+    while (job != NULL) {
+        io_job *next = job->next;
+        client_ctx *client = (client_ctx *)job->owner;
+        free(job);
+        job = next;
+        if (client == NULL) {
+            continue; // client has gone meanwhile
         }
-        buffer_clear(client->read_buf); // we always close connection, so we don't care about data after \r\n\r\n
-        if (bufferevent_enable(bev, EV_WRITE) < 0) {
-            fprintf(stderr, "Processing: cannot enable client event (write): %s; dropping client %s:%hu\n",
-                    strerror(errno), inet_ntoa(client->address.sin_addr), client->address.sin_port);
-            bufferevent_free(bev);
-            free_client_ctx(client);
+
+        client->io_job = NULL;
+        // request is still at the beginning of input, parser has stopped at its end
+        const char *data = (const char *)evbuffer_pullup(bufferevent_get_input(client->bev), client->parser.pos);
+        if (data == NULL) {
+            fprintf(stderr, "Processing: cannot read request: %s; dropping client %s\n",
+                    strerror(errno), client_name(&client->address, name));
+            bufferevent_free(client->bev);
+            free_client_ctx(client, CLOSE_INTERNAL);
+            continue;
         }
+        client_respond(client->bev, client, data, 0);
     }
 }
 
+// client_linger closes connection whose request body is left unread: writing side is shut down,
+// so client sees the end of the response, and its data is dropped until it closes too.
+static void client_linger(struct bufferevent *bev, client_ctx *client) {
+    static const struct timeval linger_timeout = { HTTP_LINGER_TIMEOUT, 0 };
+    if (shutdown(bufferevent_getfd(bev), SHUT_WR) < 0 || bufferevent_disable(bev, EV_WRITE) < 0 ||
+            bufferevent_set_timeouts(bev, &linger_timeout, NULL) < 0) {
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_DONE);
+        return;
+    }
+    client->linger_until = time(NULL) + HTTP_LINGER_TIMEOUT;
+    client->linger_left = HTTP_LINGER_MAX_BYTES;
+    client_drop_lingering(bev, client);
+}
+
+// client_drop_lingering drops what client has sent and closes connection once lingering is over.
+static void client_drop_lingering(struct bufferevent *bev, client_ctx *client) {
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t len = evbuffer_get_length(input);
+    evbuffer_drain(input, len);
+    if (len >= client->linger_left || time(NULL) >= client->linger_until) {
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_DONE);
+        return;
+    }
+    client->linger_left -= len;
+}
+
+// worker_write_cb is called when bufferevent output is drained, so current response is fully written.
 static void worker_write_cb(struct bufferevent *bev, void *ctx) {
     client_ctx *client = (client_ctx *)ctx;
+    char name[CLIENT_NAME_LEN];
+
+    if (client->response == NULL) {
+        return;
+    }
+    metrics_request_done(client->worker->metrics, client->response, client->request_start);
+    metrics_sub(&client->worker->metrics->load_queued_bytes, client->queued);
+    client->queued = 0;
+    if (client->log_pending) {
+        if (access_log_end(client->worker->access_log, &client->log_record, client->request_start,
+                metrics_now_ns()) < 0) {
+            metrics_add(&client->worker->metrics->log_dropped, 1);
+        }
+        client->log_pending = 0;
+    }
+    client->request_start = 0;
+    client->idle_since = time(NULL);
 
-    size_t headers_len = client->response->headers->len;
-    size_t body_len = client->response->body_len;
-    size_t wrote = client->wrote_bytes_to_socket;
-    // printf("headers %zu, body %zu, wrote %zu\n", headers_len, body_len, wrote);
-    if (wrote == (headers_len + body_len) /* end of write */) {
-        if (body_len != 0) {
-            bufferevent_write(bev, http_end_of_request, strlen(http_end_of_request));
+    if (!client->response->keep_alive) {
+        if (client->linger) {
+            http_response_free(client->response);
+            client->response = NULL;
+            client_linger(bev, client);
+            return;
         }
-        printf("End of write, closing connection %s:%hu\n", inet_ntoa(client->address.sin_addr), client->address.sin_port);
         bufferevent_free(bev);
-        free_client_ctx(client);
+        free_client_ctx(client, CLOSE_DONE);
         return;
     }
 
-    size_t chunk_size, left_to_write;
-    if (wrote < headers_len) {
-        // write headers
-        left_to_write = headers_len - wrote;
-        chunk_size = left_to_write < CHUNK_SIZE ? left_to_write : CHUNK_SIZE;
-        bufferevent_write(bev, client->response->headers->data + wrote, chunk_size);
-        client->wrote_bytes_to_socket += chunk_size;
-    } else {
-        // headers are written, write body
-        size_t body_wrote = wrote - headers_len;
-        left_to_write = body_len - body_wrote;
-        chunk_size = left_to_write < CHUNK_SIZE ? left_to_write : CHUNK_SIZE;
-        bufferevent_write(bev, client->response->body + body_wrote, chunk_size);
-        client->wrote_bytes_to_socket += chunk_size;
+    // keep-alive: reset state for the next request
+    http_response_free(client->response);
+    client->response = NULL;
+    if (bufferevent_disable(bev, EV_WRITE) < 0) {
+        fprintf(stderr, "Processing: cannot disable client event (write): %s; dropping client %s\n",
+                strerror(errno), client_name(&client->address, name));
+        bufferevent_free(bev);
+        free_client_ctx(client, CLOSE_INTERNAL);
+        return;
     }
+    client_process_request(bev, client);
 }
 
 //
 // client
 //
 
-static client_ctx *new_client_ctx(const struct sockaddr_in *inet_data, const char *static_root) {
-    client_ctx *ctx = calloc(1, sizeof(client_ctx));
+static client_ctx *new_client_ctx(worker *w, const struct sockaddr_in *inet_data) {
+    client_ctx *ctx = object_pool_get(&w->clients);
     if (ctx == NULL) {
         return NULL;
     }
+    memset(ctx, 0, sizeof(client_ctx));
+    metrics_add(&w->metrics->accepted, 1);
+    metrics_add(&w->metrics->load_active, 1);
     memcpy(&ctx->address, inet_data, sizeof(struct sockaddr_in));
+    ctx->worker = w;
+    ctx->cfg_static_root = w->cfg->static_root; // config outlives workers
 
-    if ((ctx->read_buf = buffer_new(MAX_REQUEST_BODY_SIZE)) == NULL) {
-        free(ctx);
-        return NULL;
-    }
+    ctx->max_header_size = w->cfg->max_header_size;
+    http_parser_init(&ctx->parser, ctx->max_header_size);
 
-    if ((ctx->cfg_static_root = strdup(static_root)) == NULL) {
-        buffer_free(ctx->read_buf);
-        free(ctx);
-        return NULL;
+    ctx->next = w->client_list;
+    if (w->client_list != NULL) {
+        w->client_list->prev = ctx;
     }
-
+    w->client_list = ctx;
     return ctx;
 }
 
-static void free_client_ctx(client_ctx *ctx) {
+static void free_client_ctx(client_ctx *ctx, enum metrics_close_reason reason) {
     if (ctx == NULL) {
         return;
     }
+    if (ctx->io_job != NULL) {
+        ctx->io_job->owner = NULL; // worker drops the job when it's done
+    }
+    worker *w = ctx->worker;
+    if (ctx->prev != NULL) {
+        ctx->prev->next = ctx->next;
+    } else {
+        w->client_list = ctx->next;
+    }
+    if (ctx->next != NULL) {
+        ctx->next->prev = ctx->prev;
+    }
+    metrics_add(&ctx->worker->metrics->closed[reason], 1);
+    metrics_sub(&ctx->worker->metrics->load_active, 1);
+    metrics_sub(&ctx->worker->metrics->load_queued_bytes, ctx->queued);
 
-    free(ctx->cfg_static_root);
-    buffer_free(ctx->read_buf);
     http_response_free(ctx->response);
-    free(ctx);
+    object_pool_put(&ctx->worker->clients, ctx);
 }
@@ -0,0 +1,1079 @@
+#include "uring.h"
+
+#include "accesslog.h"
+#include "parser.h"
+#include "pool.h"
+
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 1024 // provided receive buffers, power of two
+#define URING_BUF_SIZE 4096
+#define URING_PIPE_SIZE (1024 * 1024) // bytes spliced from file at once, if kernel allows
+#define URING_MAX_FREE_CONNS 4096
+#define CLIENT_IO_TIMEOUT 60 // same as libevent backend
+#define DRAIN_IDLE_TIMEOUT 1 // draining worker closes connections which wait for the next request that long
+
+// user_data of every SQE is connection pointer with operation in low bits,
+// connections are malloc'd so their pointers are aligned to 16 bytes; accept has listener index instead
+enum uring_op {
+    OP_ACCEPT = 0,
+    OP_TICK,
+    OP_RECV,
+    OP_SEND_HEADERS,
+    OP_SEND_BODY,
+    OP_SPLICE_IN, // file to pipe
+    OP_SPLICE_OUT, // pipe to socket
+    OP_IO_DONE, // I/O pool has finished jobs
+    OP_CANCEL, // of multishot accept on drain or of recv when stash is full
+};
+#define OP_MASK 15
+#define OP_BITS 4
+
+typedef struct uring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // SQEs are published on submit
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring; // same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *buf_data;
+    unsigned short buf_tail;
+} uring;
+
+typedef struct uring_conn {
+    int fd;
+    struct uring_conn *prev;
+    struct uring_conn *next;
+    time_t last_active;
+
+    http_parser parser;
+    char *in; // unparsed bytes: incomplete request, or pipelined ones waiting for the current response
+    size_t in_len;
+    size_t in_cap;
+    size_t body_left; // bytes of request body still to be dropped before the next request
+
+    io_job *io_job; // request waits for I/O pool, it's stashed in `in` until the job is done
+    http_response *response; // in flight
+    size_t queued; // bytes of response counted in worker's load
+    access_log_record log_record; // of the response in flight
+    int log_pending; // log_record is to be written
+    struct sockaddr_in address; // known only if access log is on
+    uint64_t request_start; // when the first bytes of current request were seen, 0 between requests
+    size_t headers_sent;
+    size_t body_sent;
+    int pipe[2]; // created for the first body spliced from file
+    size_t pipe_size;
+    size_t piped; // bytes in pipe not yet sent
+
+    int ops; // SQEs in flight, connection is freed only when it's 0
+    int send_ops; // part of ops which belongs to response chain
+    int recv_armed;
+    int recv_paused; // stash is full, recv waits until pipelined requests are answered
+    int send_failed;
+    int closing;
+    int served; // at least one response is sent, so the connection may be closed between requests
+    int linger; // request body is left unread, connection is closed with lingering after the response
+    time_t linger_until; // lingering has started, client's data is dropped until then
+    size_t linger_left; // bytes to drop before giving up on lingering
+} uring_conn;
+
+typedef struct uring_worker {
+    uring ring;
+    const int *listen_fds; // worker's own socket, then surplus ones inherited on upgrade
+    int listen_fds_len;
+    int listen_fds_owned; // closed when worker stops accepting
+    const int *stop; // set by main thread: 1 drains worker, 2 closes all its connections
+    int draining; // stop level worker has acted on
+    const serve_config *cfg;
+    http_pools *pools;
+    worker_metrics *metrics;
+    access_log_ring *access_log; // NULL if access log is off
+    io_pool *io_pool; // NULL if file system is used right in the loop
+    io_completions *io_done;
+
+    object_pool conns;
+    uring_conn *conn_list; // for idle timeouts
+    struct __kernel_timespec tick; // loop lag interval, once a second it does the periodic work
+    uint64_t tick_armed;
+    time_t tick_second;
+    time_t now;
+} uring_worker;
+
+static int uring_setup(uring *ring, unsigned entries);
+static void uring_destroy(uring *ring);
+static int uring_submit(uring *ring, unsigned wait);
+static struct io_uring_sqe *uring_get_sqe(uring *ring);
+
+static void worker_arm_accept(uring_worker *w, int listener);
+static void worker_close_listeners(uring_worker *w);
+static void worker_arm_tick(uring_worker *w);
+static void worker_arm_io(uring_worker *w);
+static void worker_handle(uring_worker *w, struct io_uring_cqe *cqe);
+static void conn_linger(uring_worker *w, uring_conn *conn);
+
+//
+// raw io_uring, liburing isn't required
+//
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_setup(uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(uring));
+
+    // only worker thread touches the ring, so kernel may run completions when we wait for them
+    static const unsigned setup_flags[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_COOP_TASKRUN,
+        0,
+    };
+    struct io_uring_params p;
+    for (size_t i = 0; i < sizeof(setup_flags) / sizeof(setup_flags[0]); i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = setup_flags[i];
+        if ((ring->fd = sys_io_uring_setup(entries, &p)) >= 0 || errno != EINVAL) {
+            break;
+        }
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_len > ring->sq_ring_len) {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            uring_destroy(ring);
+            return -1;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+// uring_setup_buffers registers provided buffer ring which multishot receives take buffers from.
+static int uring_setup_buffers(uring *ring, unsigned count, size_t size) {
+    ring->buf_ring_len = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+    if ((ring->buf_data = aligned_alloc(4096, count * size)) == NULL) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uintptr_t)ring->buf_ring,
+        .ring_entries = count,
+        .bgid = URING_BUF_GROUP,
+    };
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_buf *buf = &ring->buf_ring->bufs[i];
+        buf->addr = (uintptr_t)(ring->buf_data + i * size);
+        buf->len = size;
+        buf->bid = i;
+    }
+    ring->buf_tail = count;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// uring_recycle_buffer gives receive buffer back to kernel.
+static void uring_recycle_buffer(uring *ring, unsigned short bid) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+    buf->addr = (uintptr_t)(ring->buf_data + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_destroy(uring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    if (ring->buf_ring != NULL) {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+    free(ring->buf_data);
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+}
+
+// uring_submit publishes queued SQEs and waits for at least wait completions.
+static int uring_submit(uring *ring, unsigned wait) {
+    unsigned to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait == 0) {
+        return 0;
+    }
+    int r;
+    do {
+        r = sys_io_uring_enter(ring->fd, to_submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+// uring_get_sqe returns zeroed SQE, submitting queued ones first if SQ ring is full.
+static struct io_uring_sqe *uring_get_sqe(uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (uring_submit(ring, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    unsigned idx = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+int uring_probe() {
+    uring ring;
+    if (uring_setup(&ring, 8) < 0) {
+        return -1;
+    }
+    int r = uring_setup_buffers(&ring, 1, URING_BUF_SIZE);
+    int saved_errno = errno;
+    uring_destroy(&ring);
+    errno = saved_errno;
+    return r;
+}
+
+//
+// connections
+//
+
+static uint64_t op_data(uring_conn *conn, int op) {
+    return (uintptr_t)conn | op;
+}
+
+static void conn_free(uring_worker *w, uring_conn *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        w->conn_list = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+
+    close(conn->fd);
+    if (conn->pipe[0] >= 0) {
+        close(conn->pipe[0]);
+        close(conn->pipe[1]);
+    }
+    http_response_free(conn->response);
+    free(conn->in);
+    metrics_sub(&w->metrics->load_active, 1);
+    metrics_sub(&w->metrics->load_queued_bytes, conn->queued);
+    object_pool_put(&w->conns, conn);
+}
+
+// conn_close stops the connection: shutdown() completes its pending operations,
+// memory is released after the last of them. Reason is counted by the first call.
+static void conn_close(uring_worker *w, uring_conn *conn, enum metrics_close_reason reason) {
+    if (!conn->closing) {
+        conn->closing = 1;
+        metrics_add(&w->metrics->closed[reason], 1);
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    if (conn->ops == 0) {
+        conn_free(w, conn);
+    }
+}
+
+static uring_conn *conn_new(uring_worker *w, int fd) {
+    uring_conn *conn = object_pool_get(&w->conns);
+    if (conn == NULL) {
+        return NULL;
+    }
+    memset(conn, 0, sizeof(uring_conn));
+    metrics_add(&w->metrics->accepted, 1);
+    metrics_add(&w->metrics->load_active, 1);
+    conn->fd = fd;
+    conn->pipe[0] = conn->pipe[1] = -1;
+    conn->last_active = w->now;
+    http_parser_init(&conn->parser, w->cfg->max_header_size);
+
+    conn->next = w->conn_list;
+    if (w->conn_list != NULL) {
+        w->conn_list->prev = conn;
+    }
+    w->conn_list = conn;
+    return conn;
+}
+
+static int conn_arm_recv(uring_worker *w, uring_conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = op_data(conn, OP_RECV);
+    conn->ops++;
+    conn->recv_armed = 1;
+    return 0;
+}
+
+// conn_pause_recv stops reading from client which sends requests faster than responses go out,
+// as read watermark does in libevent backend. Bytes which are already received are still stashed.
+static void conn_pause_recv(uring_worker *w, uring_conn *conn) {
+    if (conn->recv_paused) {
+        return;
+    }
+    conn->recv_paused = 1;
+    if (!conn->recv_armed) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        return; // multishot goes on, stash grows
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = op_data(conn, OP_RECV);
+    sqe->user_data = OP_CANCEL;
+}
+
+// conn_resume_recv reads from client again once stashed requests fit the stash limit.
+static void conn_resume_recv(uring_worker *w, uring_conn *conn) {
+    if (!conn->recv_paused || conn->in_len > w->cfg->max_header_size * 2) {
+        return;
+    }
+    conn->recv_paused = 0;
+    if (!conn->recv_armed && conn_arm_recv(w, conn) < 0) {
+        conn_close(w, conn, CLOSE_INTERNAL);
+    }
+}
+
+// conn_stash keeps bytes not handled yet. Beyond max_header_size past the current request
+// recv is paused until the response is sent.
+static int conn_stash(uring_worker *w, uring_conn *conn, const char *data, size_t len) {
+    if (data == conn->in || len == 0) {
+        return 0; // already there
+    }
+    if (conn->in_len + len > w->cfg->max_header_size * 2) {
+        conn_pause_recv(w, conn); // client doesn't wait for responses
+    }
+    if (conn->in_len + len > conn->in_cap) {
+        size_t cap = conn->in_cap == 0 ? URING_BUF_SIZE : conn->in_cap;
+        while (cap < conn->in_len + len) {
+            cap *= 2;
+        }
+        char *in = realloc(conn->in, cap);
+        if (in == NULL) {
+            return -1;
+        }
+        conn->in = in;
+        conn->in_cap = cap;
+    }
+    memcpy(conn->in + conn->in_len, data, len);
+    conn->in_len += len;
+    return 0;
+}
+
+static int conn_send(uring_worker *w, uring_conn *conn);
+
+static struct io_uring_sqe *conn_send_sqe(uring_worker *w, uring_conn *conn, int op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        return NULL;
+    }
+    sqe->user_data = op_data(conn, op);
+    conn->ops++;
+    conn->send_ops++;
+    return sqe;
+}
+
+// conn_process handles request at the beginning of data: parses it in place and starts the response.
+// Bytes which aren't handled are stashed in conn->in, data may be conn->in itself.
+static void conn_respond(uring_worker *w, uring_conn *conn, const char *data, size_t len, int nonblocking);
+
+static void conn_process(uring_worker *w, uring_conn *conn, const char *data, size_t len) {
+    if (conn->response != NULL || conn->io_job != NULL || conn->closing) {
+        if (conn_stash(w, conn, data, len) < 0) {
+            conn_close(w, conn, CLOSE_INTERNAL);
+        }
+        return;
+    }
+    if (conn->body_left > 0 && len > 0) {
+        size_t body = len < conn->body_left ? len : conn->body_left;
+        if (data == conn->in) {
+            memmove(conn->in, conn->in + body, conn->in_len - body);
+            conn->in_len -= body;
+        } else {
+            data += body;
+        }
+        conn->body_left -= body;
+        len -= body;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (conn->request_start == 0) {
+        conn->request_start = metrics_now_ns();
+    }
+
+    int r = http_parser_execute(&conn->parser, data, len);
+    if (r == HTTP_PARSE_AGAIN) {
+        if (conn_stash(w, conn, data, len) < 0) {
+            conn_close(w, conn, CLOSE_INTERNAL);
+        }
+        return;
+    }
+    if (conn->parser.request.malformed || conn->parser.request.too_large) {
+        metrics_add(&w->metrics->parse_errors, 1);
+    }
+    conn_respond(w, conn, data, len, w->io_pool != NULL);
+}
+
+// conn_offload passes parsed request to I/O pool, it's handled again by worker_io_done() from conn->in.
+// Pending job holds the connection like an operation in flight. If job can't be allocated,
+// request is handled right away, blocking.
+static void conn_offload(uring_worker *w, uring_conn *conn, const char *data, size_t len) {
+    io_job *job = io_job_new(conn, w->io_done, w->cfg->static_root, data, conn->parser.pos, &conn->parser.request);
+    if (job == NULL) {
+        conn_respond(w, conn, data, len, 0);
+        return;
+    }
+    if (conn_stash(w, conn, data, len) < 0) {
+        free(job);
+        conn_close(w, conn, CLOSE_INTERNAL);
+        return;
+    }
+    conn->io_job = job;
+    conn->ops++;
+    metrics_add(&w->metrics->io_offloaded, 1);
+    io_pool_submit(w->io_pool, job);
+}
+
+// conn_respond handles complete request at the beginning of data and starts the response.
+// If nonblocking is set, request which needs file system is offloaded instead.
+static void conn_respond(uring_worker *w, uring_conn *conn, const char *data, size_t len, int nonblocking) {
+    if (w->draining) {
+        // response says Connection: close, so client sends the next request to the new process
+        conn->parser.request.connection_close = 1;
+        conn->parser.request.connection_keep_alive = 0;
+    }
+    if ((conn->response = http_handler(data, &conn->parser.request, w->cfg->static_root, w->pools,
+            nonblocking)) == NULL) {
+        if (errno == EWOULDBLOCK) {
+            conn_offload(w, conn, data, len);
+            return;
+        }
+        fprintf(stderr, "Processing: cannot process http request: %s; dropping client\n", strerror(errno));
+        conn_close(w, conn, CLOSE_INTERNAL);
+        return;
+    }
+    if (w->access_log != NULL) {
+        conn->log_pending = access_log_begin(w->access_log, &conn->log_record, &conn->address,
+            data, &conn->parser.request, conn->response);
+    }
+    // keep pipelined requests which are already read, body of this one is dropped before them
+    size_t request_len = conn->parser.pos;
+    conn->body_left = conn->response->keep_alive ? conn->parser.request.content_length : 0;
+    conn->linger = !conn->response->keep_alive &&
+        (conn->parser.request.transfer_encoding || conn->parser.request.content_length > 0);
+    http_parser_init(&conn->parser, w->cfg->max_header_size);
+    if (data == conn->in) {
+        memmove(conn->in, conn->in + request_len, conn->in_len - request_len);
+        conn->in_len -= request_len;
+    } else if (conn_stash(w, conn, data + request_len, len - request_len) < 0) {
+        conn_close(w, conn, CLOSE_INTERNAL);
+        return;
+    }
+
+    conn->headers_sent = 0;
+    conn->body_sent = 0;
+    conn->send_failed = 0;
+    conn->queued = conn->response->headers->len + conn->response->body_len;
+    metrics_add(&w->metrics->load_queued_bytes, conn->queued);
+    if (conn_send(w, conn) < 0) {
+        fprintf(stderr, "Processing: cannot queue response: %s; dropping client\n", strerror(errno));
+        conn_close(w, conn, CLOSE_INTERNAL);
+    }
+}
+
+static int conn_open_pipe(uring_conn *conn) {
+    if (pipe2(conn->pipe, O_CLOEXEC) < 0) {
+        conn->pipe[0] = conn->pipe[1] = -1;
+        return -1;
+    }
+    fcntl(conn->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE); // fine to stay with default size
+    int size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+    conn->pipe_size = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+// conn_send queues what is left of the response as one linked chain: headers, then body
+// from content cache or from file through the pipe. Linked send has MSG_WAITALL: kernel retries
+// partial send itself and fails the link only if it can't finish, so body never overtakes headers.
+// Short splice breaks the chain too; conn_send is called again when all of its operations complete.
+static int conn_send(uring_worker *w, uring_conn *conn) {
+    http_response *response = conn->response;
+    size_t headers_len = response->headers->len;
+    size_t body_left = response->body_len - conn->body_sent;
+    struct io_uring_sqe *sqe;
+
+    if (conn->headers_sent < headers_len) {
+        if ((sqe = conn_send_sqe(w, conn, OP_SEND_HEADERS)) == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uintptr_t)(response->headers->data + conn->headers_sent);
+        sqe->len = headers_len - conn->headers_sent;
+        sqe->msg_flags = MSG_NOSIGNAL | (body_left > 0 ? MSG_MORE | MSG_WAITALL : 0);
+        sqe->flags = body_left > 0 ? IOSQE_IO_LINK : 0;
+    }
+    if (body_left == 0) {
+        return 0;
+    }
+
+    if (response->body_blob != NULL) {
+        if ((sqe = conn_send_sqe(w, conn, OP_SEND_BODY)) == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = conn->fd;
+        sqe->addr = (uintptr_t)(response->body_blob->body + response->body_offset + conn->body_sent);
+        sqe->len = body_left;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        return 0;
+    }
+
+    if (conn->pipe[0] < 0 && conn_open_pipe(conn) < 0) {
+        return -1;
+    }
+    size_t chunk = conn->piped;
+    if (chunk == 0) {
+        // pipe is empty, fill it from file first
+        chunk = body_left < conn->pipe_size ? body_left : conn->pipe_size;
+        if ((sqe = conn_send_sqe(w, conn, OP_SPLICE_IN)) == NULL) {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = response->body_file->fd;
+        sqe->splice_off_in = response->body_offset + conn->body_sent;
+        sqe->fd = conn->pipe[1];
+        sqe->off = (uint64_t)-1;
+        sqe->len = chunk;
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    if ((sqe = conn_send_sqe(w, conn, OP_SPLICE_OUT)) == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = conn->pipe[0];
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->fd = conn->fd;
+    sqe->off = (uint64_t)-1;
+    sqe->len = chunk;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    return 0;
+}
+
+// conn_sent is called for every completion of response chain.
+static void conn_sent(uring_worker *w, uring_conn *conn, int op, int res) {
+    conn->ops--;
+    conn->send_ops--;
+    conn->last_active = w->now;
+    if (res < 0) {
+        if (res != -ECANCELED) { // canceled ones follow short transfer, they are just sent again
+            conn->send_failed = 1;
+        }
+    } else {
+        switch (op) {
+            case OP_SEND_HEADERS:
+                if (conn->headers_sent == 0 && res > 0) {
+                    metrics_observe(&w->metrics->ttfb, metrics_now_ns() - conn->request_start);
+                }
+                conn->headers_sent += res;
+                break;
+            case OP_SEND_BODY:
+                conn->body_sent += res;
+                break;
+            case OP_SPLICE_IN:
+                if (res == 0) {
+                    conn->send_failed = 1; // file was truncated
+                }
+                conn->piped += res;
+                break;
+            case OP_SPLICE_OUT:
+                conn->piped -= res;
+                conn->body_sent += res;
+                break;
+        }
+    }
+    if (conn->send_ops > 0) {
+        return; // rest of the chain is still running
+    }
+    if (conn->send_failed || conn->closing) {
+        conn_close(w, conn, CLOSE_ERROR);
+        return;
+    }
+
+    http_response *response = conn->response;
+    if (conn->headers_sent < response->headers->len || conn->body_sent < response->body_len) {
+        if (conn_send(w, conn) < 0) {
+            conn_close(w, conn, CLOSE_INTERNAL);
+        }
+        return;
+    }
+
+    metrics_request_done(w->metrics, response, conn->request_start);
+    metrics_sub(&w->metrics->load_queued_bytes, conn->queued);
+    conn->queued = 0;
+    if (conn->log_pending) {
+        if (access_log_end(w->access_log, &conn->log_record, conn->request_start, metrics_now_ns()) < 0) {
+            metrics_add(&w->metrics->log_dropped, 1);
+        }
+        conn->log_pending = 0;
+    }
+    conn->request_start = 0;
+    conn->served = 1;
+    int keep_alive = response->keep_alive;
+    http_response_free(response);
+    conn->response = NULL;
+    if (!keep_alive && conn->linger) {
+        conn_linger(w, conn);
+        return;
+    }
+    if (!keep_alive) {
+        conn_close(w, conn, CLOSE_DONE);
+        return;
+    }
+    conn->ops++; // handling may close connection, keep it until the end
+    conn_process(w, conn, conn->in, conn->in_len); // pipelined request
+    conn->ops--;
+    if (conn->closing) {
+        conn_close(w, conn, CLOSE_INTERNAL); // already counted
+        return;
+    }
+    conn_resume_recv(w, conn);
+}
+
+// conn_linger closes connection whose request body is left unread: writing side is shut down,
+// so client sees the end of the response, and its data is dropped until it closes too.
+static void conn_linger(uring_worker *w, uring_conn *conn) {
+    if (shutdown(conn->fd, SHUT_WR) < 0) {
+        conn_close(w, conn, CLOSE_DONE);
+        return;
+    }
+    conn->linger_until = w->now + HTTP_LINGER_TIMEOUT;
+    conn->linger_left = HTTP_LINGER_MAX_BYTES;
+    conn->in_len = 0; // stashed bytes are the body or requests which won't be answered
+    conn->recv_paused = 0;
+    if (!conn->recv_armed && conn_arm_recv(w, conn) < 0) {
+        conn_close(w, conn, CLOSE_INTERNAL);
+    }
+}
+
+// conn_drop_lingering drops len bytes client has sent and closes connection once lingering is over.
+static void conn_drop_lingering(uring_worker *w, uring_conn *conn, size_t len) {
+    if (len >= conn->linger_left || w->now >= conn->linger_until) {
+        conn_close(w, conn, CLOSE_DONE);
+        return;
+    }
+    conn->linger_left -= len;
+}
+
+static void conn_received(uring_worker *w, uring_conn *conn, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->ops--;
+        conn->recv_armed = 0;
+    }
+    conn->ops++; // handling may close connection, keep it until the end
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *data = w->ring.buf_data + (size_t)bid * URING_BUF_SIZE;
+        conn->last_active = w->now;
+        if (conn->linger_until != 0) {
+            conn_drop_lingering(w, conn, cqe->res);
+        } else if (conn->in_len > 0 && conn->response == NULL) {
+            // continue request which is already stashed
+            if (conn_stash(w, conn, data, cqe->res) < 0) {
+                conn_close(w, conn, CLOSE_INTERNAL);
+            } else {
+                conn_process(w, conn, conn->in, conn->in_len);
+            }
+        } else {
+            conn_process(w, conn, data, cqe->res);
+        }
+        uring_recycle_buffer(&w->ring, bid);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        conn_close(w, conn, conn->linger_until != 0 ? CLOSE_DONE : cqe->res == 0 ? CLOSE_EOF : CLOSE_ERROR);
+    }
+
+    conn->ops--;
+    if (conn->closing) {
+        conn_close(w, conn, CLOSE_INTERNAL); // already counted
+        return;
+    }
+    if (!conn->recv_armed && !conn->recv_paused && conn_arm_recv(w, conn) < 0) {
+        conn_close(w, conn, CLOSE_INTERNAL);
+    }
+}
+
+//
+// worker
+//
+
+static uint64_t accept_data(int listener) {
+    return (uint64_t)listener << OP_BITS | OP_ACCEPT;
+}
+
+static void worker_arm_accept(uring_worker *w, int listener) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        perror("Accept submit error");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listen_fds[listener];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = accept_data(listener);
+}
+
+static void worker_close_listeners(uring_worker *w) {
+    if (w->listen_fds_owned) {
+        for (int i = 0; i < w->listen_fds_len; i++) {
+            close(w->listen_fds[i]);
+        }
+        w->listen_fds_owned = 0;
+    }
+}
+
+static void worker_arm_tick(uring_worker *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        perror("Timer submit error");
+        return;
+    }
+    w->tick_armed = metrics_now_ns();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&w->tick;
+    sqe->len = 1;
+    sqe->user_data = OP_TICK;
+}
+
+// worker_arm_io watches eventfd of I/O completions with multishot poll.
+static void worker_arm_io(uring_worker *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    if (sqe == NULL) {
+        perror("I/O completion poll submit error");
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->io_done->fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = OP_IO_DONE;
+}
+
+// worker_io_done handles requests again when I/O pool has warmed everything they need,
+// this time file system calls are allowed: they hit caches.
+static void worker_io_done(uring_worker *w, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        worker_arm_io(w);
+    }
+    io_job *job = io_completions_take(w->io_done);
+    while (job != NULL) {
+        io_job *next = job->next;
+        uring_conn *conn = (uring_conn *)job->owner;
+        free(job);
+        job = next;
+
+        conn->io_job = NULL;
+        conn->ops--;
+        if (conn->closing) {
+            conn_close(w, conn, CLOSE_INTERNAL); // already counted
+            continue;
+        }
+        conn_respond(w, conn, conn->in, conn->in_len, 0);
+    }
+}
+
+// conn_idle tells that connection has been served and hasn't started the next request for a while.
+static int conn_idle(const uring_worker *w, const uring_conn *conn) {
+    return conn->served && w->now - conn->last_active >= DRAIN_IDLE_TIMEOUT &&
+        conn->response == NULL && conn->io_job == NULL && conn->in_len == 0 && conn->request_start == 0 &&
+        conn->body_left == 0 && conn->linger_until == 0;
+}
+
+// worker_drain cancels multishot accept and closes idle connections, the rest get Connection: close
+// with the next response; on level 2 all connections are closed right away.
+static void worker_drain(uring_worker *w, int level) {
+    if (!w->draining) {
+        for (int i = 0; i < w->listen_fds_len; i++) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+            if (sqe == NULL) {
+                perror("Accept cancel submit error");
+                continue;
+            }
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = accept_data(i);
+            sqe->user_data = OP_CANCEL;
+        }
+        worker_close_listeners(w); // accept in flight holds the socket until it's canceled
+    }
+    w->draining = level;
+    uring_conn *conn = w->conn_list;
+    while (conn != NULL) {
+        uring_conn *next = conn->next; // conn may be freed
+        if (!conn->closing && (level > 1 || conn_idle(w, conn))) {
+            conn_close(w, conn, level > 1 ? CLOSE_TIMEOUT : CLOSE_DONE);
+        }
+        conn = next;
+    }
+}
+
+// worker_tick runs every lag interval and counts how late it is, it also checks if main thread
+// stops the worker; once a second it refreshes Date header and drops idle connections,
+// draining worker drops them sooner.
+static void worker_tick(uring_worker *w) {
+    w->tick_armed = metrics_loop_lag(w->metrics, w->tick_armed);
+    int stop = __atomic_load_n(w->stop, __ATOMIC_ACQUIRE);
+    if (stop > w->draining) {
+        worker_drain(w, stop);
+    }
+    if (w->now == w->tick_second) {
+        worker_arm_tick(w);
+        return;
+    }
+    w->tick_second = w->now;
+    http_date_update(w->now);
+    uring_conn *conn = w->conn_list;
+    while (conn != NULL) {
+        uring_conn *next = conn->next; // conn may be freed
+        if (!conn->closing && conn->linger_until != 0 && w->now >= conn->linger_until) {
+            conn_close(w, conn, CLOSE_DONE);
+        } else if (!conn->closing && w->now - conn->last_active >= CLIENT_IO_TIMEOUT) {
+            conn_close(w, conn, CLOSE_TIMEOUT);
+        } else if (!conn->closing && w->draining && conn_idle(w, conn)) {
+            conn_close(w, conn, CLOSE_DONE);
+        }
+        conn = next;
+    }
+    worker_arm_tick(w);
+}
+
+static void worker_accepted(uring_worker *w, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !w->draining) {
+        worker_arm_accept(w, (int)(cqe->user_data >> OP_BITS));
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            fprintf(stderr, "Accept error: %s\n", strerror(-cqe->res));
+        }
+        return;
+    }
+
+    uring_conn *conn = conn_new(w, cqe->res);
+    if (conn == NULL) {
+        fprintf(stderr, "Memory error: client struct malloc error: %s; dropping client\n", strerror(errno));
+        close(cqe->res);
+        return;
+    }
+    if (w->access_log != NULL) {
+        // multishot accept has no place for peer address, it's asked only for the log
+        socklen_t addrlen = sizeof(conn->address);
+        getpeername(conn->fd, (struct sockaddr *)&conn->address, &addrlen);
+    }
+    if (conn_arm_recv(w, conn) < 0) {
+        conn_close(w, conn, CLOSE_INTERNAL);
+    }
+}
+
+static void worker_handle(uring_worker *w, struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & OP_MASK;
+    uring_conn *conn = (uring_conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    switch (op) {
+        case OP_ACCEPT:
+            worker_accepted(w, cqe);
+            break;
+        case OP_TICK:
+            w->now = time(NULL);
+            worker_tick(w);
+            break;
+        case OP_RECV:
+            conn_received(w, conn, cqe);
+            break;
+        case OP_IO_DONE:
+            worker_io_done(w, cqe);
+            break;
+        case OP_CANCEL:
+            break; // operation may have ended by itself meanwhile
+        default:
+            conn_sent(w, conn, op, cqe->res);
+    }
+}
+
+int uring_worker_loop(const int *listen_fds, int listen_fds_len, int listen_fds_owned, const serve_config *cfg,
+        http_pools *pools, worker_metrics *metrics, access_log_ring *access_log, io_pool *io_pool,
+        io_completions *io_done, const int *stop) {
+    uring_worker w = {
+        .listen_fds = listen_fds,
+        .listen_fds_len = listen_fds_len,
+        .listen_fds_owned = listen_fds_owned,
+        .stop = stop,
+        .cfg = cfg,
+        .pools = pools,
+        .metrics = metrics,
+        .access_log = access_log,
+        .io_pool = io_pool,
+        .io_done = io_done,
+        .tick = { .tv_nsec = METRICS_LOOP_LAG_INTERVAL_MS * 1000000 },
+        .now = time(NULL),
+    };
+    if (uring_setup(&w.ring, URING_ENTRIES) < 0) {
+        perror("io_uring setup error");
+        worker_close_listeners(&w);
+        return -1;
+    }
+    if (uring_setup_buffers(&w.ring, URING_BUF_COUNT, URING_BUF_SIZE) < 0) {
+        perror("io_uring buffer ring setup error");
+        uring_destroy(&w.ring);
+        worker_close_listeners(&w);
+        return -1;
+    }
+    object_pool_init(&w.conns, sizeof(uring_conn), URING_MAX_FREE_CONNS);
+    metrics->clients = &w.conns;
+    http_date_update(w.now);
+    w.tick_second = w.now;
+    for (int i = 0; i < listen_fds_len; i++) {
+        worker_arm_accept(&w, i);
+    }
+    worker_arm_tick(&w);
+    if (io_pool != NULL) {
+        worker_arm_io(&w);
+    }
+
+    int r = 0;
+    while (!w.draining || w.conn_list != NULL) {
+        if (uring_submit(&w.ring, 1) < 0 && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring enter error");
+            r = -1;
+            break;
+        }
+        w.now = time(NULL); // vDSO, no syscall
+
+        unsigned head = *w.ring.cq_head;
+        unsigned tail = __atomic_load_n(w.ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            worker_handle(&w, &w.ring.cqes[head & w.ring.cq_mask]);
+        }
+        __atomic_store_n(w.ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_destroy(&w.ring); // cancels the timer and poll still armed
+    object_pool_destroy(&w.conns);
+    worker_close_listeners(&w);
+    return r;
+}